@@ -0,0 +1,159 @@
+// FSLogCompress: Allocation-free LZ4 block compression for FSLogHandler
+// Company: Particle
+
+#include "FSLogCompress.h"
+#include <string.h>
+
+#define MIN_MATCH       4
+#define LAST_LITERALS   5       // LZ4 requires the block to end with at least this many literals
+#define MATCH_LIMIT     12      // ...and the last match to start at least this far from the end
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - FSLOG_LZ_HASH_BITS);
+}
+
+// Length fields above 15 continue in 255-valued bytes
+static inline uint8_t *putLength(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *putSequence(uint8_t *op, uint8_t *end, const uint8_t *literals, size_t literal_len, size_t offset, size_t match_len) {
+    size_t need = 1 + literal_len + literal_len / 255 + 1 + (offset ? 2 + match_len / 255 + 1 : 0);
+    if ((size_t)(end - op) < need) {
+        return nullptr;
+    }
+
+    uint8_t *token = op++;
+    *token = (uint8_t)((literal_len >= 15 ? 15 : literal_len) << 4);
+    if (literal_len >= 15) {
+        op = putLength(op, literal_len - 15);
+    }
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if (offset) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        match_len -= MIN_MATCH;
+        *token |= (uint8_t)(match_len >= 15 ? 15 : match_len);
+        if (match_len >= 15) {
+            op = putLength(op, match_len - 15);
+        }
+    }
+    return op;
+}
+
+size_t fslogCompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap, uint16_t *table) {
+    if (len > FSLOG_LZ_MAX_INPUT) {
+        return 0;
+    }
+    memset(table, 0, sizeof(uint16_t) << FSLOG_LZ_HASH_BITS);
+
+    uint8_t *op = dst;
+    uint8_t *end = dst + cap;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    while (ip + MATCH_LIMIT <= len) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = hash32(seq);
+        size_t ref = table[h];
+        table[h] = (uint16_t)ip;
+
+        if (ref >= ip || read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        size_t match_len = MIN_MATCH;
+        while (ip + match_len < len - LAST_LITERALS && src[ref + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+
+        op = putSequence(op, end, src + anchor, ip - anchor, ip - ref, match_len);
+        if (!op) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = putSequence(op, end, src + anchor, len - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+int fslogDecompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                literal_len += b;
+            } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < literal_len || (size_t)(oend - op) < literal_len) {
+            return -1;
+        }
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        if (ip >= iend) {
+            break;      // Last sequence has no match
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += MIN_MATCH;
+        if ((size_t)(oend - op) < match_len) {
+            return -1;
+        }
+
+        // Byte by byte, matches may overlap their own output
+        const uint8_t *match = op - offset;
+        while (match_len--) {
+            *op++ = *match++;
+        }
+    }
+    return (int)(op - dst);
+}
@@ -0,0 +1,38 @@
+// FSLogCompress: Allocation-free LZ4 block compression for FSLogHandler
+// Company: Particle
+//
+// Produces standard LZ4 block format (no frame), so compressed blocks can also be read with liblz4's
+// LZ4_decompress_safe().  Has no DeviceOS dependencies and is shared with the host-side tools.
+
+#ifndef __FSLOGCOMPRESS_H
+#define __FSLOGCOMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FSLOG_LZ_HASH_BITS      10      // Match finder table entries = 1 << FSLOG_LZ_HASH_BITS
+#define FSLOG_LZ_MAX_INPUT      0xFFFF  // Largest block, offsets and frame lengths are 16 bits
+
+// Worst-case compressed size for len input bytes
+#define FSLOG_LZ_BOUND(len)     ((len) + (len) / 255 + 16)
+
+/**
+ * @brief Compress one independent block
+ *
+ * @param src Input data, at most FSLOG_LZ_MAX_INPUT bytes
+ * @param len Input length
+ * @param dst Output buffer
+ * @param cap Output buffer size
+ * @param table Match finder scratch table of (1 << FSLOG_LZ_HASH_BITS) entries, owned by the caller
+ * @return Compressed size, or 0 if the output doesn't fit in cap (store the block uncompressed instead)
+ */
+size_t fslogCompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap, uint16_t *table);
+
+/**
+ * @brief Decompress one block produced by fslogCompress()
+ *
+ * @return Decompressed size, or -1 if the input is corrupt or doesn't fit in cap
+ */
+int fslogDecompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+#endif  //__FSLOGCOMPRESS_H
@@ -0,0 +1,23 @@
+// FSLogCrc: Table-driven CRC-32 for FSLogHandler journal records
+// Company: Particle
+//
+// Standard reflected CRC-32 (polynomial 0xEDB88320, as used by zlib and Ethernet), so records can be checked with any
+// common implementation.  Has no DeviceOS dependencies and is shared with the host-side tools.
+
+#ifndef __FSLOGCRC_H
+#define __FSLOGCRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Compute or continue a CRC-32
+ *
+ * @param data Input data
+ * @param len Input length
+ * @param crc Result of the previous call when checksumming data in pieces (optional, default is 0 to start a new CRC)
+ * @return CRC-32 of everything passed so far
+ */
+uint32_t fslogCrc32(const void *data, size_t len, uint32_t crc = 0);
+
+#endif  //__FSLOGCRC_H
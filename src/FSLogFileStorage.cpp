@@ -0,0 +1,255 @@
+// FSLogFileStorage: FSLogHandler storage in a logfile on the DeviceOS filesystem
+// Company: Particle
+
+#include "FSLogFileStorage.h"
+#include "FSLogFormat.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+void FSLogFileStorage::configure(const String &path, size_t capacity) {
+    if (strcmp(path.c_str(), _path.c_str()) == 0 && capacity == _capacity) {
+        return;
+    }
+    closeFile();
+    _path = path;
+    _capacity = capacity;
+    _end = 0;
+    _written = 0;
+}
+
+bool FSLogFileStorage::open() {
+    if (_writable) {
+        return true;
+    }
+    closeFile();
+    _fd = FSLOG_OPEN(_path, O_RDWR | O_CREAT);
+    if (_fd == -1) {
+        return false;
+    }
+    _writable = true;
+
+    if (_capacity) {
+        _fresh = !readHeader();
+        if (_fresh) {
+            // The only place a circular file changes size
+            _written = 0;
+            if (ftruncate(_fd, FSLOG_CIRC_DATA_OFFSET + _capacity) != 0 || !writeHeader()) {
+                closeFile();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    struct stat statbuf;
+    if (fstat(_fd, &statbuf) != 0 || lseek(_fd, statbuf.st_size, SEEK_SET) < 0) {
+        closeFile();
+        return false;
+    }
+    _end = statbuf.st_size;
+    _fresh = _end == 0;
+    return true;
+}
+
+int FSLogFileStorage::append(const void *data, size_t len) {
+    if (!_writable) {
+        errno = EBADF;
+        return -1;
+    }
+
+    const uint8_t *p = (const uint8_t *)data;
+    size_t done = 0;
+    while (done < len) {
+        size_t n = len - done;
+        int result;
+        if (_capacity) {
+            // Write at the head, wrapping to the start of the data region at the end
+            size_t head = (size_t)(_written % _capacity);
+            if (n > _capacity - head) {
+                n = _capacity - head;
+            }
+            result = lseek(_fd, FSLOG_CIRC_DATA_OFFSET + head, SEEK_SET) < 0 ? -1 : ::write(_fd, p + done, n);
+        } else {
+            result = ::write(_fd, p + done, n);
+        }
+        // After a short write the loop asks again, so a lasting failure comes back with its errno
+        if (result <= 0) {
+            if (result == 0) {
+                errno = ENOSPC;
+            }
+            break;
+        }
+        done += result;
+        if (_capacity) {
+            _written += result;
+        } else {
+            _end += result;
+        }
+    }
+    return done || !len ? (int)done : -1;
+}
+
+int FSLogFileStorage::sync() {
+    if (!_writable) {
+        errno = EBADF;
+        return -1;
+    }
+    if (_capacity && !writeHeader()) {
+        return -1;
+    }
+    return fsync(_fd);
+}
+
+void FSLogFileStorage::close() {
+    if (_writable && _capacity) {
+        writeHeader();
+    }
+    closeFile();    // Closing a file syncs it
+}
+
+int FSLogFileStorage::read(uint64_t *position, uint8_t *data, size_t len) {
+    if (!load()) {
+        if (errno != ENOENT) {
+            return -1;
+        }
+        *position = 0;  // Nothing logged yet, or cleared
+        return 0;
+    }
+
+    uint64_t pos = *position;
+    uint64_t available;
+    off_t offset;
+    if (_capacity) {
+        uint64_t oldest = _written > _capacity ? _written - _capacity : 0;
+        if (pos < oldest || pos > _written) {
+            pos = oldest;   // Overwritten, or from before the file was preallocated again
+        }
+        available = _written - pos;
+        if (available > _capacity - pos % _capacity) {
+            available = _capacity - pos % _capacity;
+        }
+        offset = (off_t)(FSLOG_CIRC_DATA_OFFSET + pos % _capacity);
+    } else {
+        if (pos > (uint64_t)_end) {
+            pos = 0;    // The file was truncated since
+        }
+        available = (uint64_t)_end - pos;
+        offset = (off_t)pos;
+    }
+
+    // Stop at a multiple of len, so a caller reading fixed size chunks gets aligned reads after the first
+    size_t n = len ? len - (size_t)(pos % len) : 0;
+    if (n > available) {
+        n = (size_t)available;
+    }
+    int result = n ? readAt(offset, data, n) : 0;
+    if (result < 0) {
+        return -1;
+    }
+    *position = pos + result;
+    return result;
+}
+
+void FSLogFileStorage::clear() {
+    closeFile();
+    unlink(_path.c_str());
+    _end = 0;
+    _written = 0;
+}
+
+long FSLogFileStorage::size() {
+    if (!load()) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (_capacity) {
+        return (long)(_written < _capacity ? _written : _capacity);
+    }
+    return (long)_end;
+}
+
+int FSLogFileStorage::readAt(off_t offset, void *data, size_t len) {
+    if (_fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+    if (lseek(_fd, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    int result = ::read(_fd, data, len);
+    if (_writable && !_capacity) {
+        int error = errno;
+        lseek(_fd, _end, SEEK_SET);     // Back to where appends go
+        errno = error;
+    }
+    return result;
+}
+
+bool FSLogFileStorage::truncate(off_t length) {
+    if (!_writable || _capacity) {
+        errno = EBADF;
+        return false;
+    }
+    if (ftruncate(_fd, length) != 0 || lseek(_fd, length, SEEK_SET) < 0) {
+        return false;
+    }
+    _end = length;
+    return true;
+}
+
+// Open read-only if open() hasn't been called, so the log can be read before anything is appended this session
+bool FSLogFileStorage::load() {
+    if (_fd != -1) {
+        return true;
+    }
+    _fd = ::open(_path, O_RDONLY);
+    if (_fd == -1) {
+        return false;
+    }
+    if (_capacity) {
+        if (!readHeader()) {
+            _written = 0;
+        }
+        return true;
+    }
+    struct stat statbuf;
+    if (fstat(_fd, &statbuf) != 0) {
+        closeFile();
+        return false;
+    }
+    _end = statbuf.st_size;
+    return true;
+}
+
+void FSLogFileStorage::closeFile() {
+    if (_fd != -1) {
+        int error = errno;
+        ::close(_fd);
+        errno = error;
+    }
+    _fd = -1;
+    _writable = false;
+}
+
+// A header is only valid for the configured capacity, anything else means the file has to be preallocated again
+bool FSLogFileStorage::readHeader() {
+    uint8_t header[FSLOG_CIRC_HEADER_SIZE];
+    uint32_t capacity;
+    if (lseek(_fd, 0, SEEK_SET) < 0 || ::read(_fd, header, sizeof(header)) != sizeof(header) ||
+            memcmp(header, FSLOG_CIRC_MAGIC, 4) != 0 || header[4] != FSLOG_CIRC_VERSION) {
+        return false;
+    }
+    memcpy(&capacity, header + 8, sizeof(capacity));
+    if (capacity != _capacity) {
+        return false;
+    }
+    memcpy(&_written, header + 16, sizeof(_written));
+    return true;
+}
+
+bool FSLogFileStorage::writeHeader() {
+    uint8_t header[FSLOG_CIRC_HEADER_SIZE] = { 'F', 'S', 'L', 'C', FSLOG_CIRC_VERSION };
+    uint32_t capacity = _capacity;
+    memcpy(header + 8, &capacity, sizeof(capacity));
+    memcpy(header + 16, &_written, sizeof(_written));
+    return lseek(_fd, 0, SEEK_SET) == 0 && ::write(_fd, header, sizeof(header)) == sizeof(header);
+}
@@ -0,0 +1,90 @@
+// FSLogFileStorage: FSLogHandler storage in a logfile on the DeviceOS filesystem
+// Company: Particle
+//
+// The default backend of FSLogHandler: the plain, rotated and journal layouts append to a regular file, the circular
+// layout wraps within a preallocated one (see FSLogFormat.h).  FSLogHandler picks the file and layout with configure();
+// truncating the file at boot or after a journal's torn tail is left to the handler, which knows the layout.
+
+#ifndef __FSLOGFILESTORAGE_H
+#define __FSLOGFILESTORAGE_H
+
+#include "Particle.h"
+#include "FSLogStorage.h"
+
+// open() for files the library may create.  The DeviceOS filesystem takes no file mode; builds against a POSIX open(),
+// such as tools/host, define FSLOG_OPEN_MODE to pass one.
+#ifdef FSLOG_OPEN_MODE
+#define FSLOG_OPEN(path, flags) ::open(path, flags, FSLOG_OPEN_MODE)
+#else
+#define FSLOG_OPEN(path, flags) ::open(path, flags)
+#endif
+
+/**
+ * @brief Logfile on the DeviceOS filesystem, either appended to or circular
+ *
+ * In a regular file a position is a file offset.  In a circular file it is a logical offset, counting every byte ever
+ * written, so it survives wrap-arounds; the header recording how much was written is updated by sync() and close().
+ */
+class FSLogFileStorage : public FSLogStorage {
+public:
+    FSLogFileStorage() : _fd(-1), _writable(false), _fresh(false), _capacity(0), _end(0), _written(0) {}
+    ~FSLogFileStorage() { close(); }
+
+    /**
+	 * @brief Select the file.  Closes the file if it is a different one; call while it isn't open for appending.
+     *
+     * @param path Full path of the logfile
+     * @param capacity Size of the circular data region, or 0 for a regular file
+	 */
+    void configure(const String &path, size_t capacity);
+
+    /**
+	 * @brief Open for appending, after the data already in the file.  A circular file with a different capacity, or
+     * without a valid header, is preallocated from scratch.
+	 */
+    bool open() override;
+    int append(const void *data, size_t len) override;
+    int sync() override;
+    void close() override;
+    int read(uint64_t *position, uint8_t *data, size_t len) override;
+    void clear() override;
+    long size() override;
+
+    /**
+	 * @brief Whether the last open() started from an empty or newly preallocated file
+	 */
+    bool fresh() const { return _fresh; };
+
+    /**
+	 * @brief Where the next append lands: the file size, or the head of the circular data region
+	 */
+    off_t end() const { return _capacity ? (off_t)(_written % _capacity) : _end; };
+
+    /**
+	 * @brief Read from a regular file at an offset, for layouts that scan what they wrote.  Only while open.
+     *
+     * @return Number of bytes read, or -1 with errno set
+	 */
+    int readAt(off_t offset, void *data, size_t len);
+
+    /**
+	 * @brief Cut a regular file to length and append from there.  Only while open.
+	 */
+    bool truncate(off_t length);
+
+private:
+    String _path;                   // Full logfile path
+    int _fd;                        // File descriptor, -1 if not open
+    bool _writable;                 // _fd was opened by open(), rather than read-only by read()
+    bool _fresh;                    // See fresh()
+    size_t _capacity;               // Circular data region size, 0 for a regular file
+    off_t _end;                     // Size of a regular file
+    uint64_t _written;              // Total bytes written to a circular file, the head is _written % _capacity
+
+    bool load();
+    void closeFile();
+    bool readHeader();
+    bool writeHeader();
+};
+
+#endif  //__FSLOGFILESTORAGE_H
@@ -0,0 +1,362 @@
+// FSLogFlashStorage: Log-structured FSLogHandler storage on a raw flash region
+// Company: Particle
+
+#include "FSLogFlashStorage.h"
+#include "FSLogCrc.h"
+#include "FSLogFormat.h"
+#include <errno.h>
+#include <string.h>
+
+// A sector with less room than this left is closed rather than given a tiny chunk
+#define FLASH_MIN_CHUNK 32
+
+FSLogFlashStorage::FSLogFlashStorage(FSLogFlash &flash, uint32_t address, size_t sector_size, size_t sectors,
+        size_t erase_ahead) :
+        _flash(flash), _address(address), _sector_size(sector_size), _sectors(sectors), _mounted(false), _oldest_seq(sectors),
+        _head_seq(sectors), _offset(0), _erased(0) {
+    // Sequences start at the sector count so that every one maps to its sector and none is 0
+    _erase_ahead = sectors && erase_ahead >= sectors ? sectors - 1 : erase_ahead;
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+bool FSLogFlashStorage::open() {
+    return mount();
+}
+
+// Find the oldest and newest sectors from their headers, and the end of the data in the newest
+bool FSLogFlashStorage::mount() {
+    if (_mounted) {
+        return true;
+    }
+    if (_sectors < 2 || _sector_size > 65536 ||
+            _sector_size < FSLOG_FLASH_HEADER_SIZE + FSLOG_FLASH_CHUNK_HEADER_SIZE + FLASH_MIN_CHUNK) {
+        return false;
+    }
+
+    bool found = false;
+    uint32_t oldest = 0;
+    uint32_t newest = 0;
+    for (uint32_t i = 0; i < _sectors; i++) {
+        uint32_t seq;
+        if (!readHeader(i, &seq)) {
+            continue;
+        }
+        if (!found || seq < oldest) {
+            oldest = seq;
+        }
+        if (!found || seq > newest) {
+            newest = seq;
+        }
+        found = true;
+    }
+
+    _erased = 0;    // Nothing is known about the sectors ahead until maintain() checks them
+    if (found) {
+        _head_seq = newest;
+        _oldest_seq = newest - oldest >= _sectors ? newest - _sectors + 1 : oldest;
+        _offset = findEnd(newest);
+    } else {
+        // Empty, keep the current sequence so positions from before a clear() aren't mistaken for new data
+        _oldest_seq = _head_seq;
+        _offset = 0;
+    }
+    _mounted = true;
+    return true;
+}
+
+int FSLogFlashStorage::append(const void *data, size_t len) {
+    if (!mount()) {
+        errno = EIO;
+        return -1;
+    }
+
+    const uint8_t *p = (const uint8_t *)data;
+    size_t done = 0;
+    while (done < len) {
+        if (!_offset || _sector_size - _offset < FSLOG_FLASH_CHUNK_HEADER_SIZE + FLASH_MIN_CHUNK) {
+            if (!startSector()) {
+                break;
+            }
+        }
+
+        size_t n = len - done;
+        size_t room = _sector_size - _offset - FSLOG_FLASH_CHUNK_HEADER_SIZE;
+        if (n > room) {
+            n = room;
+        }
+        if (n > FSLOG_FLASH_ERASED_LEN - 1) {
+            n = FSLOG_FLASH_ERASED_LEN - 1;
+        }
+        uint8_t header[FSLOG_FLASH_CHUNK_HEADER_SIZE];
+        uint16_t chunk_len = (uint16_t)n;
+        uint32_t crc = fslogCrc32(p + done, n);
+        memcpy(header, &chunk_len, sizeof(chunk_len));
+        memcpy(header + 2, &crc, sizeof(crc));
+
+        uint32_t address = sectorAddress(_head_seq) + _offset;
+        if (!program(address, header, sizeof(header)) || !program(address + sizeof(header), p + done, n)) {
+            _offset = _sector_size;     // Never program after a torn chunk, readers stop there
+            break;
+        }
+        _offset += FSLOG_FLASH_CHUNK_HEADER_SIZE + n;
+        done += n;
+    }
+
+    if (done < len) {
+        errno = EIO;
+        return done ? (int)done : -1;
+    }
+    return (int)len;
+}
+
+// Positions are <u32 sequence><u16 chunk offset in the sector><u16 bytes of the chunk already read>
+int FSLogFlashStorage::read(uint64_t *position, uint8_t *data, size_t len) {
+    if (!mount()) {
+        return -1;
+    }
+
+    uint32_t seq = (uint32_t)(*position >> 32);
+    uint32_t offset = (uint32_t)(*position >> 16) & 0xFFFF;
+    uint32_t skip = (uint32_t)*position & 0xFFFF;
+    if (seq < _oldest_seq || seq > _head_seq + 1 || offset < FSLOG_FLASH_HEADER_SIZE) {
+        // New read, overwritten, or from before a clear()
+        seq = _oldest_seq;
+        offset = FSLOG_FLASH_HEADER_SIZE;
+        skip = 0;
+    }
+
+    size_t total = 0;
+    while (total < len && seq <= _head_seq) {
+        int chunk = 0;
+        if (offset > FSLOG_FLASH_HEADER_SIZE || validHeader(seq)) {
+            chunk = checkChunk(seq, offset);
+        }
+        if (chunk <= 0) {
+            if (chunk == 0 && seq == _head_seq) {
+                break;  // Caught up with the writer
+            }
+            // End of the sector, a torn chunk, or a sector that was never finished
+            seq++;
+            offset = FSLOG_FLASH_HEADER_SIZE;
+            skip = 0;
+            continue;
+        }
+
+        size_t n = (size_t)chunk - skip;
+        if (n > len - total) {
+            n = len - total;
+        }
+        if (_flash.read(sectorAddress(seq) + offset + FSLOG_FLASH_CHUNK_HEADER_SIZE + skip, data + total, n)) {
+            _stats.errors++;
+            break;
+        }
+        total += n;
+        skip += n;
+        if (skip == (uint32_t)chunk) {
+            offset += FSLOG_FLASH_CHUNK_HEADER_SIZE + chunk;
+            skip = 0;
+            if (offset + FSLOG_FLASH_CHUNK_HEADER_SIZE > _sector_size) {
+                seq++;
+                offset = FSLOG_FLASH_HEADER_SIZE;
+            }
+        }
+    }
+
+    *position = (uint64_t)seq << 32 | offset << 16 | skip;
+    return (int)total;
+}
+
+void FSLogFlashStorage::clear() {
+    mount();
+    for (uint32_t i = 0; i < _sectors; i++) {
+        uint32_t seq;
+        if (readHeader(i, &seq)) {
+            if (_flash.eraseSector(_address + i * _sector_size)) {
+                _stats.errors++;
+            } else {
+                _stats.erases++;
+            }
+        }
+    }
+    // Start past every sequence used so far, so saved positions read from the new start
+    _head_seq = nextStart() + _sectors;
+    _oldest_seq = _head_seq;
+    _offset = 0;
+    _erased = 0;
+}
+
+long FSLogFlashStorage::size() {
+    if (!mount()) {
+        return -1;
+    }
+
+    long total = 0;
+    for (uint32_t seq = _oldest_seq; seq <= _head_seq; seq++) {
+        if (!validHeader(seq)) {
+            continue;
+        }
+        uint32_t end = seq == _head_seq && _offset ? _offset : _sector_size;
+        uint32_t offset = FSLOG_FLASH_HEADER_SIZE;
+        while (offset + FSLOG_FLASH_CHUNK_HEADER_SIZE <= end) {
+            uint16_t len;
+            if (_flash.read(sectorAddress(seq) + offset, &len, sizeof(len))) {
+                _stats.errors++;
+                return -1;
+            }
+            if (len == 0 || len == FSLOG_FLASH_ERASED_LEN || offset + FSLOG_FLASH_CHUNK_HEADER_SIZE + len > end) {
+                break;
+            }
+            total += len;
+            offset += FSLOG_FLASH_CHUNK_HEADER_SIZE + len;
+        }
+    }
+    return total;
+}
+
+// Check or erase one sector ahead of the head per call, so an erase never lands on an append
+void FSLogFlashStorage::maintain() {
+    if (!_mounted || _erased >= _erase_ahead) {
+        return;
+    }
+    if (prepare(nextStart() + _erased)) {
+        _erased++;
+    }
+}
+
+bool FSLogFlashStorage::readHeader(uint32_t index, uint32_t *seq) {
+    uint8_t header[FSLOG_FLASH_HEADER_SIZE];
+    if (_flash.read(_address + index * _sector_size, header, sizeof(header))) {
+        _stats.errors++;
+        return false;
+    }
+    memcpy(seq, header + 4, sizeof(*seq));
+    return memcmp(header, FSLOG_FLASH_MAGIC, 4) == 0 && *seq % _sectors == index && *seq >= _sectors;
+}
+
+// Whether the sector for seq holds that sequence, rather than an older lap or nothing
+bool FSLogFlashStorage::validHeader(uint32_t seq) {
+    uint32_t found;
+    return readHeader(seq % _sectors, &found) && found == seq;
+}
+
+// Returns the data length of the chunk at offset, 0 if the sector ends there, or -1 if the chunk is torn
+int FSLogFlashStorage::checkChunk(uint32_t seq, uint32_t offset) {
+    if (offset + FSLOG_FLASH_CHUNK_HEADER_SIZE > _sector_size) {
+        return 0;
+    }
+    uint32_t address = sectorAddress(seq) + offset;
+    uint8_t header[FSLOG_FLASH_CHUNK_HEADER_SIZE];
+    if (_flash.read(address, header, sizeof(header))) {
+        _stats.errors++;
+        return -1;
+    }
+    uint16_t len;
+    uint32_t crc;
+    memcpy(&len, header, sizeof(len));
+    memcpy(&crc, header + 2, sizeof(crc));
+    if (len == FSLOG_FLASH_ERASED_LEN && crc == 0xFFFFFFFF) {
+        return 0;
+    }
+    if (len == 0 || len == FSLOG_FLASH_ERASED_LEN || offset + FSLOG_FLASH_CHUNK_HEADER_SIZE + len > _sector_size) {
+        return -1;
+    }
+
+    uint8_t buf[64];
+    uint32_t check = 0;
+    for (uint32_t done = 0; done < len; ) {
+        uint32_t n = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        if (_flash.read(address + sizeof(header) + done, buf, n)) {
+            _stats.errors++;
+            return -1;
+        }
+        check = fslogCrc32(buf, n, check);
+        done += n;
+    }
+    return check == crc ? len : -1;
+}
+
+// Offset after the last good chunk, or the sector size if the data ends in a torn chunk
+uint32_t FSLogFlashStorage::findEnd(uint32_t seq) {
+    uint32_t offset = FSLOG_FLASH_HEADER_SIZE;
+    for (;;) {
+        int chunk = checkChunk(seq, offset);
+        if (chunk == 0) {
+            return offset;
+        }
+        if (chunk < 0) {
+            _stats.torn_chunks++;
+            return _sector_size;
+        }
+        offset += FSLOG_FLASH_CHUNK_HEADER_SIZE + chunk;
+    }
+}
+
+bool FSLogFlashStorage::isErased(uint32_t seq) {
+    uint32_t address = sectorAddress(seq);
+    uint8_t buf[64];
+    for (uint32_t done = 0; done < _sector_size; done += sizeof(buf)) {
+        uint32_t n = _sector_size - done < sizeof(buf) ? _sector_size - done : sizeof(buf);
+        if (_flash.read(address + done, buf, n)) {
+            _stats.errors++;
+            return false;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            if (buf[i] != 0xFF) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Get the sector for seq ready to be started.  Its previous lap is given up, and with it everything older.
+bool FSLogFlashStorage::prepare(uint32_t seq) {
+    if (seq - _sectors + 1 > _oldest_seq) {
+        _oldest_seq = seq - _sectors + 1;
+    }
+    if (isErased(seq)) {
+        return true;
+    }
+    if (_flash.eraseSector(sectorAddress(seq))) {
+        _stats.errors++;
+        return false;
+    }
+    _stats.erases++;
+    return true;
+}
+
+// Move the head to the next sector and write its header
+bool FSLogFlashStorage::startSector() {
+    if (_offset) {
+        _head_seq++;
+        _offset = 0;
+    }
+    if (_erased) {
+        _erased--;
+    } else {
+        _stats.erase_stalls++;
+        if (!prepare(_head_seq)) {
+            return false;
+        }
+    }
+
+    uint8_t header[FSLOG_FLASH_HEADER_SIZE];
+    memcpy(header, FSLOG_FLASH_MAGIC, 4);
+    memcpy(header + 4, &_head_seq, sizeof(_head_seq));
+    if (!program(sectorAddress(_head_seq), header, sizeof(header))) {
+        _offset = _sector_size;     // Unusable until erased on the next lap
+        return false;
+    }
+    _offset = FSLOG_FLASH_HEADER_SIZE;
+    return true;
+}
+
+bool FSLogFlashStorage::program(uint32_t address, const void *data, size_t len) {
+    _stats.programs++;
+    if (_flash.program(address, data, len)) {
+        _stats.errors++;
+        return false;
+    }
+    _stats.bytes_programmed += len;
+    return true;
+}
@@ -0,0 +1,104 @@
+// FSLogFlashStorage: Log-structured FSLogHandler storage on a raw flash region
+// Company: Particle
+//
+// Appends go straight to erased flash as CRC checked chunks, so a small append costs one program and no filesystem
+// metadata.  The sector layout is described in FSLogFormat.h.  Has no DeviceOS dependencies: the flash itself is reached
+// through FSLogFlash, so the same code runs on a device (e.g. over an SPI NOR driver) and on a host against a file-backed
+// emulator (see tools/fslog_bench.cpp).
+
+#ifndef __FSLOGFLASHSTORAGE_H
+#define __FSLOGFLASHSTORAGE_H
+
+#include "FSLogStorage.h"
+
+/**
+ * @brief NOR flash access used by FSLogFlashStorage.  Programming can only clear bits, and erasing a sector sets all of
+ * its bytes to 0xFF.  Every method returns 0 on success or a negative error code.
+ */
+class FSLogFlash {
+public:
+    virtual ~FSLogFlash() {}
+    virtual int read(uint32_t address, void *data, size_t len) = 0;
+    virtual int program(uint32_t address, const void *data, size_t len) = 0;
+    virtual int eraseSector(uint32_t address) = 0;
+};
+
+/**
+ * @brief Circular log over a region of whole flash sectors
+ *
+ * Data is programmed as soon as it is appended, so sync() has nothing to do.  When the head sector fills, the log moves
+ * on to the next one, overwriting the oldest data once the region has wrapped.  maintain() keeps a few sectors ahead of
+ * the head erased, so appends rarely wait for an erase; the data in those sectors is given up early.  Not thread safe,
+ * FSLogHandler serializes all calls.
+ */
+class FSLogFlashStorage : public FSLogStorage {
+public:
+    /**
+	 * @brief Flash counters, see stats()
+	 */
+    struct Stats {
+        uint32_t erases;            // Sectors erased
+        uint32_t erase_stalls;      // Erases (or erased checks) done by append() because maintain() hadn't got there yet
+        uint32_t programs;          // Program calls, two per chunk
+        uint64_t bytes_programmed;  // Bytes programmed, including sector and chunk headers
+        uint32_t torn_chunks;       // Chunks with a bad CRC found at the end of the log when it was opened
+        uint32_t errors;            // Failed flash operations
+    };
+
+    /**
+	 * @brief Constructor
+     *
+     * @param flash Flash device, must outlive the storage
+     * @param address Start of the region, sector aligned
+     * @param sector_size Erase sector size, up to 65536
+     * @param sectors Number of sectors in the region, at least 2
+     * @param erase_ahead Sectors maintain() keeps erased ahead of the head (optional, default is 1)
+	 */
+    FSLogFlashStorage(FSLogFlash &flash, uint32_t address, size_t sector_size, size_t sectors, size_t erase_ahead = 1);
+
+    bool open() override;
+    int append(const void *data, size_t len) override;
+    int sync() override { return 0; };
+    void close() override { _mounted = false; };
+    int read(uint64_t *position, uint8_t *data, size_t len) override;
+    void clear() override;
+    void maintain() override;
+
+    /**
+	 * @brief Count the data bytes from the chunk headers of every sector in use.  CRCs aren't checked, so a chunk torn
+     * by a power cut is counted until its sector is reused.
+	 */
+    long size() override;
+
+    /**
+	 * @brief Get the flash counters
+	 */
+    Stats stats() { return _stats; };
+
+private:
+    FSLogFlash &_flash;
+    uint32_t _address;              // Start of the region
+    uint32_t _sector_size;          // Erase sector size
+    uint32_t _sectors;              // Sectors in the region
+    uint32_t _erase_ahead;          // Sectors to keep erased ahead of the head
+    bool _mounted;                  // The region has been scanned since the last close()
+    uint32_t _oldest_seq;           // Sequence of the oldest sector holding data
+    uint32_t _head_seq;             // Sequence of the sector being appended to
+    uint32_t _offset;               // Append offset in the head sector, 0 if its header isn't programmed yet
+    uint32_t _erased;               // Sectors known to be erased, starting with the next one to be started
+    Stats _stats;                   // See stats()
+
+    bool mount();
+    uint32_t sectorAddress(uint32_t seq) { return _address + (seq % _sectors) * _sector_size; };
+    uint32_t nextStart() { return _offset ? _head_seq + 1 : _head_seq; };
+    bool readHeader(uint32_t index, uint32_t *seq);
+    bool validHeader(uint32_t seq);
+    int checkChunk(uint32_t seq, uint32_t offset);
+    uint32_t findEnd(uint32_t seq);
+    bool isErased(uint32_t seq);
+    bool prepare(uint32_t seq);
+    bool startSector();
+    bool program(uint32_t address, const void *data, size_t len);
+};
+
+#endif  //__FSLOGFLASHSTORAGE_H
@@ -0,0 +1,236 @@
+// FSLogFormat: On-flash binary log format shared by FSLogHandler and the host-side tools
+// Company: Particle
+//
+// This header has no DeviceOS dependencies so it can be included by host tools (see tools/fslog_decode.cpp).
+//
+// A binary log file starts with an 8 byte header:
+//
+//   "FSLB" <version> <flags> 0x00 0x00
+//
+// followed by a stream of records.  Every record starts with a tag byte.  The low nibble of the tag is the log level
+// divided by 10 (TRACE = 0, INFO = 3, WARN = 4, ERROR = 5, PANIC = 6), or 0xF for a definition record.
+//
+// Log record, the high nibble of the tag holds FSLOG_BIN_HAS_* flags:
+//   [tag]
+//   [zigzag varint time delta from the previous record]          if FSLOG_BIN_HAS_TIME
+//   [varint category id]                                         if FSLOG_BIN_HAS_CATEGORY
+//   [varint call-site id]                                        if FSLOG_BIN_HAS_CALLSITE
+//   [attr flags byte][zigzag varint code][varint len][details]   if FSLOG_BIN_HAS_ATTRS, code/details only if flagged
+//   [varint len][message]
+//
+// Category definition, emitted once per file before the first record that uses the id:
+//   [FSLOG_BIN_DEF_CATEGORY][varint id][varint len][name]
+//
+// Call-site definition:
+//   [FSLOG_BIN_DEF_CALLSITE][varint id][flags byte][varint len][file][zigzag varint line][varint len][function]
+//   where flags are FSLOG_BIN_CALLSITE_* and absent fields are written as zero
+//
+// Tokenized record, written by FSLOG_TOKEN().  The format string is not stored; the token is the fslogHash() of it and the
+// host rebuilds the text from the token database in the firmware ELF (section "fslog_tokens"):
+//   [FSLOG_BIN_TOKEN][flags byte: level nibble | FSLOG_BIN_HAS_TIME | FSLOG_BIN_HAS_CATEGORY]
+//   [zigzag varint time delta]                                   if FSLOG_BIN_HAS_TIME
+//   [varint category id]                                         if FSLOG_BIN_HAS_CATEGORY
+//   [varint token][varint len][packed arguments]
+// Arguments are packed in order: integers as zigzag varints (64 bit), floating point as 4 byte little endian floats,
+// strings as [varint len][bytes].
+//
+// Ids start at 1.  When the device runs out of interning slots it writes id 0 in the log record, immediately followed
+// by the definition body (everything after the id above) inline.
+//
+// Compressed logfiles (FSLogHandler::configureCompression()) start with an 8 byte header:
+//
+//   "FSLZ" <version> 0x00 0x00 0x00
+//
+// followed by independently decodable frames, one per write block:
+//
+//   [FSLOG_Z_FRAME_MAGIC][type][u16 LE raw length][u16 LE data length][data]
+//
+// type is FSLOG_Z_STORED (data is the raw bytes, used when compression doesn't help) or FSLOG_Z_LZ4 (an LZ4 block, see
+// FSLogCompress.h).  Concatenating the decompressed frames gives a text or binary logfile as described above.
+//
+// Circular logfiles (FSLogHandler::configureCircular()) have a fixed size.  They start with a header:
+//
+//   "FSLC" <version> 0x00 0x00 0x00 <u32 LE capacity> <u32 reserved> <u64 LE bytes written>
+//
+// and the data region starts at FSLOG_CIRC_DATA_OFFSET.  Logical byte n of the log lives at data offset n % capacity;
+// the oldest valid byte is max(0, written - capacity).
+//
+// Journaled logfiles (FSLogHandler::configureJournal()) survive power cuts and are appended to across boots.  They start
+// with an 8 byte header:
+//
+//   "FSLJ" <version> 0x00 0x00 0x00
+//
+// followed by records and sync markers:
+//
+//   [FSLOG_J_RECORD][u32 LE CRC-32 of the varint and payload][varint len][payload]
+//   FSLOG_J_SYNC_MAGIC (FSLOG_J_SYNC_SIZE bytes)
+//
+// Concatenating the payloads gives a text or binary logfile as described above.  In a binary journal each session starts
+// with a payload holding a fresh FSLB header, which resets the interning tables.  A sync marker goes before the first
+// record that starts in each write block, so after a power cut the end of the valid data is found by searching back
+// from the end of the file to the last marker and checking the records after it.  The marker bytes never occur in text.
+//
+// Time index sidecars (FSLogHandler::configureIndex()) are named after the logfile with FSLOG_IDX_SUFFIX appended.  They
+// hold FSLOG_IDX_ENTRY_SIZE byte entries:
+//
+//   <u32 LE record time><u32 LE file offset of the record>
+//
+// one for the first timestamped record that starts in each write block.  Times never decrease within an index; when
+// they do (a reboot while appending to a journal) the index starts over.
+//
+// Raw flash logs (FSLogFlashStorage) fill the sectors of a flash region in turn, then wrap around and overwrite the
+// oldest.  Every sector in use starts with a header:
+//
+//   "FSLF" <u32 LE sequence>
+//
+// Sequences go up by one per sector, and sector i of an n sector region only holds sequences s with s % n == i, so the
+// oldest and newest sectors are found from the headers alone.  After the header come chunks, one per append, that never
+// straddle a sector:
+//
+//   [u16 LE length][u32 LE CRC-32 of the data][data]
+//
+// An erased length (0xFFFF) ends the sector.  A chunk with a bad CRC is the torn end of the log; the writer moves on to
+// the next sector rather than programming after it.  Concatenating the chunk data from the oldest sector gives a text
+// logfile as described above.
+
+#ifndef __FSLOGFORMAT_H
+#define __FSLOGFORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FSLOG_BIN_MAGIC             "FSLB"
+#define FSLOG_BIN_VERSION           1
+#define FSLOG_BIN_HEADER_SIZE       8
+
+#define FSLOG_Z_MAGIC               "FSLZ"
+#define FSLOG_Z_VERSION             1
+#define FSLOG_Z_HEADER_SIZE         8
+#define FSLOG_Z_FRAME_MAGIC         0xFC
+#define FSLOG_Z_FRAME_HEADER_SIZE   6
+#define FSLOG_Z_STORED              0
+#define FSLOG_Z_LZ4                 1
+
+#define FSLOG_CIRC_MAGIC            "FSLC"
+#define FSLOG_CIRC_VERSION          1
+#define FSLOG_CIRC_HEADER_SIZE      24
+#define FSLOG_CIRC_DATA_OFFSET      512     // Keeps the data region aligned to flash program blocks
+
+#define FSLOG_J_MAGIC               "FSLJ"
+#define FSLOG_J_VERSION             1
+#define FSLOG_J_HEADER_SIZE         8
+#define FSLOG_J_RECORD              0xFA
+#define FSLOG_J_RECORD_HEADER_MAX   10      // Tag, CRC and a 32 bit varint
+#define FSLOG_J_SYNC_MAGIC          "\xFBSYNC\xFE\xFF\xFB"
+#define FSLOG_J_SYNC_SIZE           8
+
+#define FSLOG_IDX_SUFFIX            ".idx"
+#define FSLOG_IDX_ENTRY_SIZE        8
+
+#define FSLOG_FLASH_MAGIC           "FSLF"
+#define FSLOG_FLASH_HEADER_SIZE     8
+#define FSLOG_FLASH_CHUNK_HEADER_SIZE   6
+#define FSLOG_FLASH_ERASED_LEN      0xFFFF
+
+#define FSLOG_BIN_LEVEL_MASK        0x0F
+#define FSLOG_BIN_LEVEL_DEF         0x0F
+
+#define FSLOG_BIN_HAS_TIME          0x10
+#define FSLOG_BIN_HAS_CATEGORY      0x20
+#define FSLOG_BIN_HAS_CALLSITE      0x40
+#define FSLOG_BIN_HAS_ATTRS         0x80
+
+#define FSLOG_BIN_ATTR_CODE         0x01
+#define FSLOG_BIN_ATTR_DETAILS      0x02
+
+#define FSLOG_BIN_CALLSITE_FILE     0x01
+#define FSLOG_BIN_CALLSITE_LINE     0x02
+#define FSLOG_BIN_CALLSITE_FUNCTION 0x04
+
+#define FSLOG_BIN_DEF_CATEGORY      0x0F
+#define FSLOG_BIN_DEF_CALLSITE      0x1F
+#define FSLOG_BIN_TOKEN             0x2F
+
+#define FSLOG_TOKEN_SECTION         "fslog_tokens"
+
+#define FSLOG_VARINT_MAX            5   // Bytes needed for a 32 bit varint
+#define FSLOG_VARINT64_MAX          10  // Bytes needed for a 64 bit varint
+
+static inline uint8_t *fslogPutVarint(uint8_t *p, uint32_t value) {
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+// Returns nullptr if the varint runs past end
+static inline const uint8_t *fslogGetVarint(const uint8_t *p, const uint8_t *end, uint32_t *value) {
+    uint32_t result = 0;
+    for (int shift = 0; p < end && shift < 35; shift += 7) {
+        uint8_t b = *p++;
+        result |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *value = result;
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+static inline uint8_t *fslogPutVarint64(uint8_t *p, uint64_t value) {
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+static inline const uint8_t *fslogGetVarint64(const uint8_t *p, const uint8_t *end, uint64_t *value) {
+    uint64_t result = 0;
+    for (int shift = 0; p < end && shift < 70; shift += 7) {
+        uint8_t b = *p++;
+        result |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *value = result;
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+static inline uint64_t fslogZigzag64(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t fslogUnzigzag64(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static inline uint32_t fslogZigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t fslogUnzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static inline uint8_t fslogLevelToNibble(int level) {
+    return (uint8_t)(level / 10);
+}
+
+static inline int fslogNibbleToLevel(uint8_t nibble) {
+    return nibble ? nibble * 10 : 1;
+}
+
+// 32 bit FNV-1a, used to intern categories and call-sites and, at compile time, to tokenize format strings
+static inline constexpr uint32_t fslogHash(const char *s, size_t len, uint32_t hash = 2166136261u) {
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)s[i]) * 16777619u;
+    }
+    return hash;
+}
+
+#endif  //__FSLOGFORMAT_H
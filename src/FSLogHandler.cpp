@@ -5,122 +5,2474 @@
 
 #include "FSLogHandler.h"
 #include <fcntl.h>
+#include <new>
 #include <sys/stat.h>
 
+// In binary mode logMessage() only copies the raw fields into the ring; the consumer does the encoding and interning so
+// definitions always land in the same file as the records that use them
+struct PackedRecord {
+    uint32_t time;
+    uint32_t token;         // FSLOG_TOKEN() format string hash, message holds the packed arguments
+    int32_t line;
+    int32_t code;
+    uint16_t category_len;
+    uint16_t file_len;
+    uint16_t func_len;
+    uint16_t msg_len;
+    uint16_t details_len;
+    uint8_t level;
+    uint8_t flags;          // PACKED_HAS_* below
+};
+
+#define PACKED_HAS_TIME         0x01
+#define PACKED_HAS_CATEGORY     0x02
+#define PACKED_HAS_FILE         0x04
+#define PACKED_HAS_LINE         0x08
+#define PACKED_HAS_FUNCTION     0x10
+#define PACKED_HAS_CODE         0x20
+#define PACKED_HAS_DETAILS      0x40
+#define PACKED_HAS_TOKEN        0x80
+
+#define FSLOG_ARRAY_SIZE(a)     (sizeof(a) / sizeof((a)[0]))
+
+// Bounds of the FSLOG_TOKEN() format string table, weak so firmware without tokens still links
+extern "C" const char __start_fslog_tokens[] __attribute__((weak));
+extern "C" const char __stop_fslog_tokens[] __attribute__((weak));
+
+FSLogHandler *FSLogHandler::_token_sink = nullptr;
+
+// Exponentially weighted moving average with a weight of 1/8 for the new sample, rounded towards the sample so a steady
+// input is reached exactly
+static inline uint32_t ewma(uint32_t average, uint32_t sample) {
+    int64_t diff = (int64_t)sample - (int64_t)average;
+    return (uint32_t)((int64_t)average + (diff >= 0 ? diff + 7 : diff - 7) / 8);
+}
+
+// Bucket of a duration in the log2 histograms of FSLogHandler::Stats
+static inline size_t histogramBucket(uint32_t us) {
+    size_t bucket = us ? 32 - __builtin_clz(us) : 0;
+    return bucket < FS_LOG_HANDLER_STATS_BUCKETS ? bucket : FS_LOG_HANDLER_STATS_BUCKETS - 1;
+}
+
 FSLogHandler::FSLogHandler(String filename, bool enable_now, LogLevel level, LogCategoryFilters filters) : 
         LogHandler(level, filters) {
     
     // Private var init
+    os_mutex_create(&_lock);
+    _clock = nullptr;
+    _filters = filters;
     _enabled = enable_now;
     _open = false;
-    _fd = -1;
-    _path = "/log/" + filename + ".log";
+    _base = FS_LOG_HANDLER_DIR "/" + filename;
+    _path = _base + ".log";
+    _bytes_queued = 0;
+    _buffer.resize(4096);
+    _block = nullptr;
+    _block_size = 0;
+    _block_used = 0;
+    _file_offset = 0;
+    _compress = false;
+    _zblock = nullptr;
+    _circ_capacity = 0;
+    _rot_files = 0;
+    _rot_bytes = 0;
+    _generation = 0;
+    _generation_loaded = false;
+    _journal = false;
+    _journal_end = 0;
+    _journal_block = -1;
+    _jrec = nullptr;
+    _jrec_size = 0;
+    _jrec_used = 0;
+    memset(&_journal_recovery, 0, sizeof(_journal_recovery));
+    _index = false;
+    _idx_fd = -1;
+    _idx_block = -1;
+    _idx_last_time = 0;
+    _idx_pending_count = 0;
+    _format = FORMAT_TEXT;
+    _last_time = 0;
+    _category_count = 0;
+    _callsite_count = 0;
+    configureWriteBlock(512);
+    _last_sync_ms = clockMs();
+    _unsynced_since_ms = _last_sync_ms;
+    _last_pass_ms = _last_sync_ms;
+    _durability_ms = 0;
+    _held = nullptr;
+    _held_size = 0;
+    _held_len = 0;
+    memset(&_fault_stats, 0, sizeof(_fault_stats));
+    _stalled = false;
+    _file.configure(_path, 0);
+    _storage = &_file;
+    _writer = nullptr;
+    _writer_wake = nullptr;
+    _writer_watermark = 0;
+    _writer_stop = false;
+    memset(&_writer_stats, 0, sizeof(_writer_stats));
+    _dump_jobs = nullptr;
+    _dump_chunk = 1024;
+    memset(&_dump_cursor, 0, sizeof(_dump_cursor));
+    _epoch = 0;
+    _urgent_on = false;
+    _urgent_level = LOG_LEVEL_ERROR;
+    _urgent_sync_ms = 0;
+    _urgent_written_ms = 0;
+    _urgent_unsynced = false;
+    _bulk_on = false;
+    _bulk_level = LOG_LEVEL_INFO;
+    _backpressure = BACKPRESSURE_DROP_NEWEST;
+    _block_ms = 10;
+    _degrade_level = LOG_LEVEL_INFO;
+    _drops_newest.store(0);
+    _drops_oldest.store(0);
+    _drops_timeouts.store(0);
+    _drops_degraded.store(0);
+    _drops_reported = 0;
+    memset(_rate_table, -1, sizeof(_rate_table));
+    _rate_count = 0;
+    _rate_summary_ms = 0;
+    memset(_dedup, 0, sizeof(_dedup));
+    _dedup_size = 0;
+    _dedup_next = 0;
+    _dedup_timeout_ms = 0;
+    _dedup_busy.clear();
+    memset(&_counters, 0, sizeof(_counters));
+    _stats_seq.store(0);
+    _stat_messages.store(0);
+    for (size_t i = 0; i < FS_LOG_HANDLER_STATS_BUCKETS; i++) {
+        _stat_log_us[i].store(0);
+    }
+    for (size_t i = 0; i < 3; i++) {
+        _stat_high_water[i].store(0);
+    }
+    _stats_timing = false;
+    _stats_period_ms = 0;
+    _stats_emit_ms = 0;
+    _flight_on = false;
+    _flight_persist = LOG_LEVEL_NONE;
+    _flight_trigger_level = LOG_LEVEL_ERROR;
+    _flight_pre_ms = 0;
+    _flight_post_ms = 0;
+    _flight_trigger_ms = 0;
+    _flight_post = false;
+    _flight_triggers.store(0);
+    _flight_pending_ms.store(0);
+    _flight_persisted = 0;
+    _flight_avoided = 0;
+
+    // Sane defaults for fsync triggers
+    configureFsync(4096, 10);
+
+    // Add this log handler to the system log manager
+    LogManager::instance()->addHandler(this);
+}
+
+FSLogHandler::~FSLogHandler() {
+    LogManager::instance()->removeHandler(this);
+    while (_dump_jobs) {
+        cancelDump(*_dump_jobs);
+    }
+    stopWriterThread();
+    drain();
+    syncAndClose();
+    if (_writer_wake) {
+        os_semaphore_destroy(_writer_wake);
+    }
+    os_mutex_destroy(_lock);
+    delete[] _block;
+    delete[] _zblock;
+    delete[] _jrec;
+    delete[] _held;
+}
+
+FSLogHandler &FSLogHandler::configureFormat(Format format) {
+    if (_enabled || format == _format || (format != FORMAT_TEXT && (_circ_capacity || _storage != &_file))) {
+        return *this;
+    }
+
+    // Flush records queued in the old format and start a new file so formats never mix
+    os_mutex_lock(_lock);
+    drain();
+    syncAndClose();
+    _format = format;
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+FSLogHandler &FSLogHandler::configureCircular(size_t capacity) {
+    if (_enabled || capacity == _circ_capacity || (capacity && (_compress || _journal || _format != FORMAT_TEXT || _rot_files || _storage != &_file))) {
+        return *this;
+    }
+
+    os_mutex_lock(_lock);
+    drain();
+    syncAndClose();
+    _circ_capacity = capacity;
+    _file.configure(_path, _circ_capacity);
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+FSLogHandler &FSLogHandler::configureRotation(size_t max_bytes, unsigned int max_files) {
+    if (_enabled || (max_files && (_circ_capacity || _storage != &_file))) {
+        return *this;
+    }
+
+    os_mutex_lock(_lock);
+    drain();
+    syncAndClose();
+    _rot_bytes = max_bytes;
+    _rot_files = max_bytes ? max_files : 0;
+    _generation_loaded = false;
+    _path = _rot_files ? generationPath(_generation) : _base + ".log";
+    _file.configure(_path, _circ_capacity);
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+String FSLogHandler::generationPath(uint32_t generation) {
+    return _base + "." + String((int)(generation % _rot_files));
+}
+
+// The manifest only holds the current generation; file names are the generation modulo the number of files, so
+// rotating never renames anything.  Returns false if there is no manifest yet.
+bool FSLogHandler::readGeneration(uint32_t *generation) {
+    int fd = open(_base + ".gen", O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool found = read(fd, generation, sizeof(*generation)) == sizeof(*generation);
+    close(fd);
+    return found;
+}
+
+void FSLogHandler::loadGeneration() {
+    uint32_t generation;
+    _generation = 0;
+    if (readGeneration(&generation)) {
+        _generation = _journal ? generation : generation + 1;   // Only journals append to the previous session's file
+    }
+    _generation_loaded = true;
+}
+
+void FSLogHandler::saveGeneration() {
+    int fd = FSLOG_OPEN(_base + ".gen", O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd == -1) {
+        DEBUG_PRINTLNF("FSLogHandler::saveGeneration() manifest open FAILED! errno=%i", errno);
+        return;
+    }
+    ::write(fd, &_generation, sizeof(_generation));
+    fsync(fd);
+    close(fd);
+}
+
+// Close the current file and start the next generation, replacing the oldest file
+void FSLogHandler::rotate() {
+    syncAndClose();
+    _generation++;
+    _path = generationPath(_generation);
+    _file.configure(_path, _circ_capacity);
+    unlink(_path.c_str());
+    unlink((_path + FSLOG_IDX_SUFFIX).c_str());
+    TRACE_PRINTLNF("FSLogHandler::rotate() generation %u, logfile %s", _generation, _path.c_str());
+}
+
+FSLogHandler &FSLogHandler::configureCompression(bool enable) {
+    if (_enabled || enable == _compress || (enable && (_circ_capacity || _journal || _storage != &_file))) {
+        return *this;
+    }
+
+    os_mutex_lock(_lock);
+    drain();
+    syncAndClose();
+    _compress = enable;
+    if (_compress && !allocCompressBuffer()) {
+        _compress = false;
+    }
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+FSLogHandler &FSLogHandler::configureJournal(bool enable) {
+    if (_enabled || enable == _journal || (enable && (_circ_capacity || _compress || _storage != &_file))) {
+        return *this;
+    }
+
+    os_mutex_lock(_lock);
+    drain();
+    syncAndClose();
+    _journal = enable;
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+FSLogHandler &FSLogHandler::configureIndex(bool enable) {
+    if (_enabled || enable == _index || (enable && _storage != &_file)) {
+        return *this;
+    }
+
+    os_mutex_lock(_lock);
+    drain();
+    syncAndClose();
+    _index = enable;
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+FSLogHandler &FSLogHandler::configureStorage(FSLogStorage *storage) {
+    if (!storage) {
+        storage = &_file;
+    }
+    if (_enabled || storage == _storage ||
+            (storage != &_file && (_compress || _circ_capacity || _rot_files || _journal || _index || _format != FORMAT_TEXT))) {
+        return *this;
+    }
+
+    os_mutex_lock(_lock);
+    drain();
+    syncAndClose();
+    _storage = storage;
+    _epoch++;   // Cursors into the logfile mean nothing to the backend, and the other way round
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+FSLogHandler &FSLogHandler::configureRateLimit(const char *category, unsigned int per_second, unsigned int burst, bool per_callsite) {
+    if (_enabled || !category) {
+        return *this;
+    }
+
+    size_t len = strlen(category);
+    uint32_t hash = fslogHash(category, len);
+    RateLimit *limit = findRateLimit(hash, category, len);
+    if (!limit) {
+        if (_rate_count == FS_LOG_HANDLER_MAX_RATE_LIMITS) {
+            DEBUG_PRINTLNF("FSLogHandler::configureRateLimit() no room for \"%s\"", category);
+            return *this;
+        }
+        limit = &_rate_limits[_rate_count];
+        size_t slot = hash % FSLOG_ARRAY_SIZE(_rate_table);
+        while (_rate_table[slot] != -1) {
+            slot = (slot + 1) % FSLOG_ARRAY_SIZE(_rate_table);
+        }
+        _rate_table[slot] = _rate_count++;
+    }
+
+    limit->hash = hash;
+    limit->category = category;
+    limit->rate = per_second;
+    limit->capacity = (burst ? burst : 1) * 1000;
+    limit->buckets = per_callsite ? FS_LOG_HANDLER_RATE_CALLSITE_BUCKETS : 1;
+    for (size_t i = 0; i < FS_LOG_HANDLER_RATE_CALLSITE_BUCKETS; i++) {
+        limit->bucket[i].tokens.store(limit->capacity);
+        limit->bucket[i].last_ms.store(clockMs());
+    }
+    limit->suppressed.store(0);
+    return *this;
+}
+
+FSLogHandler &FSLogHandler::configureDedup(unsigned int history, unsigned int timeout_s) {
+    if (_enabled) {
+        return *this;
+    }
+
+    os_mutex_lock(_lock);
+    dedupFlush(true);
+    drain();
+    memset(_dedup, 0, sizeof(_dedup));
+    _dedup_size = history > FS_LOG_HANDLER_DEDUP_HISTORY ? FS_LOG_HANDLER_DEDUP_HISTORY : history;
+    _dedup_next = 0;
+    _dedup_timeout_ms = timeout_s * 1000;
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+FSLogHandler &FSLogHandler::configureUrgentLane(LogLevel level, unsigned int sync_ms, size_t ram_bytes) {
+    if (_enabled) {
+        return *this;
+    }
+
+    os_mutex_lock(_lock);
+    drain();
+    _urgent_on = ram_bytes && _urgent.resize(ram_bytes);
+    _urgent_level = level;
+    _urgent_sync_ms = sync_ms;
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+FSLogHandler &FSLogHandler::configureBulkLane(LogLevel level, size_t ram_bytes) {
+    if (_enabled) {
+        return *this;
+    }
+
+    os_mutex_lock(_lock);
+    drain();
+    _bulk_on = ram_bytes && _bulk.resize(ram_bytes);
+    _bulk_level = level;
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+FSLogHandler &FSLogHandler::configureFlightRecorder(LogLevel persist_level, size_t ram_bytes, unsigned int pre_s, unsigned int post_s) {
+    if (_enabled) {
+        return *this;
+    }
+
+    os_mutex_lock(_lock);
+    drain();
+    _flight_on = ram_bytes && _flight.resize(ram_bytes);
+    _flight_persist = persist_level;
+    _flight_pre_ms = pre_s * 1000;
+    _flight_post_ms = post_s * 1000;
+    _flight_post = false;
+    _flight_pending_ms.store(0);
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+FSLogHandler &FSLogHandler::configureFlightTrigger(LogLevel level, const char *category) {
+    // The category is read by logMessage() without the lock
+    if (_enabled) {
+        return *this;
+    }
+
+    _flight_trigger_level = level;
+    _flight_trigger_category = category ? category : "";
+    return *this;
+}
+
+void FSLogHandler::triggerFlightRecorder() {
+    if (!_flight_on) {
+        return;
+    }
+    // Counted before claiming the pending slot, so a consumer finishing the previous window either sees the slot taken
+    // or the count changed
+    uint32_t now = clockMs();
+    _flight_trigger_ms = now;
+    _flight_post = true;
+    _flight_triggers.fetch_add(1);
+    uint32_t none = 0;
+    _flight_pending_ms.compare_exchange_strong(none, now ? now : 1);
+    if (_writer) {
+        os_semaphore_give(_writer_wake, false);
+    }
+}
+
+FSLogHandler::FlightRecorderStats FSLogHandler::flightRecorderStats() {
+    FlightRecorderStats stats;
+    os_mutex_lock(_lock);
+    stats.triggers = _flight_triggers.load();
+    stats.bytes_persisted = _flight_persisted;
+    stats.bytes_avoided = _flight_avoided;
+    stats.dropped = _flight.dropped();
+    os_mutex_unlock(_lock);
+    return stats;
+}
+
+bool FSLogHandler::allocCompressBuffer() {
+    delete[] _zblock;
+    _zblock = new (std::nothrow) uint8_t[FSLOG_Z_FRAME_HEADER_SIZE + FSLOG_LZ_BOUND(_block_size)];
+    if (!_zblock) {
+        DEBUG_PRINTLNF("FSLogHandler::allocCompressBuffer() allocation for %u byte blocks FAILED", _block_size);
+        return false;
+    }
+    return true;
+}
+
+FSLogHandler &FSLogHandler::configureWriteBlock(size_t bytes) {
+    if (bytes > FSLOG_LZ_MAX_INPUT) {
+        bytes = FSLOG_LZ_MAX_INPUT;     // Frame lengths are 16 bits
+    }
+    char *block = new (std::nothrow) char[bytes];
+    if (!block) {
+        DEBUG_PRINTLNF("FSLogHandler::configureWriteBlock() allocation of %u bytes FAILED", bytes);
+        return *this;
+    }
+
+    os_mutex_lock(_lock);
+    if (_open) {
+        flushBlock();
+    }
+    delete[] _block;
+    _block = block;
+    _block_size = bytes;
+    _block_used = 0;
+    if (_compress && !allocCompressBuffer()) {
+        _compress = false;
+    }
+    os_mutex_unlock(_lock);
+    return *this;
+}
+
+bool FSLogHandler::startWriterThread(size_t watermark) {
+    if (_writer) {
+        return true;
+    }
+
+    _writer_watermark = watermark ? watermark : _buffer.capacity() / 2;
+    _writer_stop = false;
+    // The semaphore outlives the thread: a producer that saw _writer set just before stopWriterThread() cleared it may
+    // still give it
+    if (!_writer_wake) {
+        int result = os_semaphore_create(&_writer_wake, 1, 0);
+        if (result != 0) {
+            DEBUG_PRINTLNF("FSLogHandler::startWriterThread() semaphore create FAILED! result=%i", result);
+            _writer_wake = nullptr;
+            return false;
+        }
+    }
+    os_thread_t writer;
+    int result = os_thread_create(&writer, "fslog", OS_THREAD_PRIORITY_DEFAULT, writerThread, this, 3 * 1024);
+    if (result != 0) {
+        DEBUG_PRINTLNF("FSLogHandler::startWriterThread() thread create FAILED! result=%i", result);
+        return false;
+    }
+    _writer = writer;
+    return true;
+}
+
+void FSLogHandler::stopWriterThread() {
+    if (!_writer) {
+        return;
+    }
+
+    // Clear _writer first so logMessage() stops signalling and loop() takes over again
+    os_thread_t writer = _writer.exchange(nullptr);
+    if (!writer) {
+        return;
+    }
+    _writer_stop = true;
+    os_semaphore_give(_writer_wake, false);
+    os_thread_join(writer);
+    os_thread_cleanup(writer);
+}
+
+FSLogHandler::WriterStats FSLogHandler::writerStats() {
+    os_mutex_lock(_lock);
+    WriterStats stats = _writer_stats;
+    os_mutex_unlock(_lock);
+    return stats;
+}
+
+// Writer thread body: sleep until the buffer crosses the watermark or the fsync timeout expires, then write
+// everything that is queued and finish the batch with a single fsync()
+void FSLogHandler::writerThread(void *arg) {
+    FSLogHandler *self = static_cast<FSLogHandler *>(arg);
+    uint32_t wait = 0;  // First pass right away
+
+    while (!self->_writer_stop) {
+        os_semaphore_take(self->_writer_wake, wait, false);
+
+        os_mutex_lock(self->_lock);
+        self->_writer_stats.wakeups++;
+        self->schedulePass();
+        size_t bytes = self->drain(false);
+        if (self->_durability_ms ? self->syncDue() : self->_open && self->_bytes_queued > 0) {
+            self->timedSync();
+        } else if (self->_open) {
+            self->urgentSync();
+        }
+        if (self->_open) {
+            self->_storage->maintain();
+        }
+        if (bytes) {
+            self->_writer_stats.batches++;
+            self->_writer_stats.batch_bytes_total += bytes;
+            self->_writer_stats.batch_bytes_last = bytes;
+            if (bytes > self->_writer_stats.batch_bytes_max) {
+                self->_writer_stats.batch_bytes_max = bytes;
+            }
+        }
+        wait = self->writerWait();
+        os_mutex_unlock(self->_lock);
+    }
+
+    os_thread_exit(nullptr);
+}
+
+void FSLogHandler::timedSync() {
+    DEBUG_PRINTLNF("FSLogHandler::timedSync() fsync() %u bytes", _bytes_queued);
+    flushBlock();
+    indexFlush();
+    uint32_t elapsed = syncFile();
+    _writer_stats.fsyncs++;
+    _writer_stats.fsync_us_last = elapsed;
+    if (elapsed > _writer_stats.fsync_us_max) {
+        _writer_stats.fsync_us_max = elapsed;
+    }
+    updateSchedule(elapsed, _bytes_queued);
     _bytes_queued = 0;
+    _urgent_unsynced = false;
+    _last_sync_ms = clockMs();
+}
+
+// Whether the data written since the last fsync() has waited long enough, see configureFsync() and configureDurability()
+bool FSLogHandler::syncDue() {
+    if (!_open || !_bytes_queued) {
+        return false;
+    }
+    if (_durability_ms) {
+        return clockMs() - _unsynced_since_ms >= _counters.sync_interval_ms;
+    }
+    return clockMs() - _last_sync_ms >= _fsync_timeout_s * 1000 || _bytes_queued > _max_bytes_queued;
+}
+
+// How long the writer thread can sleep before the next sync is due, unless the watermark wakes it first.  Unsynced
+// urgent records shorten the wait to their deadline.
+uint32_t FSLogHandler::writerWait() {
+    uint32_t wait = _fsync_timeout_s * 1000;
+    if (_durability_ms) {
+        wait = _counters.sync_interval_ms;
+        if (_bytes_queued) {
+            uint32_t age = clockMs() - _unsynced_since_ms;
+            wait = age < wait ? wait - age : 0;
+        }
+    }
+    if (wait < FS_LOG_HANDLER_WRITER_MIN_WAIT_MS) {
+        wait = FS_LOG_HANDLER_WRITER_MIN_WAIT_MS;
+    }
+    if (_urgent_unsynced && _open) {
+        uint32_t age = clockMs() - _urgent_written_ms;
+        uint32_t urgent = age < _urgent_sync_ms ? _urgent_sync_ms - age : 1;
+        wait = urgent < wait ? urgent : wait;
+    }
+    return wait;
+}
+
+// Track the average gap between passes that drain the RAM buffers, which is how long a record can wait in RAM
+void FSLogHandler::schedulePass() {
+    uint32_t now = clockMs();
+    countersBegin();
+    _counters.poll_ms = ewma(_counters.poll_ms, now - _last_pass_ms);
+    countersEnd();
+    _last_pass_ms = now;
+}
+
+// Fold a finished fsync() into the scheduler's estimates and, with a durability target, pick the next sync interval.
+// A record can wait a pass to be written, then the interval, then the fsync() itself, so both are taken off the target.
+void FSLogHandler::updateSchedule(uint32_t fsync_us, uint32_t bytes) {
+    uint32_t now = clockMs();
+    uint32_t since = now - _last_sync_ms;
+
+    countersBegin();
+    // A slower fsync() raises the estimate at once; faster ones only bring it down gradually
+    _counters.fsync_cost_us = fsync_us > _counters.fsync_cost_us ? fsync_us : ewma(_counters.fsync_cost_us, fsync_us);
+    _counters.bytes_per_sync = _counters.bytes_per_sync ? ewma(_counters.bytes_per_sync, bytes) : bytes;
+    if (since) {
+        _counters.byte_rate = ewma(_counters.byte_rate, (uint32_t)((uint64_t)bytes * 1000 / since));
+    }
+    if (bytes && now - _unsynced_since_ms > _counters.unsynced_ms_max) {
+        _counters.unsynced_ms_max = now - _unsynced_since_ms;
+    }
+
+    if (_durability_ms) {
+        // fsync() cost grows with the data it has to commit
+        uint64_t cost_us = _counters.fsync_cost_us;
+        uint64_t expected = (uint64_t)_counters.byte_rate * _counters.sync_interval_ms / 1000;
+        if (_counters.bytes_per_sync && expected > _counters.bytes_per_sync) {
+            cost_us = cost_us * expected / _counters.bytes_per_sync;
+        }
+        uint64_t overhead = _counters.poll_ms + (cost_us + 999) / 1000;
+        _counters.sync_interval_ms = _durability_ms > overhead ? (uint32_t)(_durability_ms - overhead) : 0;
+    }
+    countersEnd();
+}
+
+// fsync() the logfile and account for it, returns the duration in microseconds
+uint32_t FSLogHandler::syncFile() {
+    uint32_t gap = clockMs() - _last_sync_ms;
+    uint32_t drops = getDropCount();
+    uint32_t start = micros();
+    int result = _storage->sync();
+    uint32_t elapsed = micros() - start;
+
+    // Records dropped from the first fsync() that can't keep up until one does are lost to the stall.  Not while a
+    // write fault is counting them.
+    if (elapsed / 1000 > gap && !_held_len) {
+        _fault_stats.fsync_stalls++;
+        if (!_stalled) {
+            _stalled = true;
+            _stall_drops = drops;
+        }
+    } else if (_stalled) {
+        endStall();
+    }
+
+    countersBegin();
+    _counters.fsyncs++;
+    _counters.fsync_us[histogramBucket(elapsed)]++;
+    countersEnd();
+    reportIo(IoEvent::FSYNC, _bytes_queued, elapsed, result);
+    return elapsed;
+}
+
+void FSLogHandler::reportIo(IoEvent::Type type, uint32_t bytes, uint32_t us, int result) {
+    if (_io_observer) {
+        IoEvent event = { type, clockMs(), bytes, us, result };
+        _io_observer(event);
+    }
+}
+
+void FSLogHandler::syncAndClose() {
+    if (_open) {
+        if (_held_len) {
+            retryHeld(true);
+        }
+        flushBlock();
+        if (_held_len) {
+            _fault_stats.bytes_lost += _held_len + _block_used;
+            _held_len = 0;
+            _block_used = 0;
+        }
+        indexClose();
+        syncFile();
+        _storage->close();
+        _bytes_queued = 0;
+        _urgent_unsynced = false;
+        _open = false;
+        TRACE_PRINTLNF("FSLogHandler()::syncAndClose() File %s closed", _path.c_str());
+    }
+}
+
+long FSLogHandler::getLogSize() {
+    os_mutex_lock(_lock);
+    long size = _storage->size();
+    if (size >= 0 && _open) {
+        size += (long)_block_used;
+        if (_circ_capacity && size > (long)_circ_capacity) {
+            size = (long)_circ_capacity;
+        }
+    }
+    os_mutex_unlock(_lock);
+    return size;
+}
+
+void FSLogHandler::clearLogs() {
+    os_mutex_lock(_lock);
+    syncAndClose();
+    if (_rot_files) {
+        for (unsigned int i = 0; i < _rot_files; i++) {
+            unlink(generationPath(i).c_str());
+            unlink((generationPath(i) + FSLOG_IDX_SUFFIX).c_str());
+        }
+        unlink((_base + ".gen").c_str());
+        _generation = 0;
+        _generation_loaded = true;
+        _path = generationPath(_generation);
+        _file.configure(_path, _circ_capacity);
+    }
+    _storage->clear();
+    unlink((_path + FSLOG_IDX_SUFFIX).c_str());
+    _epoch++;
+    os_mutex_unlock(_lock);
+    TRACE_PRINTLNF("FSLogHandler()::clearLogs() Close and delete logfile %s", _path.c_str());
+}
+
+void FSLogHandler::writeToFile(const char *data, size_t len) {
+    _bytes_queued += len;
+    TRACE_PRINTF("FSLogHandler::write() msg=%.*s", (int)len, data);
+
+    if (_journal) {
+        // Collect the pieces of the record, journalCommit() frames it
+        if (_jrec_used + len <= _jrec_size) {
+            memcpy(_jrec + _jrec_used, data, len);
+        }
+        _jrec_used += len;
+        return;
+    }
+    stage(data, len);
+}
+
+// Coalesce records into the staging block so the filesystem only sees full, block-aligned writes
+void FSLogHandler::stage(const char *data, size_t len) {
+    while (len) {
+        // After a partial flush the file offset is unaligned, so only fill up to the next block boundary.  Compressed
+        // frames have no fixed size on flash, so they always take a full block.
+        size_t fill = _compress ? _block_size : _block_size - (size_t)(_file_offset % _block_size);
+        size_t n = fill - _block_used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(_block + _block_used, data, n);
+        _block_used += n;
+        data += n;
+        len -= n;
+
+        if (_block_used == fill) {
+            flushBlock();
+            if (_block_used) {
+                // Stuck behind a held block with the rest of the record still to stage
+                _fault_stats.bytes_lost += _block_used;
+                _block_used = 0;
+            }
+        }
+    }
+}
+
+// Returns the 1-based id of hash in table, adding it if there is room.  Returns 0 if the table is full.
+uint32_t FSLogHandler::internString(uint32_t *table, uint8_t *count, size_t max, uint32_t hash, bool *is_new) {
+    *is_new = false;
+    for (uint8_t i = 0; i < *count; i++) {
+        if (table[i] == hash) {
+            return i + 1;
+        }
+    }
+    if (*count >= max) {
+        return 0;
+    }
+    table[(*count)++] = hash;
+    *is_new = true;
+    return *count;
+}
+
+void FSLogHandler::writeVarint(uint32_t value) {
+    uint8_t buf[FSLOG_VARINT_MAX];
+    writeToFile((const char *)buf, fslogPutVarint(buf, value) - buf);
+}
+
+void FSLogHandler::writeLengthPrefixed(const char *data, size_t len) {
+    writeVarint(len);
+    writeToFile(data, len);
+}
+
+// Encode a PackedRecord from the ring in the binary format, emitting definitions for categories and call-sites the
+// current file hasn't seen yet.  Id 0 means the definition follows inline because the interning table is full.
+void FSLogHandler::writeBinaryRecord(const char *data, size_t len) {
+    const PackedRecord *r = reinterpret_cast<const PackedRecord *>(data);
+    if (len < sizeof(PackedRecord)) {
+        return;
+    }
+    const char *category = data + sizeof(PackedRecord);
+    const char *file = category + r->category_len;
+    const char *func = file + r->file_len;
+    const char *msg = func + r->func_len;
+    const char *details = msg + r->msg_len;
+    uint8_t tag = r->level & FSLOG_BIN_LEVEL_MASK;
+    bool is_new;
+    char def;
+
+    uint32_t category_id = 0;
+    if (r->flags & PACKED_HAS_CATEGORY) {
+        tag |= FSLOG_BIN_HAS_CATEGORY;
+        category_id = internString(_categories, &_category_count, FS_LOG_HANDLER_MAX_CATEGORIES,
+                fslogHash(category, r->category_len), &is_new);
+        if (is_new) {
+            def = FSLOG_BIN_DEF_CATEGORY;
+            writeToFile(&def, 1);
+            writeVarint(category_id);
+            writeLengthPrefixed(category, r->category_len);
+        }
+    }
+
+    if (r->flags & PACKED_HAS_TOKEN) {
+        uint8_t header[2] = { FSLOG_BIN_TOKEN, (uint8_t)(tag | FSLOG_BIN_HAS_TIME) };
+        writeToFile((const char *)header, sizeof(header));
+        writeVarint(fslogZigzag((int32_t)(r->time - _last_time)));
+        _last_time = r->time;
+        if (r->flags & PACKED_HAS_CATEGORY) {
+            writeVarint(category_id);
+            if (!category_id) {
+                writeLengthPrefixed(category, r->category_len);
+            }
+        }
+        writeVarint(r->token);
+        writeLengthPrefixed(msg, r->msg_len);
+        return;
+    }
+
+    uint32_t callsite_id = 0;
+    uint8_t callsite_flags = ((r->flags & PACKED_HAS_FILE) ? FSLOG_BIN_CALLSITE_FILE : 0) |
+            ((r->flags & PACKED_HAS_LINE) ? FSLOG_BIN_CALLSITE_LINE : 0) |
+            ((r->flags & PACKED_HAS_FUNCTION) ? FSLOG_BIN_CALLSITE_FUNCTION : 0);
+    if (callsite_flags) {
+        tag |= FSLOG_BIN_HAS_CALLSITE;
+        uint32_t hash = fslogHash((const char *)&r->line, sizeof(r->line), callsite_flags);
+        hash = fslogHash(func, r->func_len, fslogHash(file, r->file_len, hash));
+        callsite_id = internString(_callsites, &_callsite_count, FS_LOG_HANDLER_MAX_CALLSITES, hash, &is_new);
+        if (is_new) {
+            def = FSLOG_BIN_DEF_CALLSITE;
+            writeToFile(&def, 1);
+            writeVarint(callsite_id);
+            writeCallsite(r, callsite_flags, file, func);
+        }
+    }
+
+    uint8_t attr_flags = ((r->flags & PACKED_HAS_CODE) ? FSLOG_BIN_ATTR_CODE : 0) |
+            ((r->flags & PACKED_HAS_DETAILS) ? FSLOG_BIN_ATTR_DETAILS : 0);
+    if (attr_flags) {
+        tag |= FSLOG_BIN_HAS_ATTRS;
+    }
+    if (r->flags & PACKED_HAS_TIME) {
+        tag |= FSLOG_BIN_HAS_TIME;
+    }
+
+    writeToFile((const char *)&tag, 1);
+    if (r->flags & PACKED_HAS_TIME) {
+        writeVarint(fslogZigzag((int32_t)(r->time - _last_time)));
+        _last_time = r->time;
+    }
+    if (r->flags & PACKED_HAS_CATEGORY) {
+        writeVarint(category_id);
+        if (!category_id) {
+            writeLengthPrefixed(category, r->category_len);
+        }
+    }
+    if (callsite_flags) {
+        writeVarint(callsite_id);
+        if (!callsite_id) {
+            writeCallsite(r, callsite_flags, file, func);
+        }
+    }
+    if (attr_flags) {
+        writeToFile((const char *)&attr_flags, 1);
+        if (attr_flags & FSLOG_BIN_ATTR_CODE) {
+            writeVarint(fslogZigzag(r->code));
+        }
+        if (attr_flags & FSLOG_BIN_ATTR_DETAILS) {
+            writeLengthPrefixed(details, r->details_len);
+        }
+    }
+    writeLengthPrefixed(msg, r->msg_len);
+}
+
+void FSLogHandler::writeCallsite(const PackedRecord *r, uint8_t flags, const char *file, const char *func) {
+    writeToFile((const char *)&flags, 1);
+    writeLengthPrefixed(file, r->file_len);
+    writeVarint(fslogZigzag(r->line));
+    writeLengthPrefixed(func, r->func_len);
+}
+
+// Write out whatever is staged, full block or not.  Nothing goes out while a held block is waiting for its retry.
+void FSLogHandler::flushBlock() {
+    if (!_block_used || (_held_len && !retryHeld(false))) {
+        return;
+    }
+
+    const void *data = _block;
+    size_t len = _block_used;
+    if (_compress) {
+        // Store the block raw if compression doesn't shrink it, e.g. binary UBX payloads
+        size_t zlen = fslogCompress((const uint8_t *)_block, _block_used, _zblock + FSLOG_Z_FRAME_HEADER_SIZE,
+                _block_used, _lz_table);
+        uint8_t type = zlen ? FSLOG_Z_LZ4 : FSLOG_Z_STORED;
+        if (!zlen) {
+            zlen = _block_used;
+            memcpy(_zblock + FSLOG_Z_FRAME_HEADER_SIZE, _block, zlen);
+        }
+        _zblock[0] = FSLOG_Z_FRAME_MAGIC;
+        _zblock[1] = type;
+        _zblock[2] = (uint8_t)_block_used;
+        _zblock[3] = (uint8_t)(_block_used >> 8);
+        _zblock[4] = (uint8_t)zlen;
+        _zblock[5] = (uint8_t)(zlen >> 8);
+        data = _zblock;
+        len = FSLOG_Z_FRAME_HEADER_SIZE + zlen;
+    }
+
+    int result = writeData(data, len);
+    _block_used = 0;
+    if (result != (int)len) {
+        holdWrite(data, len, result);
+    }
+}
+
+// Append to the log.  _file_offset only moves once all of it is written; holdWrite() accounts for a partial append.
+int FSLogHandler::writeData(const void *data, size_t len) {
+    uint32_t start = micros();
+    int result = _storage->append(data, len);
+    uint32_t elapsed = micros() - start;
+    if (result == (int)len) {
+        _file_offset += result;
+    }
+
+    countersBegin();
+    _counters.writes++;
+    _counters.bytes_written += result > 0 ? result : 0;
+    _counters.write_us[histogramBucket(elapsed)]++;
+    countersEnd();
+    reportIo(IoEvent::WRITE, len, elapsed, result);
+    return result;
+}
+
+// Keep a block that failed or was cut short so it can be retried ahead of everything after it
+void FSLogHandler::holdWrite(const void *data, size_t len, int result) {
+    if (result > 0) {
+        // The storage keeps what it appended, so only the rest is retried
+        _file_offset += result;
+        data = (const uint8_t *)data + result;
+        len -= result;
+        if (_held_len) {
+            memmove(_held, data, len);
+            _held_len = len;
+        }
+    }
+    _fault_stats.failures++;
+    _fault_stats.short_writes += result >= 0;
+    _fault_stats.error = errno;     // Set by partial appends as well
+    _fault_retry_ms = clockMs();
+    DEBUG_PRINTLNF("FSLogHandler::holdWrite() write of %u bytes FAILED! result=%i errno=%i", len, result, errno);
+
+    if (_held_len) {
+        // A retry of the held block failed
+        _fault_backoff_ms = _fault_backoff_ms * 2 < FS_LOG_HANDLER_RETRY_MAX_MS ? _fault_backoff_ms * 2 :
+                FS_LOG_HANDLER_RETRY_MAX_MS;
+        return;
+    }
+
+    if (len > _held_size) {
+        delete[] _held;
+        _held = new (std::nothrow) uint8_t[len];
+        _held_size = _held ? len : 0;
+    }
+    if (!_held) {
+        _fault_stats.bytes_lost += len;
+        return;
+    }
+    memcpy(_held, data, len);
+    _held_len = len;
+    _fault_since_ms = _fault_retry_ms;
+    _fault_backoff_ms = FS_LOG_HANDLER_RETRY_MIN_MS;
+    if (_stalled) {
+        endStall();
+    }
+    _fault_drops = getDropCount();
+}
+
+// Retry the held block once its backoff has passed, first freeing space or reopening the logfile depending on how it
+// failed.  Returns true once the held block is written.
+bool FSLogHandler::retryHeld(bool force) {
+    uint32_t now = clockMs();
+    if (!force && now - _fault_retry_ms < _fault_backoff_ms) {
+        return false;
+    }
+    _fault_stats.retries++;
+
+    if (_fault_stats.error == ENOSPC) {
+        evictOldest();
+    } else if (_fault_stats.error > 0) {
+        _storage->close();
+        _open = _storage->open();
+        _fault_stats.reopens++;
+    }
+    int result = -1;
+    if (_open) {
+        result = writeData(_held, _held_len);
+    }
+    if (result != (int)_held_len) {
+        holdWrite(_held, _held_len, result);
+        return false;
+    }
+
+    uint32_t elapsed = clockMs() - _fault_since_ms;
+    _fault_stats.faults++;
+    _fault_stats.records_lost += getDropCount() - _fault_drops;
+    _fault_stats.recovery_ms_last = elapsed;
+    if (elapsed > _fault_stats.recovery_ms_max) {
+        _fault_stats.recovery_ms_max = elapsed;
+    }
+    _fault_stats.error = 0;
+    _held_len = 0;
+    DEBUG_PRINTLNF("FSLogHandler::retryHeld() recovered after %u ms", elapsed);
+    return true;
+}
+
+// Count what was dropped during a run of fsync() stalls as lost
+void FSLogHandler::endStall() {
+    _fault_stats.records_lost += getDropCount() - _stall_drops;
+    _stalled = false;
+}
+
+FSLogHandler::FaultStats FSLogHandler::faultStats() {
+    os_mutex_lock(_lock);
+    FaultStats stats = _fault_stats;
+    if (_held_len) {
+        stats.records_lost += getDropCount() - _fault_drops;
+    } else if (_stalled) {
+        stats.records_lost += getDropCount() - _stall_drops;
+    }
+    os_mutex_unlock(_lock);
+    return stats;
+}
+
+// Free space by deleting the oldest rotated logfile that isn't the current one.  Returns false if there is none.
+bool FSLogHandler::evictOldest() {
+    for (uint32_t age = _rot_files ? _rot_files - 1 : 0; age > 0; age--) {
+        if (age > _generation) {
+            continue;   // Not created yet
+        }
+        String path = generationPath(_generation - age);
+        if (unlink(path.c_str()) == 0) {
+            unlink((path + FSLOG_IDX_SUFFIX).c_str());
+            _fault_stats.evictions++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Move everything committed to the RAM buffers into the file, highest priority lane first.  The bulk lane is left alone
+// until it is due unless all is set.  Single consumer: called from loop() or the writer thread (never both), and the
+// destructor.
+size_t FSLogHandler::drain(bool all) {
+    if (_held_len && !retryHeld(false)) {
+        return 0;   // Records wait in the RAM buffers until the logfile takes writes again
+    }
+    if (!_bytes_queued) {
+        _unsynced_since_ms = clockMs();     // Whatever this pass writes is the oldest unsynced data
+    }
+    if (_dedup_size) {
+        dedupFlush(all);     // Queues summaries for runs that timed out, so they go out in this pass
+    }
+    size_t bytes = drainUrgent();
+    if (_flight_on) {
+        bytes += drainFlight();
+    }
+    bytes += drainLane(_buffer);
+    if (_bulk_on && (all || _bulk.used() >= _bulk.capacity() / 2 || clockMs() - _last_sync_ms >= _fsync_timeout_s * 1000)) {
+        bytes += drainLane(_bulk);
+    }
+
+    // Space was freed, so mark the gap left by any records lost since the last marker
+    uint32_t drops = getDropCount();
+    if (bytes && drops != _drops_reported) {
+        writeNotice("fslog", drops - _drops_reported, "dropped");
+        _drops_reported = drops;
+    }
+
+    if (_rate_count && (all || clockMs() - _rate_summary_ms >= FS_LOG_HANDLER_RATE_SUMMARY_S * 1000)) {
+        writeRateSummaries();
+    }
+    if (_stats_period_ms && clockMs() - _stats_emit_ms >= _stats_period_ms) {
+        writeStatsRecord();
+    }
+    return bytes;
+}
+
+size_t FSLogHandler::drainLane(FSLogRingBuffer &lane) {
+    if (lane.empty()) {
+        return 0;
+    }
+
+    if (!fileInit()) {
+        TRACE_PRINTLNF("FSLogHandler::drainLane() fileInit() for file %s returned FALSE", _path.c_str());
+        return 0;
+    }
+
+    size_t bytes = 0;
+    size_t len;
+    const char *data;
+    while (!_held_len && (data = lane.peek(&len)) != nullptr) {
+        // Urgent records that arrive while a backlog is being written go ahead of the rest of it
+        if (&lane != &_urgent && _urgent_on) {
+            bytes += drainUrgent();
+            urgentSync();
+        }
+        if (!writeRecord(data, len)) {
+            break;
+        }
+        lane.pop();
+        bytes += len;
+    }
+    return bytes;
+}
+
+size_t FSLogHandler::drainUrgent() {
+    if (!_urgent_on || _urgent.empty()) {
+        return 0;
+    }
+
+    size_t bytes = drainLane(_urgent);
+    if (bytes && !_urgent_unsynced) {
+        _urgent_unsynced = true;
+        _urgent_written_ms = clockMs();
+    }
+    return bytes;
+}
+
+// fsync() once the oldest unsynced urgent record reaches its deadline
+void FSLogHandler::urgentSync() {
+    if (_urgent_unsynced && _open && clockMs() - _urgent_written_ms >= _urgent_sync_ms) {
+        timedSync();
+    }
+}
+
+// Largest record any of the rings can hold
+size_t FSLogHandler::largestRecord() {
+    size_t size = _buffer.capacity();
+    if (_urgent_on && _urgent.capacity() > size) {
+        size = _urgent.capacity();
+    }
+    if (_bulk_on && _bulk.capacity() > size) {
+        size = _bulk.capacity();
+    }
+    if (_flight_on && _flight.capacity() > size) {
+        size = _flight.capacity();
+    }
+    return size;
+}
+
+// How far out of time order records can land in the file: lanes are drained at least once per fsync timeout, and the
+// flight recorder writes up to pre_s of history late
+uint32_t FSLogHandler::reorderWindow() {
+    uint32_t window = 0;
+    if (_urgent_on || _bulk_on || _flight_on) {
+        window += _fsync_timeout_s * 1000;
+    }
+    if (_flight_on) {
+        window += _flight_pre_ms;
+    }
+    return window;
+}
+
+// Write one record taken from a RAM ring.  Returns false if the file couldn't be reopened after a rotation.
+bool FSLogHandler::writeRecord(const char *data, size_t len) {
+    // Rotate between records so binary records never straddle files
+    if (_rot_files && _file_offset + (off_t)_block_used >= (off_t)_rot_bytes) {
+        rotate();
+        if (!fileInit()) {
+            return false;
+        }
+    }
+
+    if (_format == FORMAT_BINARY) {
+        writeBinaryRecord(data, len);
+        if (_journal) {
+            journalCommit();
+        }
+    } else if (_journal) {
+        indexRecord(data, len);
+        _bytes_queued += len;
+        journalRecord(data, len);
+    } else {
+        indexRecord(data, len);
+        writeToFile(data, len);
+    }
+    return true;
+}
+
+// Persist the window around pending triggers: from pre_s before the earliest to post_s after the most recent, and discard
+// the records that have aged out.  The triggers stay pending until the whole window is written, so a failed write is
+// retried on the next pass.  Called by drain() before the main ring, so the pre-trigger history lands ahead of the
+// records queued when the trigger fired.
+size_t FSLogHandler::drainFlight() {
+    uint32_t triggers = _flight_triggers.load();
+    uint32_t first_ms = _flight_pending_ms.load();
+    uint32_t trigger_ms = _flight_trigger_ms;
+    uint32_t now = clockMs();
+    if (_flight_post && now - trigger_ms >= _flight_post_ms) {
+        // A trigger that fires while clearing has already stored its time, so it's seen here and reopens the window
+        _flight_post = false;
+        if (_flight_trigger_ms != trigger_ms) {
+            _flight_post = true;
+        }
+    }
+
+    size_t bytes = 0;
+    size_t len;
+    const char *data;
+    bool written = true;
+    while ((data = _flight.peek(&len)) != nullptr) {
+        uint32_t time;
+        memcpy(&time, data, sizeof(time));
+        const char *record = data + sizeof(time);
+        size_t record_len = len - sizeof(time);
+
+        // Records may also be captured a little after the trigger, before producers see the post window
+        if (first_ms && (int32_t)(time - trigger_ms) > (int32_t)_flight_post_ms) {
+            break;      // After the window, kept as history for the next trigger
+        } else if (first_ms && (int32_t)(first_ms - time) <= (int32_t)_flight_pre_ms) {
+            if (_held_len || !fileInit() || !writeRecord(record, record_len)) {
+                written = false;
+                break;
+            }
+            _flight_persisted += record_len;
+            bytes += record_len;
+        } else if (first_ms || now - time > _flight_pre_ms || _flight.used() > _flight.capacity() / 4 * 3) {
+            _flight_avoided += record_len;
+        } else {
+            break;      // Still within the pre-trigger window
+        }
+        _flight.pop();
+    }
+
+    if (first_ms && written) {
+        _flight_pending_ms.compare_exchange_strong(first_ms, 0);
+        // A trigger that fired during this pass found the slot taken, so claim it on its behalf
+        if (_flight_triggers.load() != triggers) {
+            uint32_t none = 0;
+            uint32_t latest = _flight_trigger_ms;
+            _flight_pending_ms.compare_exchange_strong(none, latest ? latest : 1);
+        }
+    }
+    return bytes;
+}
+
+// Limit configured for exactly the first len characters of category
+FSLogHandler::RateLimit *FSLogHandler::findRateLimit(uint32_t hash, const char *category, size_t len) {
+    size_t slot = hash % FSLOG_ARRAY_SIZE(_rate_table);
+    while (_rate_table[slot] != -1) {
+        RateLimit *limit = &_rate_limits[_rate_table[slot]];
+        if (limit->hash == hash && limit->category.length() == len && strncmp(limit->category.c_str(), category, len) == 0) {
+            return limit;
+        }
+        slot = (slot + 1) % FSLOG_ARRAY_SIZE(_rate_table);
+    }
+    return nullptr;
+}
+
+// Take a token from the bucket of the most specific rate limit covering category.  The category is hashed once, with a
+// table lookup at every '.' and at the end, so the cost doesn't depend on the number of limits.  Safe from any thread.
+bool FSLogHandler::admitRecord(const char *category, uint32_t callsite) {
+    if (!_rate_count || !category) {
+        return true;
+    }
+
+    RateLimit *limit = nullptr;
+    uint32_t hash = fslogHash("", 0);
+    for (const char *p = category; ; p++) {
+        if (*p == '.' || *p == '\0') {
+            RateLimit *match = findRateLimit(hash, category, p - category);
+            if (match) {
+                limit = match;
+            }
+            if (*p == '\0') {
+                break;
+            }
+        }
+        hash = fslogHash(p, 1, hash);
+    }
+    if (!limit) {
+        return true;
+    }
+
+    RateBucket &bucket = limit->bucket[callsite % limit->buckets];
+    uint32_t now = clockMs();
+    uint32_t last = bucket.last_ms.load(std::memory_order_relaxed);
+    uint32_t elapsed = now - last;
+    if (elapsed && bucket.last_ms.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+        // Only the producer that moved last_ms adds the tokens for the elapsed time
+        uint64_t add = (uint64_t)elapsed * limit->rate;
+        uint32_t tokens = bucket.tokens.load(std::memory_order_relaxed);
+        uint32_t refilled;
+        do {
+            refilled = limit->capacity - tokens < add ? limit->capacity : tokens + (uint32_t)add;
+        } while (!bucket.tokens.compare_exchange_weak(tokens, refilled, std::memory_order_relaxed));
+    }
+
+    uint32_t tokens = bucket.tokens.load(std::memory_order_relaxed);
+    do {
+        if (tokens < 1000) {
+            limit->suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    } while (!bucket.tokens.compare_exchange_weak(tokens, tokens - 1000, std::memory_order_relaxed));
+    return true;
+}
+
+// Consumer only: write one summary record per rate limit that refused records since the last pass
+void FSLogHandler::writeRateSummaries() {
+    _rate_summary_ms = clockMs();
+    for (size_t i = 0; i < _rate_count; i++) {
+        uint32_t suppressed = _rate_limits[i].suppressed.exchange(0, std::memory_order_relaxed);
+        if (suppressed && fileInit()) {
+            writeNotice(_rate_limits[i].category.c_str(), suppressed, "suppressed");
+        }
+    }
+}
+
+// A category matches a filter naming it or one of its parents
+static bool categoryMatches(const char *category, const char *filter) {
+    size_t len = strlen(filter);
+    return strncmp(category, filter, len) == 0 && (category[len] == '\0' || category[len] == '.');
+}
+
+// Pick the ring for a record and reserve len bytes in it.  Records below the flight recorder's persist level go to the
+// flight recorder ring behind their capture time, unless a trigger's post window is open.  Everything else goes to the
+// lane for its level.
+char *FSLogHandler::reserveRecord(LogLevel level, const char *category, size_t len, FSLogRingBuffer **ring) {
+    if (_flight_on) {
+        if (level >= _flight_trigger_level ||
+                (category && _flight_trigger_category.length() && categoryMatches(category, _flight_trigger_category.c_str()))) {
+            triggerFlightRecorder();
+        }
+        if (level < _flight_persist && !(_flight_post && clockMs() - _flight_trigger_ms < _flight_post_ms)) {
+            char *span = _flight.reserve(sizeof(uint32_t) + len);
+            if (!span) {
+                return nullptr;
+            }
+            uint32_t now = clockMs();
+            memcpy(span, &now, sizeof(now));
+            *ring = &_flight;
+            return span + sizeof(now);
+        }
+    }
+
+    if (_urgent_on && level >= _urgent_level) {
+        *ring = &_urgent;
+    } else if (_bulk_on && level < _bulk_level) {
+        *ring = &_bulk;
+    } else {
+        *ring = &_buffer;
+    }
+    return reserveLane(**ring, level, len);
+}
+
+// Reserve len bytes in a lane, applying the backpressure policy if it is full
+char *FSLogHandler::reserveLane(FSLogRingBuffer &lane, LogLevel level, size_t len) {
+    if (_backpressure == BACKPRESSURE_DEGRADE && level < _degrade_level && lane.used() >= lane.capacity() / 2) {
+        _drops_degraded.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    char *span = lane.reserve(len);
+    if (span) {
+        return span;
+    }
+
+    os_thread_t writer = _writer;
+    if (_backpressure == BACKPRESSURE_DROP_OLDEST) {
+        span = reserveEvicting(lane, len);
+    } else if (_backpressure == BACKPRESSURE_BLOCK && writer && !HAL_IsISR() && !system_thread_current(nullptr) &&
+            !os_thread_is_current(writer)) {
+        span = reserveBlocking(lane, len);
+        if (!span) {
+            _drops_timeouts.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+    }
+    if (!span) {
+        _drops_newest.fetch_add(1, std::memory_order_relaxed);
+    }
+    return span;
+}
+
+// BACKPRESSURE_DROP_OLDEST: discard the oldest records until the new one fits.  Popping is the consumer's job, so this
+// only happens when the consumer's lock can be taken without waiting.
+char *FSLogHandler::reserveEvicting(FSLogRingBuffer &lane, size_t len) {
+    if (HAL_IsISR() || os_mutex_trylock(_lock) != 0) {
+        return nullptr;
+    }
+
+    char *span = nullptr;
+    size_t oldest_len;
+    while (!span && lane.peek(&oldest_len)) {
+        lane.pop();
+        _drops_oldest.fetch_add(1, std::memory_order_relaxed);
+        span = lane.reserve(len);
+    }
+    os_mutex_unlock(_lock);
+    return span;
+}
+
+// BACKPRESSURE_BLOCK: keep waking the writer thread until it makes room or the timeout expires
+char *FSLogHandler::reserveBlocking(FSLogRingBuffer &lane, size_t len) {
+    uint32_t start = millis();
+    char *span = nullptr;
+    while (!span && millis() - start < _block_ms) {
+        os_semaphore_give(_writer_wake, false);
+        HAL_Delay_Milliseconds(1);
+        span = lane.reserve(len);
+    }
+    return span;
+}
+
+FSLogHandler::DropStats FSLogHandler::dropStats() {
+    DropStats stats;
+    stats.newest = _drops_newest.load(std::memory_order_relaxed);
+    stats.oldest = _drops_oldest.load(std::memory_order_relaxed);
+    stats.timeouts = _drops_timeouts.load(std::memory_order_relaxed);
+    stats.degraded = _drops_degraded.load(std::memory_order_relaxed);
+    return stats;
+}
+
+uint32_t FSLogHandler::getDropCount() {
+    DropStats stats = dropStats();
+    return stats.newest + stats.oldest + stats.timeouts + stats.degraded;
+}
+
+void FSLogHandler::commitRecord(FSLogRingBuffer *ring, char *span, size_t len) {
+    if (ring == &_flight) {
+        _flight.commit(span - sizeof(uint32_t), sizeof(uint32_t) + len);
+        // Let the writer thread age records out before the ring fills up
+        if (_writer && _flight.used() > _flight.capacity() / 4 * 3) {
+            os_semaphore_give(_writer_wake, false);
+        }
+        return;
+    }
+
+    ring->commit(span, len);
+
+    // High-water mark, only written when it actually rises
+    std::atomic<uint32_t> &high_water = _stat_high_water[ring == &_buffer ? 0 : ring == &_urgent ? 1 : 2];
+    uint32_t used = ring->used();
+    uint32_t mark = high_water.load(std::memory_order_relaxed);
+    while (used > mark && !high_water.compare_exchange_weak(mark, used, std::memory_order_relaxed)) {
+    }
+
+    if (ring == &_buffer) {
+        notifyWriter();
+    } else if (_writer && (ring == &_urgent || _bulk.used() >= _bulk.capacity() / 2)) {
+        os_semaphore_give(_writer_wake, false);
+    }
+}
+
+void FSLogHandler::loop() {
+    runDumpJobs();
+
+    if (_writer) {
+        return;     // The writer thread owns draining and syncing
+    }
+
+    os_mutex_lock(_lock);
+    schedulePass();
+    drain(false);
+    if (syncDue()) {
+        timedSync();
+    } else if (_open) {
+        urgentSync();
+    }
+    if (_open) {
+        _storage->maintain();
+    }
+    os_mutex_unlock(_lock);
+}
+
+// Open our file if not opened
+bool FSLogHandler::fileInit() {
+    if (!_open) {
+        _file_offset = 0;
+        if (!(_storage == &_file ? logfileInit() : _storage->open())) {
+            DEBUG_PRINTLNF("FSLogHandler::fileInit() Logfile \"%s\" open FAILED! errno=%i", _path.c_str(), errno);
+            return false;
+        }
+        TRACE_PRINTLNF("FSLogHandler::fileInit() Logfile \"%s\" opened successfully!", _path.c_str());
+        _open = true;
+        _block_used = 0;
+
+        if (_journal) {
+            _file_offset = _journal_end;
+            _journal_block = -1;    // Resync right away, the previous session's marker may be far back
+            if (_file_offset == 0) {
+                char header[FSLOG_J_HEADER_SIZE] = { 'F', 'S', 'L', 'J', FSLOG_J_VERSION, 0, 0, 0 };
+                stage(header, sizeof(header));
+            }
+            // Binary records are assembled before framing, and can't outgrow the ring slot they came from by more
+            // than their varints
+            size_t size = _format == FORMAT_BINARY ? largestRecord() + 64 : 0;
+            if (size > _jrec_size) {
+                delete[] _jrec;
+                _jrec = new (std::nothrow) uint8_t[size];
+                _jrec_size = _jrec ? size : 0;
+            }
+            _jrec_used = 0;
+        }
+        indexInit();
+
+        if (_compress) {
+            char header[FSLOG_Z_HEADER_SIZE] = { 'F', 'S', 'L', 'Z', FSLOG_Z_VERSION, 0, 0, 0 };
+            if (writeData(header, sizeof(header)) != sizeof(header)) {
+                DEBUG_PRINTLNF("FSLogHandler::fileInit() header write FAILED! errno=%i", errno);
+            }
+        }
+
+        // Interned ids and timestamp deltas are per file
+        _last_time = 0;
+        _category_count = 0;
+        _callsite_count = 0;
+        if (_format == FORMAT_BINARY) {
+            char header[FSLOG_BIN_HEADER_SIZE] = { 'F', 'S', 'L', 'B', FSLOG_BIN_VERSION, 0, 0, 0 };
+            writeToFile(header, sizeof(header));
+            if (_journal) {
+                journalCommit();
+            }
+        }
+    }
+    return true;
+}
+
+// Open the logfile for the current layout.  A plain file starts over at every open; circular files and journals carry on
+// after what they hold, as storage backends do.
+bool FSLogHandler::logfileInit() {
+    createDirIfNecessary(FS_LOG_HANDLER_DIR);
+    if (_rot_files) {
+        if (!_generation_loaded) {
+            loadGeneration();
+            _path = generationPath(_generation);
+        }
+        saveGeneration();
+    }
+    _file.configure(_path, _circ_capacity);
+    if (!_file.open()) {
+        return false;
+    }
+
+    if (_journal) {
+        if (!journalInit()) {
+            _file.close();
+            return false;
+        }
+    } else if (_circ_capacity) {
+        if (_file.fresh()) {
+            _epoch++;   // Preallocated from scratch
+        }
+    } else {
+        if (!_file.truncate(0)) {
+            _file.close();
+            return false;
+        }
+        if (!_rot_files) {
+            _epoch++;   // Rotated files are told apart by generation instead
+        }
+    }
+    _file_offset = _file.end();
+    return true;
+}
+
+void FSLogHandler::dump(Print &stream, bool read_from_beginning) {
+    if (read_from_beginning) {
+        _dump_cursor.started = false;
+    }
+    int fd = -1;
+    DumpSlice slice = { SIZE_MAX, 0, 0, 0, nullptr };
+    dumpStep(stream, &_dump_cursor, &fd, &slice);
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+FSLogReader::~FSLogReader() {
+    if (_fd != -1) {
+        close(_fd);
+    }
+}
+
+size_t FSLogReader::read(Print &stream, size_t max_bytes, uint32_t max_us) {
+    FSLogHandler::DumpSlice slice = { max_bytes, 0, micros(), max_us, nullptr };
+    _caught_up = _handler.dumpStep(stream, &_cursor, &_fd, &slice);
+    return slice.written;
+}
+
+void FSLogReader::rewind() {
+    _cursor.started = false;
+    _caught_up = false;
+}
+
+void FSLogReader::seek(const FSLogCursor &cursor) {
+    if (_fd != -1 && cursor.generation != _cursor.generation) {
+        close(_fd);
+        _fd = -1;
+    }
+    _cursor = cursor;
+    _caught_up = false;
+}
+
+// Saved positions are a small fixed record: magic, version, then the cursor fields that survive a reboot
+#define READER_MAGIC    "FSLR"
+#define READER_VERSION  1
+
+struct SavedPosition {
+    char magic[4];
+    uint32_t version;
+    uint32_t generation;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t logical;
+};
+
+bool FSLogReader::save(const char *path) const {
+    SavedPosition saved = { { 'F', 'S', 'L', 'R' }, READER_VERSION, _cursor.generation, 0, (uint64_t)_cursor.offset,
+            _cursor.logical };
+    int fd = FSLOG_OPEN(path, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd == -1) {
+        DEBUG_PRINTLNF("FSLogReader::save() open of \"%s\" FAILED! errno=%i", path, errno);
+        return false;
+    }
+    bool ok = ::write(fd, &saved, sizeof(saved)) == sizeof(saved) && fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+bool FSLogReader::restore(const char *path) {
+    SavedPosition saved;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = ::read(fd, &saved, sizeof(saved)) == sizeof(saved) && memcmp(saved.magic, READER_MAGIC, 4) == 0 &&
+            saved.version == READER_VERSION;
+    close(fd);
+
+    // The log may have been cleared or rotated since; a position past the end of its data can't be trusted
+    if (ok && _handler.storageDump()) {
+        uint64_t position = saved.logical;
+        os_mutex_lock(_handler._lock);
+        ok = _handler._storage->read(&position, nullptr, 0) == 0 && (position == saved.logical || !saved.logical);
+        os_mutex_unlock(_handler._lock);
+    } else if (ok) {
+        String file = _handler._rot_files ? _handler.generationPath(saved.generation) : _handler._path;
+        struct stat statbuf;
+        ok = stat(file, &statbuf) == 0 && (uint64_t)statbuf.st_size >= saved.offset;
+    }
+    if (!ok) {
+        rewind();
+        return false;
+    }
+
+    FSLogCursor cursor = {};
+    cursor.generation = saved.generation;
+    cursor.offset = (_off_t)saved.offset;
+    cursor.logical = saved.logical;
+    cursor.epoch = _handler._epoch;
+    cursor.started = true;
+    seek(cursor);
+    return true;
+}
+
+FSLogDumpJob::~FSLogDumpJob() {
+    if (_handler) {
+        _handler->cancelDump(*this);
+    }
+}
+
+bool FSLogHandler::startDump(FSLogDumpJob &job) {
+    if (job._handler) {
+        return false;
+    }
+    job._cursor.started = false;
+    job._bytes = 0;
+    job._handler = this;
+    job._next = nullptr;
+
+    FSLogDumpJob **tail = &_dump_jobs;
+    while (*tail) {
+        tail = &(*tail)->_next;
+    }
+    *tail = &job;
+    return true;
+}
+
+void FSLogHandler::cancelDump(FSLogDumpJob &job) {
+    for (FSLogDumpJob **p = &_dump_jobs; *p; p = &(*p)->_next) {
+        if (*p == &job) {
+            *p = job._next;
+            break;
+        }
+    }
+    if (job._fd != -1) {
+        close(job._fd);
+        job._fd = -1;
+    }
+    job._handler = nullptr;
+}
+
+// Give each running job one slice of its budget.  Callbacks may start or cancel jobs, so the next job is looked up
+// after them.
+void FSLogHandler::runDumpJobs() {
+    FSLogDumpJob *job = _dump_jobs;
+    while (job) {
+        DumpSlice slice = { job->_budget_bytes, 0, micros(), job->_budget_us, nullptr };
+        bool done = dumpStep(job->_stream, &job->_cursor, &job->_fd, &slice);
+        job->_bytes += slice.written;
+
+        FSLogDumpJob *next = job->_next;
+        if (slice.written && job->_on_progress) {
+            job->_on_progress(*job);
+            next = job->_handler ? job->_next : next;
+        }
+        if (done && job->_handler) {
+            next = job->_next;
+            cancelDump(*job);
+            if (job->_on_complete) {
+                job->_on_complete(*job);
+            }
+        }
+        job = next;
+    }
+}
+
+// Dump from cursor until the budget runs out, walking rotated files oldest first.  fd is the caller's handle on the file
+// the cursor is in, opened here as needed.  Returns true once the cursor has caught up with the end of the log.
+bool FSLogHandler::dumpStep(Print &stream, FSLogCursor *cursor, int *fd, DumpSlice *slice) {
+    // Allocated per slice rather than kept, dumps are rare and may run from any thread
+    uint8_t *buf = new (std::nothrow) uint8_t[_dump_chunk];
+    if (!buf) {
+        DEBUG_PRINTLNF("FSLogHandler::dumpStep() allocation of %u bytes FAILED", _dump_chunk);
+        return false;
+    }
+    slice->buf = buf;
+    bool caught_up = dumpFiles(stream, cursor, fd, slice);
+    // Records staged in the write block aren't in the file yet.  Flush them once the dump has caught up, rather than
+    // before every slice, so running dumps don't break up write blocks.
+    if (caught_up && !slice->exhausted() && flushStaged()) {
+        caught_up = dumpFiles(stream, cursor, fd, slice);
+    }
+    delete[] buf;
+    return caught_up;
+}
+
+// Write out a partly filled write block, returns false if there was nothing to write
+bool FSLogHandler::flushStaged() {
+    os_mutex_lock(_lock);
+    bool flushed = _open && _block_used && !_held_len;
+    if (flushed) {
+        flushBlock();
+    }
+    os_mutex_unlock(_lock);
+    return flushed;
+}
+
+// Read through the storage where it holds the whole log as is; rotated generations, compressed frames and text journal
+// records are walked file by file
+bool FSLogHandler::dumpFiles(Print &stream, FSLogCursor *cursor, int *fd, DumpSlice *slice) {
+    if (storageDump()) {
+        return dumpStorage(stream, cursor, slice);
+    }
+
+    os_mutex_lock(_lock);
+    uint32_t current = _generation;
+    if (_rot_files && !_generation_loaded && !readGeneration(&current)) {
+        current = 0;    // Not opened yet this session, so the newest file is the one the manifest names
+    }
+    os_mutex_unlock(_lock);
+    uint32_t oldest = _rot_files && current >= _rot_files ? current - _rot_files + 1 : 0;
+
+    if (!cursor->started || cursor->epoch != _epoch ||
+            (_rot_files && (cursor->generation < oldest || cursor->generation > current))) {
+        // New dump, or the data the cursor was in has been cleared, truncated or rotated away
+        cursor->epoch = _epoch;
+        cursor->generation = _rot_files ? oldest : 0;
+        cursor->offset = 0;
+        cursor->logical = 0;
+        cursor->started = false;
+        if (*fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+
+    for (;;) {
+        if (*fd == -1) {
+            String path = _rot_files ? generationPath(cursor->generation) : _path;
+            *fd = open(path, O_RDONLY);
+            if (*fd == -1 && errno == ENOENT && _rot_files && cursor->generation < current) {
+                cursor->generation++;   // Deleted to free space, see evictOldest()
+                cursor->offset = 0;
+                continue;
+            }
+            if (*fd == -1) {
+                DEBUG_PRINTLNF("Logfile for dump \"%s\" open FAILED! errno=%i", path.c_str(), errno);
+                return true;
+            }
+        }
+
+        bool caught_up;
+        if (_compress) {
+            caught_up = dumpFrames(stream, *fd, cursor, slice);
+        } else if (_journal && _format == FORMAT_TEXT) {
+            // Binary journals are dumped as is, for tools/fslog_decode
+            caught_up = dumpJournal(stream, *fd, cursor, slice);
+        } else {
+            caught_up = dumpRaw(stream, *fd, cursor, slice);
+        }
+        cursor->started = true;
+
+        if (!caught_up || !_rot_files || cursor->generation >= current) {
+            return caught_up;
+        }
+        close(*fd);
+        *fd = -1;
+        cursor->generation++;
+        cursor->offset = 0;
+    }
+}
+
+// Hand the stream whole aligned chunks straight from the read buffer.  A stream that takes less than it is given (a
+// non-blocking Serial with a full TX buffer) ends the slice, and the rest is sent from the cursor next time.
+bool FSLogHandler::dumpRaw(Print &stream, int fd, FSLogCursor *cursor, DumpSlice *slice) {
+    lseek(fd, cursor->offset, SEEK_SET);
+    while (!slice->exhausted()) {
+        size_t n = _dump_chunk - (size_t)(cursor->offset % _dump_chunk);
+        int bytes = read(fd, slice->buf, n);
+        if (bytes <= 0) {
+            return true;
+        }
+        size_t written = stream.write(slice->buf, bytes);
+        cursor->offset += (_off_t)written;
+        slice->spend(written);
+        if (written < (size_t)bytes) {
+            return false;
+        }
+        Particle.process();
+    }
+    return false;
+}
+
+// Dump from the storage.  The cursor holds the storage position of the last read and, in offset, how much of it
+// the stream has taken; reading the same position again gives the same bytes, so the rest is sent next time.
+bool FSLogHandler::dumpStorage(Print &stream, FSLogCursor *cursor, DumpSlice *slice) {
+    if (!cursor->started || cursor->epoch != _epoch) {
+        cursor->epoch = _epoch;
+        cursor->generation = 0;
+        cursor->offset = 0;
+        cursor->logical = 0;
+        cursor->started = true;
+    }
+
+    while (!slice->exhausted()) {
+        uint64_t next = cursor->logical;
+        os_mutex_lock(_lock);
+        int bytes = _storage->read(&next, slice->buf, _dump_chunk);
+        os_mutex_unlock(_lock);
+        if (bytes <= 0) {
+            return true;
+        }
+        size_t sent = (size_t)cursor->offset;
+        if (sent >= (size_t)bytes) {
+            sent = 0;   // Overwritten since the last slice, send what replaced it
+        }
+        size_t written = stream.write(slice->buf + sent, bytes - sent);
+        slice->spend(written);
+        if (sent + written < (size_t)bytes) {
+            cursor->offset = (_off_t)(sent + written);
+            return false;
+        }
+        cursor->logical = next;
+        cursor->offset = 0;
+        Particle.process();
+    }
+    return false;
+}
+
+// Prepare the opened journal for appending, cutting off whatever follows the last intact record.  Anything that isn't a
+// journal is replaced.
+bool FSLogHandler::journalInit() {
+    _journal_end = 0;
+    uint32_t start = micros();
+    off_t size = _file.end();
+    uint8_t header[FSLOG_J_HEADER_SIZE];
+    off_t end = 0;
+    memset(&_journal_recovery, 0, sizeof(_journal_recovery));
+    if (size >= FSLOG_J_HEADER_SIZE && _file.readAt(0, header, sizeof(header)) == sizeof(header) &&
+            memcmp(header, FSLOG_J_MAGIC, 4) == 0 && header[4] == FSLOG_J_VERSION) {
+        end = journalRecover(size);
+    }
+
+    if (end != size && !_file.truncate(end)) {
+        DEBUG_PRINTLNF("FSLogHandler::journalInit() truncate FAILED! errno=%i", errno);
+        return false;
+    }
+    _journal_end = end;
+    _journal_recovery.bytes_discarded = (uint32_t)(size - end);
+    _journal_recovery.recover_us = micros() - start;
+    DEBUG_PRINTLNF("FSLogHandler::journalInit() resuming at %li, discarded %u bytes", (long)end, _journal_recovery.bytes_discarded);
+    return true;
+}
+
+// Find the end of the valid data.  The last sync marker is at most about one write block plus one record from the end,
+// so only the tail of the file is read however large it is.
+off_t FSLogHandler::journalRecover(off_t size) {
+    uint8_t buf[256 + FSLOG_J_SYNC_SIZE - 1];
+    off_t end = size;
+
+    while (end > FSLOG_J_HEADER_SIZE) {
+        off_t start = end - 256;
+        if (start < FSLOG_J_HEADER_SIZE) {
+            start = FSLOG_J_HEADER_SIZE;
+        }
+        // Overlap the previous chunk so a marker straddling the boundary is still found
+        size_t n = (size_t)(end - start) + FSLOG_J_SYNC_SIZE - 1;
+        if (start + (off_t)n > size) {
+            n = (size_t)(size - start);
+        }
+        int bytes = _file.readAt(start, buf, n);
+        if (bytes <= 0) {
+            break;
+        }
+        _journal_recovery.bytes_scanned += bytes;
 
-    // Sane defaults for fsync triggers
-    configureFsync(4096, 10);
+        for (int i = bytes - FSLOG_J_SYNC_SIZE; i >= 0; i--) {
+            if (memcmp(buf + i, FSLOG_J_SYNC_MAGIC, FSLOG_J_SYNC_SIZE) == 0) {
+                return journalScan(start + i, size);
+            }
+        }
+        end = start;
+    }
+    return journalScan(FSLOG_J_HEADER_SIZE, size);
+}
 
-    // Add this log handler to the system log manager
-    LogManager::instance()->addHandler(this);
+// Walk records and markers from pos, returning the offset of the first one that is torn or fails its CRC
+off_t FSLogHandler::journalScan(off_t pos, off_t size) {
+    while (pos < size) {
+        uint8_t header[FSLOG_J_RECORD_HEADER_MAX];
+        int n = _file.readAt(pos, header, sizeof(header));
+        if (n <= 0) {
+            break;
+        }
+        _journal_recovery.bytes_scanned += n;
+
+        if (n >= FSLOG_J_SYNC_SIZE && memcmp(header, FSLOG_J_SYNC_MAGIC, FSLOG_J_SYNC_SIZE) == 0) {
+            pos += FSLOG_J_SYNC_SIZE;
+            continue;
+        }
+
+        uint32_t crc, len;
+        const uint8_t *p = n > 5 && header[0] == FSLOG_J_RECORD ? fslogGetVarint(header + 5, header + n, &len) : nullptr;
+        if (!p || pos + (p - header) + (off_t)len > size) {
+            break;
+        }
+        memcpy(&crc, header + 1, sizeof(crc));
+        uint32_t check = fslogCrc32(header + 5, p - (header + 5));
+
+        uint8_t buf[128];
+        size_t remaining = len;
+        off_t offset = pos + (p - header);
+        while (remaining) {
+            int bytes = _file.readAt(offset, buf, remaining < sizeof(buf) ? remaining : sizeof(buf));
+            if (bytes <= 0) {
+                break;
+            }
+            _journal_recovery.bytes_scanned += bytes;
+            check = fslogCrc32(buf, bytes, check);
+            offset += bytes;
+            remaining -= bytes;
+        }
+        if (remaining || check != crc) {
+            break;
+        }
+        pos += (p - header) + len;
+    }
+    return pos;
 }
 
-FSLogHandler::~FSLogHandler() {
-    LogManager::instance()->removeHandler(this);
-    syncAndClose();
+// Stage one framed record, preceded by a sync marker if it is the first to start in this write block
+void FSLogHandler::journalRecord(const char *data, size_t len) {
+    off_t block = (_file_offset + (off_t)_block_used) / (off_t)_block_size;
+    if (block != _journal_block) {
+        stage(FSLOG_J_SYNC_MAGIC, FSLOG_J_SYNC_SIZE);
+        _journal_block = block;
+    }
+
+    uint8_t header[FSLOG_J_RECORD_HEADER_MAX];
+    uint8_t *end = fslogPutVarint(header + 5, len);
+    uint32_t crc = fslogCrc32(data, len, fslogCrc32(header + 5, end - (header + 5)));
+    header[0] = FSLOG_J_RECORD;
+    memcpy(header + 1, &crc, sizeof(crc));
+    stage((const char *)header, end - header);
+    stage(data, len);
 }
 
-void FSLogHandler::syncAndClose() {
-    if (_open) {
-        fsync(_fd);
-        close(_fd);
-        _bytes_queued = 0;
-        _open = false;
-        TRACE_PRINTLNF("FSLogHandler()::syncAndClose() File %s closed", _path.c_str());
+// Frame the record collected by writeToFile()
+void FSLogHandler::journalCommit() {
+    if (_jrec_used > _jrec_size) {
+        DEBUG_PRINTLNF("FSLogHandler::journalCommit() %u byte record dropped", _jrec_used);
+    } else if (_jrec_used) {
+        journalRecord((const char *)_jrec, _jrec_used);
     }
+    _jrec_used = 0;
 }
 
-long FSLogHandler::getLogSize() {
+// Emit the payloads of the complete records from cursor onwards, skipping the framing.  Each read fills the buffer with
+// as many records as fit and their payloads are written from it in place; larger records are streamed in pieces.  Like
+// dumpFrames(), the cursor only advances past whole records; cursor->logical counts the payload bytes of the record at
+// the cursor that a short stream write already took.  Stops early if the stream reports a write error.
+bool FSLogHandler::dumpJournal(Print &stream, int fd, FSLogCursor *cursor, DumpSlice *slice) {
+    if (cursor->offset == 0) {
+        cursor->offset = FSLOG_J_HEADER_SIZE;
+        cursor->logical = 0;
+    }
+
     struct stat statbuf;
-    if (_open) {
-        fstat(_fd, &statbuf);
-    } else {
-        stat(_path, &statbuf);
+    off_t size = fstat(fd, &statbuf) == 0 ? statbuf.st_size : 0;
+    while (!slice->exhausted()) {
+        lseek(fd, cursor->offset, SEEK_SET);
+        int n = read(fd, slice->buf, _dump_chunk);
+        if (n <= 0) {
+            return true;
+        }
+
+        const uint8_t *p = slice->buf;
+        const uint8_t *end = p + n;
+        while (p < end && !slice->exhausted()) {
+            if (end - p >= FSLOG_J_SYNC_SIZE && memcmp(p, FSLOG_J_SYNC_MAGIC, FSLOG_J_SYNC_SIZE) == 0) {
+                p += FSLOG_J_SYNC_SIZE;
+                cursor->offset += FSLOG_J_SYNC_SIZE;
+                continue;
+            }
+
+            uint32_t len;
+            const uint8_t *payload = end - p > 5 && *p == FSLOG_J_RECORD ? fslogGetVarint(p + 5, end, &len) : nullptr;
+            if (!payload) {
+                if (p == slice->buf) {
+                    return true;    // Torn header or no more records
+                }
+                break;              // Header straddles the end of the buffer, read again from it
+            }
+            size_t header_len = payload - p;
+            if (cursor->offset + (off_t)(header_len + len) > size) {
+                return true;        // Still being written
+            }
+
+            size_t skip = (size_t)cursor->logical;
+            size_t sent;
+            if (payload + len <= end) {
+                sent = stream.write(payload + skip, len - skip);
+            } else if (p == slice->buf) {
+                sent = dumpJournalPayload(stream, fd, cursor->offset + header_len + skip, len - skip, slice);
+            } else {
+                break;              // Read again from the start of this record
+            }
+            slice->spend(sent);
+            if (sent < len - skip) {
+                cursor->logical += sent;
+                return false;
+            }
+            cursor->logical = 0;
+            cursor->offset += header_len + len;
+            p = payload + len;
+            if (stream.getWriteError()) {
+                return true;
+            }
+        }
+        Particle.process();
     }
-    return statbuf.st_size;
+    return false;
 }
 
-void FSLogHandler::clearLogs() {
-    syncAndClose();
-    unlink(getPath().c_str());
-    TRACE_PRINTLNF("FSLogHandler()::clearLogs() Close and delete logfile %s", _path.c_str());
+// Stream a record payload too large for the read buffer, returning how much of it the stream took
+size_t FSLogHandler::dumpJournalPayload(Print &stream, int fd, off_t offset, size_t len, DumpSlice *slice) {
+    size_t sent = 0;
+    lseek(fd, offset, SEEK_SET);
+    while (sent < len) {
+        int bytes = read(fd, slice->buf, len - sent < _dump_chunk ? len - sent : _dump_chunk);
+        if (bytes <= 0) {
+            break;
+        }
+        size_t written = stream.write(slice->buf, bytes);
+        sent += written;
+        if (written < (size_t)bytes) {
+            break;
+        }
+    }
+    return sent;
+}
+
+// Timestamp of a text record, "0000012345 " at the start of the line.  Dumped lines may begin with the '\r' of the
+// previous line's "\n\r".
+static bool recordTime(const char *p, size_t len, uint32_t *time) {
+    if (len && *p == '\r') {
+        p++;
+        len--;
+    }
+    if (len < 11 || p[10] != ' ') {
+        return false;
+    }
+    uint32_t value = 0;
+    for (int i = 0; i < 10; i++) {
+        if (p[i] < '0' || p[i] > '9') {
+            return false;
+        }
+        value = value * 10 + (p[i] - '0');
+    }
+    *time = value;
+    return true;
+}
+
+bool FSLogHandler::indexActive() {
+    return _index && _format == FORMAT_TEXT && !_compress && !_circ_capacity;
 }
 
-void FSLogHandler::writeToFile(String message) {
-    int result = ::write(_fd, message.c_str(), message.length());
-    if (result == -1) {
-        DEBUG_PRINTLNF("FSLogHandler::write() FAILED! Errno=%i", errno);
+// Open the index of the current logfile, dropping entries past the data that survived (everything, for a new file)
+void FSLogHandler::indexInit() {
+    _idx_block = -1;
+    _idx_last_time = 0;
+    _idx_pending_count = 0;
+    if (!indexActive()) {
+        return;
+    }
+
+    _idx_fd = FSLOG_OPEN(_path + FSLOG_IDX_SUFFIX, O_RDWR | O_CREAT);
+    if (_idx_fd == -1) {
+        DEBUG_PRINTLNF("FSLogHandler::indexInit() open FAILED! errno=%i", errno);
         return;
     }
-    _bytes_queued += message.length();
-    // fsync(_fd);
-    TRACE_PRINTF("FSLogHandler::write() msg=%s", message.c_str());
+
+    struct stat statbuf;
+    off_t end = fstat(_idx_fd, &statbuf) == 0 ? statbuf.st_size - statbuf.st_size % FSLOG_IDX_ENTRY_SIZE : 0;
+    while (end > 0) {
+        uint32_t entry[2];
+        lseek(_idx_fd, end - FSLOG_IDX_ENTRY_SIZE, SEEK_SET);
+        if (read(_idx_fd, entry, sizeof(entry)) != sizeof(entry)) {
+            end = 0;
+        } else if ((off_t)entry[1] >= _file_offset) {
+            end -= FSLOG_IDX_ENTRY_SIZE;
+        } else {
+            _idx_last_time = entry[0];
+            break;
+        }
+    }
+    ftruncate(_idx_fd, end);
+    lseek(_idx_fd, end, SEEK_SET);
 }
 
-void FSLogHandler::loop() {
-    static unsigned int last_ran = System.uptime();
-    if (_open) {
-        if ( (System.uptime() - last_ran > 10 && _bytes_queued > 0) || (_bytes_queued > 4096) ) {
-            DEBUG_PRINTLNF("FSLogHandler::loop() fsync() %u bytes", _bytes_queued);
-            fsync(_fd);
-            _bytes_queued = 0;
-            last_ran = System.uptime();
+// Called with each text record before it is staged
+void FSLogHandler::indexRecord(const char *data, size_t len) {
+    uint32_t time;
+    off_t offset = _file_offset + (off_t)_block_used;
+    if (_idx_fd == -1 || offset / (off_t)_block_size == _idx_block || !recordTime(data, len, &time)) {
+        return;
+    }
+
+    if (time < _idx_last_time) {
+        if (_idx_block != -1) {
+            return;     // Written late by a lane or the flight recorder, see reorderWindow()
         }
+        // Time went backwards across sessions, so the index would no longer be sorted
+        _idx_pending_count = 0;
+        ftruncate(_idx_fd, 0);
+        lseek(_idx_fd, 0, SEEK_SET);
     }
+    if (_idx_pending_count * FSLOG_IDX_ENTRY_SIZE == sizeof(_idx_pending)) {
+        indexFlush();
+    }
+    uint32_t entry[2] = { time, (uint32_t)offset };
+    memcpy(_idx_pending + _idx_pending_count++ * FSLOG_IDX_ENTRY_SIZE, entry, sizeof(entry));
+    _idx_block = offset / (off_t)_block_size;
+    _idx_last_time = time;
 }
 
-// Open our file if not opened
-bool FSLogHandler::fileInit() {
-    if (!_open || _fd == -1) {
-        createDirIfNecessary("/log");
-        _fd = open(_path, O_WRONLY | O_CREAT | O_TRUNC);
-        if (_fd == -1) {
-            DEBUG_PRINTLNF("FSLogHandler::fileInit() Logfile \"%s\" open FAILED! errno=%i", _path.c_str(), errno);
-            _open = false;
-            return false;
+// The index is only a hint, so it is written with the data but never fsync()ed on its own; after a power cut it may
+// lag the logfile, and dump() reads a little further than needed
+void FSLogHandler::indexFlush() {
+    if (_idx_fd == -1 || !_idx_pending_count) {
+        return;
+    }
+    if (::write(_idx_fd, _idx_pending, _idx_pending_count * FSLOG_IDX_ENTRY_SIZE) == -1) {
+        DEBUG_PRINTLNF("FSLogHandler::indexFlush() write FAILED! errno=%i", errno);
+    }
+    _idx_pending_count = 0;
+}
+
+void FSLogHandler::indexClose() {
+    if (_idx_fd != -1) {
+        indexFlush();
+        close(_idx_fd);
+        _idx_fd = -1;
+    }
+}
+
+// Binary search the index for the last entry before time, returning the offset to start reading from
+off_t FSLogHandler::indexLookup(const char *path, uint32_t time) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+
+    struct stat statbuf;
+    size_t lo = 0;
+    size_t hi = fstat(fd, &statbuf) == 0 ? statbuf.st_size / FSLOG_IDX_ENTRY_SIZE : 0;
+    off_t offset = 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint32_t entry[2];
+        lseek(fd, mid * FSLOG_IDX_ENTRY_SIZE, SEEK_SET);
+        if (read(fd, entry, sizeof(entry)) != sizeof(entry)) {
+            break;
+        }
+        if (entry[0] < time) {
+            offset = entry[1];
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        TRACE_PRINTLNF("FSLogHandler::fileInit() Logfile \"%s\" opened successfully!", _path.c_str());
-        _open = true;
     }
-    return true;
+    close(fd);
+    return offset;
 }
 
-void FSLogHandler::dump(Print &stream, bool read_from_beginning) {
-    int dump_fd = -1;
-    static _off_t f_cursor = 0;
+// Passes through the lines of a text log whose timestamps fall in a range.  Sets the write error once it sees a line
+// more than slack_ms past the range, so the reader can stop.
+class TimeRangeFilter : public Print {
+public:
+    TimeRangeFilter(Print &out, uint32_t from_ms, uint32_t to_ms, uint32_t slack_ms) :
+            _out(out), _from(from_ms), _to(to_ms), _stop(to_ms + slack_ms < to_ms ? UINT32_MAX : to_ms + slack_ms),
+            _head_len(0), _pass(false) {}
+
+    size_t write(uint8_t c) override {
+        return write(&c, 1);
+    }
+
+    size_t write(const uint8_t *buf, size_t len) override {
+        size_t i = 0;
+        while (i < len && !getWriteError()) {
+            if (_head_len < sizeof(_head)) {
+                // Collect enough of the line to read its timestamp
+                char c = (char)buf[i++];
+                _head[_head_len++] = c;
+                if (_head_len == sizeof(_head) || c == '\n') {
+                    decide();
+                    if (c == '\n') {
+                        _head_len = 0;
+                    }
+                }
+                continue;
+            }
+
+            // Rest of the line
+            size_t n = i;
+            while (n < len && buf[n] != '\n') {
+                n++;
+            }
+            bool eol = n < len;
+            n += eol ? 1 : 0;
+            if (_pass) {
+                _out.write(buf + i, n - i);
+            }
+            i = n;
+            if (eol) {
+                _head_len = 0;
+            }
+        }
+        return len;
+    }
 
-    dump_fd = open(_path, O_RDONLY);
-    if (!dump_fd) {
-        DEBUG_PRINTLNF("Logfile for dump \"%s\" open FAILED! errno=%i", _path.c_str(), errno);
+private:
+    void decide() {
+        uint32_t time;
+        if (recordTime(_head, _head_len, &time)) {
+            if (time > _stop) {
+                _pass = false;
+                setWriteError();
+                return;
+            }
+            _pass = time >= _from && time <= _to;
+        }
+        if (_pass) {
+            _out.write((const uint8_t *)_head, _head_len);
+        }
+    }
+
+    Print &_out;
+    uint32_t _from;
+    uint32_t _to;
+    uint32_t _stop;                 // Lines timestamped later than this end the dump
+    char _head[12];                 // Optional '\r', 10 digit timestamp and a space
+    uint8_t _head_len;
+    bool _pass;                     // Current line is in range
+};
+
+void FSLogHandler::dump(Print &stream, uint32_t from_ms, uint32_t to_ms) {
+    if (!indexActive()) {
+        DEBUG_PRINTLNF("FSLogHandler::dump() time range dump needs a text logfile with configureIndex(), index=%d", _index);
         return;
     }
 
-    if (read_from_beginning) {
-        f_cursor = 0;
+    if (!_rot_files) {
+        dumpRange(stream, _path, from_ms, to_ms);
+        return;
+    }
+
+    os_mutex_lock(_lock);
+    uint32_t current = _generation;
+    os_mutex_unlock(_lock);
+    for (uint32_t g = current >= _rot_files ? current - _rot_files + 1 : 0; g <= current; g++) {
+        dumpRange(stream, generationPath(g), from_ms, to_ms);
+    }
+}
+
+void FSLogHandler::dumpRange(Print &stream, const char *path, uint32_t from_ms, uint32_t to_ms) {
+    FSLogCursor cursor = {};
+    cursor.offset = indexLookup(String(path) + FSLOG_IDX_SUFFIX, from_ms);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    TimeRangeFilter filter(stream, from_ms, to_ms, reorderWindow());
+    DumpSlice slice = { SIZE_MAX, 0, 0, 0, new (std::nothrow) uint8_t[_dump_chunk] };
+    if (!slice.buf) {
+        DEBUG_PRINTLNF("FSLogHandler::dumpRange() allocation of %u bytes FAILED", _dump_chunk);
+    } else if (_journal) {
+        dumpJournal(filter, fd, &cursor, &slice);
     } else {
-        lseek(dump_fd, f_cursor, SEEK_SET);
+        int bytes;
+        lseek(fd, cursor.offset, SEEK_SET);
+        while (!filter.getWriteError() && (bytes = read(fd, slice.buf, _dump_chunk)) > 0) {
+            filter.write(slice.buf, bytes);
+            Particle.process();
+        }
     }
+    delete[] slice.buf;
+    close(fd);
+}
 
-    char buf[1024];
-    int bytes = 0;
-    do {
-        bytes = read(dump_fd, buf, sizeof(buf)-1);
-        f_cursor += (_off_t)bytes;  // Still increment this in case the next call isn't read from beginning
-        buf[bytes] = 0;   // term char
-        stream.printf("%s", buf);
-        Particle.process();
-    } while (bytes);
+// Decompress whole frames from cursor onwards.  The cursor only advances past complete frames, so a frame that is still
+// being written is picked up by the next incremental dump.  As in dumpJournal(), cursor->logical counts the bytes of the
+// frame at the cursor that a short stream write already took.
+bool FSLogHandler::dumpFrames(Print &stream, int fd, FSLogCursor *cursor, DumpSlice *slice) {
+    if (cursor->offset == 0) {
+        cursor->offset = FSLOG_Z_HEADER_SIZE;
+        cursor->logical = 0;
+    }
+    lseek(fd, cursor->offset, SEEK_SET);
+
+    // Frames hold one write block, so buffers for the current block size normally do; grow them for larger frames
+    // written before configureWriteBlock() changed
+    size_t raw_cap = 0;
+    uint8_t *raw = nullptr;
+    bool caught_up = true;
+    for (;;) {
+        if (slice->exhausted()) {
+            caught_up = false;
+            break;
+        }
+        uint8_t header[FSLOG_Z_FRAME_HEADER_SIZE];
+        if (read(fd, header, sizeof(header)) != sizeof(header) || header[0] != FSLOG_Z_FRAME_MAGIC) {
+            break;
+        }
+        size_t raw_len = header[2] | (header[3] << 8);
+        size_t zlen = header[4] | (header[5] << 8);
+        size_t need = raw_len > _block_size ? raw_len : _block_size;
+        if (need > raw_cap || !raw) {
+            delete[] raw;
+            raw = new (std::nothrow) uint8_t[need + FSLOG_LZ_BOUND(need)];
+            raw_cap = raw ? need : 0;
+            if (!raw) {
+                break;
+            }
+        }
+        uint8_t *zbuf = raw + raw_cap;
+        if (zlen > FSLOG_LZ_BOUND(raw_cap) || read(fd, zbuf, zlen) != (int)zlen) {
+            break;
+        }
+
+        int n = (int)raw_len;
+        if (header[1] == FSLOG_Z_LZ4) {
+            n = fslogDecompress(zbuf, zlen, raw, raw_len);
+        } else {
+            memcpy(raw, zbuf, zlen);
+        }
+        if (n != (int)raw_len) {
+            DEBUG_PRINTLNF("FSLogHandler::dumpFrames() corrupt frame at offset %li", (long)cursor->offset);
+            break;
+        }
 
-    close(dump_fd);
+        size_t skip = (size_t)cursor->logical;
+        size_t sent = stream.write(raw + skip, n - skip);
+        slice->spend(sent);
+        if (sent < n - skip) {
+            cursor->logical += sent;
+            caught_up = false;
+            break;
+        }
+        cursor->logical = 0;
+        cursor->offset += sizeof(header) + zlen;
+        Particle.process();
+    }
+    delete[] raw;
+    return caught_up;
 }
 
 const char* FSLogHandler::extractFileName(const char *s) {
@@ -144,83 +2496,448 @@ const char* FSLogHandler::extractFuncName(const char *s, size_t *size) {
     return s1;
 }
 
-// Copied from StreamLogHandler
+// Append helpers for the record formatter.  Each writes into a span already reserved in the ring and returns the new end.
+static inline char *appendStr(char *p, const char *s, size_t len) {
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static inline char *appendDec(char *p, uint32_t value, int min_digits) {
+    char tmp[10];
+    int n = 0;
+    do {
+        tmp[n++] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    while (n < min_digits) {
+        tmp[n++] = '0';
+    }
+    while (n) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+static inline char *appendHex(char *p, uintptr_t value) {
+    char tmp[sizeof(uintptr_t) * 2];
+    int n = 0;
+    do {
+        tmp[n++] = "0123456789abcdef"[value & 0xF];
+        value >>= 4;
+    } while (value);
+    while (n) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+#define APPEND_LITERAL(p, s) appendStr((p), (s), sizeof(s) - 1)
+
+static inline uint16_t clampLength(size_t len) {
+    return len > 0xFFFF ? 0xFFFF : (uint16_t)len;
+}
+
+// Same layout as StreamLogHandler.  The worst-case length is reserved in the ring up front and the record is formatted
+// straight into it, so the hot path never touches the heap.
 void FSLogHandler::logMessage(const char *msg, LogLevel level, const char *category, const LogAttributes &attr) {
     if (!_enabled) {
         return;
     }
-    
-    if (!fileInit()) {
-        TRACE_PRINTLNF("FSLogHandler::logMessage() fileInit() for file %s returned FALSE", _path.c_str());
+
+    uint32_t start = _stats_timing ? micros() : 0;
+    if (admitRecord(category, attr.has_file ? (uint32_t)(uintptr_t)attr.file ^ (uint32_t)attr.line * 2654435761u : 0) &&
+            !(_dedup_size && dedupRecord(msg, level, category))) {
+        queueMessage(msg, level, category, attr);
+    }
+    _stat_messages.fetch_add(1, std::memory_order_relaxed);
+    if (_stats_timing) {
+        _stat_log_us[histogramBucket(micros() - start)].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Format a record into the ring for its level, without the admission checks of logMessage()
+void FSLogHandler::queueMessage(const char *msg, LogLevel level, const char *category, const LogAttributes &attr) {
+    // Measure every field first
+    size_t category_len = category ? strlen(category) : 0;
+    const char *file = nullptr;
+    size_t file_len = 0;
+    if (attr.has_file) {
+        file = extractFileName(attr.file); // Strip directory path
+        file_len = strlen(file);
+    }
+    const char *func = nullptr;
+    size_t func_len = 0;
+    if (attr.has_function) {
+        func = extractFuncName(attr.function, &func_len); // Strip argument and return types
+    }
+    const char *level_name = levelName(level);
+    size_t level_len = strlen(level_name);
+    size_t msg_len = msg ? strlen(msg) : 0;
+    size_t details_len = attr.has_details ? strlen(attr.details) : 0;
+
+    if (_format == FORMAT_BINARY) {
+        PackedRecord r;
+        r.time = attr.has_time ? (uint32_t)attr.time : 0;
+        r.token = 0;
+        r.line = attr.has_line ? attr.line : 0;
+        r.code = attr.has_code ? (int32_t)attr.code : 0;
+        r.category_len = clampLength(category_len);
+        r.file_len = clampLength(file_len);
+        r.func_len = clampLength(func_len);
+        r.msg_len = clampLength(msg_len);
+        r.details_len = clampLength(details_len);
+        r.level = fslogLevelToNibble(level);
+        r.flags = (attr.has_time ? PACKED_HAS_TIME : 0) | (category ? PACKED_HAS_CATEGORY : 0) |
+                (attr.has_file ? PACKED_HAS_FILE : 0) | (attr.has_line ? PACKED_HAS_LINE : 0) |
+                (attr.has_function ? PACKED_HAS_FUNCTION : 0) | (attr.has_code ? PACKED_HAS_CODE : 0) |
+                (attr.has_details ? PACKED_HAS_DETAILS : 0);
+
+        FSLogRingBuffer *ring;
+        char *span = reserveRecord(level, category, sizeof(r) + r.category_len + r.file_len + r.func_len + r.msg_len + r.details_len, &ring);
+        if (!span) {
+            return;
+        }
+        char *p = appendStr(span, (const char *)&r, sizeof(r));
+        if (category) {
+            p = appendStr(p, category, r.category_len);
+        }
+        if (file) {
+            p = appendStr(p, file, r.file_len);
+        }
+        if (func) {
+            p = appendStr(p, func, r.func_len);
+        }
+        if (msg) {
+            p = appendStr(p, msg, r.msg_len);
+        }
+        if (attr.has_details) {
+            p = appendStr(p, attr.details, r.details_len);
+        }
+        commitRecord(ring, span, p - span);
         return;
     }
 
-    String s;
+    size_t len = level_len + 2 + msg_len + 2;                   // "LEVEL: msg\n\r"
+    if (attr.has_time) {
+        len += 10 + 1;                                          // "0000000000 "
+    }
+    if (category) {
+        len += category_len + 3;                                // "[category] "
+    }
+    if (attr.has_file) {
+        len += file_len + 2 + (attr.has_line ? 1 + 11 : 0);     // "file:-line, "
+    }
+    if (attr.has_function) {
+        len += func_len + 4;                                    // "func(): "
+    }
+    if (attr.has_code || attr.has_details) {
+        len += 3 + (attr.has_code ? 9 + sizeof(uintptr_t) * 2 : 0) + (attr.has_details ? 2 + 10 + details_len : 0);
+    }
+
+    FSLogRingBuffer *ring;
+    char *span = reserveRecord(level, category, len, &ring);
+    if (!span) {
+        TRACE_PRINTLNF("FSLogHandler::logMessage() buffer full, dropped %u bytes", len);
+        return;
+    }
+    char *p = span;
 
     // Timestamp
     if (attr.has_time) {
-        s.concat(String::format("%010u ", (unsigned)attr.time));
+        p = appendDec(p, (uint32_t)attr.time, 10);
+        *p++ = ' ';
     }
 
     // Category
     if (category) {
-        s.concat("[");
-        s.concat(category);
-        s.concat("] ");
+        *p++ = '[';
+        p = appendStr(p, category, category_len);
+        p = APPEND_LITERAL(p, "] ");
     }
 
     // Source file
     if (attr.has_file) {
-        s = extractFileName(attr.file); // Strip directory path
-        s.concat(s); // File name
+        p = appendStr(p, file, file_len); // File name
         if (attr.has_line) {
-            s.concat(":");
-            s.concat(String(attr.line)); // Line number
+            *p++ = ':';
+            if (attr.line < 0) {
+                *p++ = '-';
+            }
+            p = appendDec(p, attr.line < 0 ? -(uint32_t)attr.line : (uint32_t)attr.line, 1); // Line number
         }
         if (attr.has_function) {
-            s.concat(", ");
+            p = APPEND_LITERAL(p, ", ");
         } else {
-            s.concat(": ");
+            p = APPEND_LITERAL(p, ": ");
         }
     }
 
     // Function name
     if (attr.has_function) {
-        size_t n = 0;
-        s = extractFuncName(attr.function, &n); // Strip argument and return types
-        s.concat(s);
-        s.concat("(): ");
+        p = appendStr(p, func, func_len);
+        p = APPEND_LITERAL(p, "(): ");
     }
 
     // Level
-    s.concat(levelName(level));
-    s.concat(": ");
+    p = appendStr(p, level_name, level_len);
+    p = APPEND_LITERAL(p, ": ");
 
     // Message
     if (msg) {
-        s.concat(msg);
+        p = appendStr(p, msg, msg_len);
     }
 
     // Additional attributes
     if (attr.has_code || attr.has_details) {
-        s.concat(" [");
+        p = APPEND_LITERAL(p, " [");
         // Code
         if (attr.has_code) {
-            s.concat(String::format("code = %p" , (intptr_t)attr.code));
+            p = APPEND_LITERAL(p, "code = 0x");
+            p = appendHex(p, (uintptr_t)attr.code);
         }
         // Details
         if (attr.has_details) {
             if (attr.has_code) {
-                s.concat(", ");
+                p = APPEND_LITERAL(p, ", ");
             }
-            s.concat("details = ");
-            s.concat(attr.details);
+            p = APPEND_LITERAL(p, "details = ");
+            p = appendStr(p, attr.details, details_len);
+        }
+        *p++ = ']';
+    }
+
+    p = APPEND_LITERAL(p, "\n\r");
+    commitRecord(ring, span, p - span);
+}
+
+size_t FSLogHandler::tokenDatabaseSize() {
+    return __stop_fslog_tokens - __start_fslog_tokens;
+}
+
+// Most specific matching category filter wins, same as LogManager
+LogLevel FSLogHandler::categoryLevel(const char *category) {
+    LogLevel level = this->level();
+    if (!category) {
+        return level;
+    }
+
+    size_t best = 0;
+    for (size_t i = 0; i < (size_t)_filters.size(); i++) {
+        const char *filter = _filters[i].category();
+        size_t len = strlen(filter);
+        if (len > best && categoryMatches(category, filter)) {
+            best = len;
+            level = _filters[i].level();
+        }
+    }
+    return level;
+}
+
+bool FSLogHandler::acceptsToken(LogLevel level, const char *category) {
+    return _enabled && _format == FORMAT_BINARY && level >= categoryLevel(category);
+}
+
+void FSLogHandler::writeToken(LogLevel level, const char *category, uint32_t token, const uint8_t *args, size_t len) {
+    // Referencing the table bounds also keeps the linker from garbage collecting the token database
+    _stat_messages.fetch_add(1, std::memory_order_relaxed);
+    if (!tokenDatabaseSize() || !admitRecord(category, token)) {
+        return;
+    }
+
+    PackedRecord r;
+    memset(&r, 0, sizeof(r));
+    r.time = clockMs();
+    r.token = token;
+    r.category_len = category ? clampLength(strlen(category)) : 0;
+    r.msg_len = clampLength(len);
+    r.level = fslogLevelToNibble(level);
+    r.flags = PACKED_HAS_TOKEN | PACKED_HAS_TIME | (category ? PACKED_HAS_CATEGORY : 0);
+
+    FSLogRingBuffer *ring;
+    char *span = reserveRecord(level, category, sizeof(r) + r.category_len + r.msg_len, &ring);
+    if (!span) {
+        return;
+    }
+    char *p = appendStr(span, (const char *)&r, sizeof(r));
+    if (category) {
+        p = appendStr(p, category, r.category_len);
+    }
+    p = appendStr(p, (const char *)args, r.msg_len);
+    commitRecord(ring, span, p - span);
+}
+
+// Count the record if it repeats a recent message.  Returns true if it was counted and should not be logged.  The
+// history is guarded by a flag rather than a lock, and a record that finds it taken is simply logged.
+bool FSLogHandler::dedupRecord(const char *msg, LogLevel level, const char *category) {
+    uint32_t hash = category ? fslogHash(category, strlen(category)) : fslogHash("", 0);
+    uint8_t level_byte = (uint8_t)level;
+    hash = fslogHash((const char *)&level_byte, 1, hash);
+    hash = msg ? fslogHash(msg, strlen(msg), hash) : hash;
+    hash = hash ? hash : 1;     // 0 marks an unused entry
+
+    if (_dedup_busy.test_and_set(std::memory_order_acquire)) {
+        return false;
+    }
+    for (size_t i = 0; i < _dedup_size; i++) {
+        if (_dedup[i].hash == hash) {
+            _dedup[i].count++;
+            _dedup_busy.clear(std::memory_order_release);
+            return true;
+        }
+    }
+
+    // A new message replaces the oldest one, ending its run
+    DedupEntry ended = _dedup[_dedup_next];
+    DedupEntry &entry = _dedup[_dedup_next];
+    _dedup_next = (_dedup_next + 1) % _dedup_size;
+    entry.hash = hash;
+    entry.count = 0;
+    entry.reported_ms = clockMs();
+    entry.level = level;
+    strlcpy(entry.category, category ? category : "", sizeof(entry.category));
+    strlcpy(entry.message, msg ? msg : "", sizeof(entry.message));
+    _dedup_busy.clear(std::memory_order_release);
+
+    if (ended.count) {
+        dedupReport(ended);
+    }
+    return false;
+}
+
+// Log '"<message>" repeated N times' in the category and level of the repeated message
+void FSLogHandler::dedupReport(const DedupEntry &entry) {
+    char msg[sizeof(entry.message) + 32];
+    size_t len = strlen(entry.message);
+    char *p = msg;
+    *p++ = '"';
+    p = appendStr(p, entry.message, len);
+    p = len == sizeof(entry.message) - 1 ? APPEND_LITERAL(p, "...\" repeated ") : APPEND_LITERAL(p, "\" repeated ");
+    p = appendDec(p, entry.count, 1);
+    p = entry.count == 1 ? APPEND_LITERAL(p, " time") : APPEND_LITERAL(p, " times");
+    *p = '\0';
+
+    LogAttributes attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.has_time = 1;
+    attr.time = clockMs();
+    queueMessage(msg, entry.level, entry.category[0] ? entry.category : nullptr, attr);
+}
+
+// Report runs of repeats that have gone unreported for the timeout, or all of them
+void FSLogHandler::dedupFlush(bool all) {
+    if (_dedup_busy.test_and_set(std::memory_order_acquire)) {
+        return;
+    }
+    DedupEntry due[FS_LOG_HANDLER_DEDUP_HISTORY];
+    size_t due_count = 0;
+    uint32_t now = clockMs();
+    for (size_t i = 0; i < _dedup_size; i++) {
+        if (_dedup[i].count && (all || now - _dedup[i].reported_ms >= _dedup_timeout_ms)) {
+            due[due_count++] = _dedup[i];
+            _dedup[i].count = 0;
+            _dedup[i].reported_ms = now;
         }
-        s.concat(']');
     }
+    _dedup_busy.clear(std::memory_order_release);
+
+    for (size_t i = 0; i < due_count; i++) {
+        dedupReport(due[i]);
+    }
+}
+
+// Consumer only: write a "<count> records <what>" WARN record straight to the file, in the same layout as logMessage()
+void FSLogHandler::writeNotice(const char *category, uint32_t count, const char *what) {
+    char msg[40];
+    char *p = appendDec(msg, count, 1);
+    p = APPEND_LITERAL(p, " records ");
+    p = appendStr(p, what, strnlen(what, sizeof(msg) - (p - msg)));
+    writeSynthetic(LOG_LEVEL_WARN, category, msg, p - msg);
+}
+
+// Consumer only: write a record straight to the file, bypassing the RAM buffers.  The message is limited to 128 bytes
+// and the category to 64.
+void FSLogHandler::writeSynthetic(LogLevel level, const char *category, const char *msg, size_t msg_len) {
+    size_t category_len = strnlen(category, 64);
+    msg_len = msg_len > 128 ? 128 : msg_len;
+    char *p;
+
+    if (_format == FORMAT_BINARY) {
+        char record[sizeof(PackedRecord) + 64 + 128];
+        PackedRecord r;
+        memset(&r, 0, sizeof(r));
+        r.time = clockMs();
+        r.category_len = category_len;
+        r.msg_len = msg_len;
+        r.level = fslogLevelToNibble(level);
+        r.flags = PACKED_HAS_TIME | PACKED_HAS_CATEGORY;
+        p = appendStr(record, (const char *)&r, sizeof(r));
+        p = appendStr(p, category, category_len);
+        p = appendStr(p, msg, msg_len);
+        writeRecord(record, p - record);
+        return;
+    }
+
+    const char *level_name = levelName(level);
+    char line[11 + 3 + 64 + 16 + 128 + 2];
+    p = appendDec(line, clockMs(), 10);
+    p = APPEND_LITERAL(p, " [");
+    p = appendStr(p, category, category_len);
+    p = APPEND_LITERAL(p, "] ");
+    p = appendStr(p, level_name, strnlen(level_name, 12));
+    p = APPEND_LITERAL(p, ": ");
+    p = appendStr(p, msg, msg_len);
+    p = APPEND_LITERAL(p, "\n\r");
+    writeRecord(line, p - line);
+}
+
+// Consumer only: write the periodic stats() summary
+void FSLogHandler::writeStatsRecord() {
+    _stats_emit_ms = clockMs();
+    if (!fileInit()) {
+        return;
+    }
+
+    Stats s = stats();
+    char msg[128];
+    int len = snprintf(msg, sizeof(msg), "messages=%lu drops=%lu written=%lu writes=%lu fsyncs=%lu high_water=%lu/%lu/%lu",
+            (unsigned long)s.messages, (unsigned long)s.drops, (unsigned long)s.bytes_written, (unsigned long)s.writes,
+            (unsigned long)s.fsyncs, (unsigned long)s.buffer_high_water, (unsigned long)s.urgent_high_water,
+            (unsigned long)s.bulk_high_water);
+    writeSynthetic(LOG_LEVEL_INFO, "fslog", msg, len > 0 ? len : 0);
+}
 
-    s.concat("\n\r");
-    writeToFile(s);
+FSLogHandler::Stats FSLogHandler::stats() {
+    Stats stats;
+    WriterCounters counters;
+    uint32_t seq;
+    do {
+        while ((seq = _stats_seq.load(std::memory_order_acquire)) & 1) {
+            os_thread_yield();
+        }
+        memcpy(&counters, &_counters, sizeof(counters));
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while (_stats_seq.load(std::memory_order_relaxed) != seq);
+
+    stats.messages = _stat_messages.load(std::memory_order_relaxed);
+    stats.drops = getDropCount();
+    stats.bytes_written = counters.bytes_written;
+    stats.writes = counters.writes;
+    stats.fsyncs = counters.fsyncs;
+    stats.buffer_high_water = _stat_high_water[0].load(std::memory_order_relaxed);
+    stats.urgent_high_water = _stat_high_water[1].load(std::memory_order_relaxed);
+    stats.bulk_high_water = _stat_high_water[2].load(std::memory_order_relaxed);
+    for (size_t i = 0; i < FS_LOG_HANDLER_STATS_BUCKETS; i++) {
+        stats.log_us[i] = _stat_log_us[i].load(std::memory_order_relaxed);
+    }
+    memcpy(stats.write_us, counters.write_us, sizeof(stats.write_us));
+    memcpy(stats.fsync_us, counters.fsync_us, sizeof(stats.fsync_us));
+    stats.sync_interval_ms = counters.sync_interval_ms;
+    stats.fsync_cost_us = counters.fsync_cost_us;
+    stats.byte_rate = counters.byte_rate;
+    stats.bytes_per_sync = counters.bytes_per_sync;
+    stats.poll_ms = counters.poll_ms;
+    stats.unsynced_ms_max = counters.unsynced_ms_max;
+    return stats;
 }
 
 bool FSLogHandler::createDirIfNecessary(const char *path) {
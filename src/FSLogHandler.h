@@ -7,6 +7,14 @@
 #define __FSLOGHANDLER_H
 
 #include "Particle.h"
+#include <functional>
+#include <type_traits>
+#include "FSLogCompress.h"
+#include "FSLogCrc.h"
+#include "FSLogFileStorage.h"
+#include "FSLogFormat.h"
+#include "FSLogRingBuffer.h"
+#include "FSLogStorage.h"
 
 // Set up some debug macros:
 // - You cannot log from inside a logger
@@ -14,6 +22,59 @@
 
 #define FS_LOG_HANDLER_DEBUG_LEVEL 0    // 0, 1, or 2
 
+// Directory holding the logfiles
+#ifndef FS_LOG_HANDLER_DIR
+#define FS_LOG_HANDLER_DIR "/log"
+#endif
+
+// Interning table sizes for the binary format.  Categories and call-sites beyond these are written inline.
+#ifndef FS_LOG_HANDLER_MAX_CATEGORIES
+#define FS_LOG_HANDLER_MAX_CATEGORIES 32
+#endif
+#ifndef FS_LOG_HANDLER_MAX_CALLSITES
+#define FS_LOG_HANDLER_MAX_CALLSITES 64
+#endif
+
+// Largest packed argument block of a single FSLOG_TOKEN() record, strings are truncated to fit
+#ifndef FS_LOG_HANDLER_MAX_TOKEN_ARGS
+#define FS_LOG_HANDLER_MAX_TOKEN_ARGS 64
+#endif
+
+// Rate limits, see FSLogHandler::configureRateLimit()
+#ifndef FS_LOG_HANDLER_MAX_RATE_LIMITS
+#define FS_LOG_HANDLER_MAX_RATE_LIMITS 8
+#endif
+#ifndef FS_LOG_HANDLER_RATE_CALLSITE_BUCKETS
+#define FS_LOG_HANDLER_RATE_CALLSITE_BUCKETS 8  // Buckets shared by the call-sites of a per-call-site limit
+#endif
+#ifndef FS_LOG_HANDLER_RATE_SUMMARY_S
+#define FS_LOG_HANDLER_RATE_SUMMARY_S 10        // Interval between suppressed record summaries
+#endif
+
+// Most recent distinct messages tracked by FSLogHandler::configureDedup()
+#ifndef FS_LOG_HANDLER_DEDUP_HISTORY
+#define FS_LOG_HANDLER_DEDUP_HISTORY 8
+#endif
+
+// Duration histograms in FSLogHandler::Stats: bucket 0 counts durations under 1 us, bucket i counts [2^(i-1), 2^i) us,
+// and the last bucket is open ended
+#ifndef FS_LOG_HANDLER_STATS_BUCKETS
+#define FS_LOG_HANDLER_STATS_BUCKETS 16
+#endif
+
+// Backoff between retries of a failed logfile write, doubling from the minimum while the failure lasts
+#ifndef FS_LOG_HANDLER_RETRY_MIN_MS
+#define FS_LOG_HANDLER_RETRY_MIN_MS 100
+#endif
+#ifndef FS_LOG_HANDLER_RETRY_MAX_MS
+#define FS_LOG_HANDLER_RETRY_MAX_MS 10000
+#endif
+
+// Shortest sleep of the writer thread between passes, so a configureFsync() timeout of 0 doesn't make it spin
+#ifndef FS_LOG_HANDLER_WRITER_MIN_WAIT_MS
+#define FS_LOG_HANDLER_WRITER_MIN_WAIT_MS 10
+#endif
+
 #if FS_LOG_HANDLER_DEBUG_LEVEL > 0
 # define DEBUG_PRINTF(fmt, ...) Serial.printf("DEBUG: " fmt, __VA_ARGS__)
 # define DEBUG_PRINTLNF(fmt, ...) Serial.printlnf("DEBUG: " fmt, __VA_ARGS__)
@@ -30,16 +91,356 @@
 # define TRACE_PRINTLNF(fmt, ...) do {} while (0)
 #endif
 
+/**
+ * @brief Tokenized logging: store a hash of the format string plus the packed arguments instead of formatted text.
+ *
+ * The format string is placed in the "fslog_tokens" section of the firmware ELF, where tools/fslog_decode finds it to
+ * rebuild the text on the host.  Nothing is formatted on the device.  Records go to the handler selected with
+ * FSLogHandler::setTokenSink(), which must use FORMAT_BINARY.  Supported arguments are integers, floating point values
+ * (stored as float), pointers and C strings.
+ *
+ * FSLOG_TOKEN(LOG_LEVEL_TRACE, "app.gps.nmea", "fix=%d hdop=%f", fix, hdop);
+ */
+#define FSLOG_TOKEN(level, category, fmt, ...) \
+    do { \
+        __attribute__((section(FSLOG_TOKEN_SECTION), used)) static const char _fslog_token_fmt[] = fmt; \
+        constexpr uint32_t _fslog_token = fslogHash(fmt, sizeof(fmt) - 1); \
+        (void)_fslog_token_fmt; \
+        FSLogHandler::logToken((level), (category), _fslog_token, ##__VA_ARGS__); \
+    } while (0)
+
+// Argument packers for FSLOG_TOKEN(), see FSLogFormat.h for the encoding
+class FSLogTokenArgs {
+public:
+    FSLogTokenArgs() : _p(_buf) {};
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type add(T value) {
+        if (room(FSLOG_VARINT64_MAX)) {
+            _p = fslogPutVarint64(_p, fslogZigzag64((int64_t)value));
+        }
+    };
+
+    template <typename T>
+    typename std::enable_if<std::is_floating_point<T>::value>::type add(T value) {
+        float f = (float)value;
+        if (room(sizeof(f))) {
+            memcpy(_p, &f, sizeof(f));
+            _p += sizeof(f);
+        }
+    };
+
+    void add(const char *s) {
+        size_t len = s ? strlen(s) : 0;
+        size_t avail = (_buf + sizeof(_buf)) - _p;
+        if (avail < 1) {
+            return;
+        }
+        avail = avail > FSLOG_VARINT_MAX ? avail - FSLOG_VARINT_MAX : 0;
+        if (len > avail) {
+            len = avail;
+        }
+        _p = fslogPutVarint(_p, len);
+        memcpy(_p, s, len);
+        _p += len;
+    };
+
+    void add(char *s) { add((const char *)s); };
+
+    void add(const void *ptr) { add((uintptr_t)ptr); };
+
+    void pack() {};
+
+    template <typename T, typename... Args>
+    void pack(T first, Args... rest) {
+        add(first);
+        pack(rest...);
+    };
+
+    const uint8_t *data() const { return _buf; };
+    size_t size() const { return _p - _buf; };
+
+private:
+    bool room(size_t n) const { return (size_t)((_buf + sizeof(_buf)) - _p) >= n; };
+
+    uint8_t _buf[FS_LOG_HANDLER_MAX_TOKEN_ARGS];
+    uint8_t *_p;
+};
+
+class FSLogHandler;
+
+/**
+ * @brief Read position in a log, covering every layout: the rotation generation and the offset within the file for the
+ * layouts dumps walk file by file, the storage position for the others
+ */
+struct FSLogCursor {
+    uint32_t generation;            // Rotation generation being read
+    _off_t offset;                  // Offset in the file, or bytes of the last storage read already sent
+    uint64_t logical;               // FSLogStorage::read() position, or bytes of a partly sent record
+    uint32_t epoch;                 // FSLogHandler file epoch the position refers to
+    bool started;                   // False until the cursor has been placed at the start of the log
+};
+
+/**
+ * @brief An independent reader of an FSLogHandler log.  Each reader owns its cursor and keeps its file open between
+ * reads, so any number of consumers (a Serial dump, an uploader) can tail the same log side by side.  The position can be
+ * saved to flash and restored after a reboot.  A reader must not outlive its handler, and each reader should only be used
+ * from one thread at a time.
+ */
+class FSLogReader {
+public:
+    explicit FSLogReader(FSLogHandler &handler) : _handler(handler), _cursor(), _fd(-1), _caught_up(false) {}
+    ~FSLogReader();
+
+    /**
+	 * @brief Write the log from the current position to a stream, stopping at the end of the log or when a limit is hit
+     *
+     * @param stream Stream object to dump data to
+     * @param max_bytes Stop after about this many bytes (optional, default is no limit)
+     * @param max_us Stop after about this many microseconds (optional, default is no limit)
+     * @return Number of bytes written
+	 */
+    size_t read(Print &stream, size_t max_bytes = SIZE_MAX, uint32_t max_us = 0);
+
+    /**
+	 * @brief Check whether the last read() reached the end of the log
+	 */
+    bool caughtUp() const { return _caught_up; };
+
+    /**
+	 * @brief Go back to the oldest data in the log
+	 */
+    void rewind();
+
+    FSLogCursor position() const { return _cursor; };
+    void seek(const FSLogCursor &cursor);
+
+    /**
+	 * @brief Persist the current position to a file, e.g. after a successful upload
+     *
+     * @return True if the position was written and synced
+	 */
+    bool save(const char *path) const;
+
+    /**
+	 * @brief Restore a position written by save().  Positions past the end of the log are discarded, and the reader
+     * starts from the oldest data instead.
+     *
+     * @return True if a saved position was restored
+	 */
+    bool restore(const char *path);
+
+private:
+    FSLogHandler &_handler;         // Log being read
+    FSLogCursor _cursor;            // Position in the log
+    int _fd;                        // Open file the cursor is in, -1 if none
+    bool _caught_up;                // Last read() reached the end of the log
+};
+
+/**
+ * @brief An incremental dump of an FSLogHandler log, advanced a slice at a time by FSLogHandler::loop() instead of
+ * blocking like dump().  Each job has its own cursor and file descriptor, so several can run at once.  Jobs are started
+ * with FSLogHandler::startDump() and must outlive their run (or be cancelled).  Not thread safe: start, cancel and run
+ * jobs from the application thread.
+ */
+class FSLogDumpJob {
+public:
+    typedef std::function<void(FSLogDumpJob &job)> Callback;
+
+    /**
+	 * @brief Constructor
+     *
+     * @param stream Stream object to dump data to
+	 */
+    explicit FSLogDumpJob(Print &stream) :
+            _stream(stream), _cursor(), _fd(-1), _budget_bytes(1024), _budget_us(2000), _bytes(0), _handler(nullptr),
+            _next(nullptr) {}
+    ~FSLogDumpJob();
+
+    /**
+	 * @brief Limit the work done per loop() call.  A slice stops after whichever limit is hit first, at the end of the
+     * chunk or record being written, so it may run over by one chunk.
+     *
+     * @param bytes Bytes written to the stream per slice (default is 1024)
+     * @param us Microseconds per slice, 0 for no time limit (default is 2000)
+	 */
+    inline FSLogDumpJob &budget(size_t bytes, uint32_t us) {
+        _budget_bytes = bytes ? bytes : 1;
+        _budget_us = us;
+        return *this;   // Allow for chaining with other setters
+    };
+
+    /**
+	 * @brief Called after every slice that wrote something
+	 */
+    inline FSLogDumpJob &onProgress(Callback callback) {
+        _on_progress = callback;
+        return *this;   // Allow for chaining with other setters
+    };
+
+    /**
+	 * @brief Called once the job has caught up with the end of the log and stopped
+	 */
+    inline FSLogDumpJob &onComplete(Callback callback) {
+        _on_complete = callback;
+        return *this;   // Allow for chaining with other setters
+    };
+
+    uint64_t bytesDumped() const { return _bytes; };
+    bool running() const { return _handler != nullptr; };
+
+private:
+    friend class FSLogHandler;
+
+    Print &_stream;                 // Where the dump goes
+    FSLogCursor _cursor;            // Position in the log
+    int _fd;                        // Open file the cursor is in, -1 if none
+    size_t _budget_bytes;           // Bytes per slice
+    uint32_t _budget_us;            // Microseconds per slice, 0 for no limit
+    uint64_t _bytes;                // Bytes written so far
+    Callback _on_progress;          // Called after each slice that wrote something
+    Callback _on_complete;          // Called when the job finishes
+    FSLogHandler *_handler;         // Handler running the job, nullptr if not running
+    FSLogDumpJob *_next;            // Next running job of the same handler
+};
+
 /**
  * @brief Class for logging to the Particle Filesystem, as introduced in 1.5.4/2.0.0
  * 
  * The class will log to a a file in /log/<supplied filename>.log
- * Syncing logs from the buffer is handled through a loop() function that needs to be called from the main file's loop()
+ * logMessage() only appends formatted records to a lock-free RAM buffer, so the logging thread never waits on the filesystem.
+ * Writing and syncing logs from the buffer is handled through a loop() function that needs to be called from the main file's loop(),
+ * or optionally by a background writer thread (see startWriterThread()), in which case loop() does nothing.
  * 
- * Optionally you can configure the buffer size before fsyncing, as well as a timeout.
+ * Optionally you can configure the buffer size before fsyncing, as well as a timeout, or a durability target that the
+ * sync schedule adapts to (see configureDurability()).
  */
 class FSLogHandler : public LogHandler {
+    friend class FSLogReader;
+
 public:
+    /**
+	 * @brief On-flash record encoding, see configureFormat()
+	 */
+    enum Format {
+        FORMAT_TEXT,                // Human readable lines, same layout as StreamLogHandler
+        FORMAT_BINARY               // Compact records described in FSLogFormat.h, rendered by tools/fslog_decode
+    };
+
+    /**
+	 * @brief What happens to a record that doesn't fit in its RAM buffer, see configureBackpressure()
+	 */
+    enum Backpressure {
+        BACKPRESSURE_DROP_NEWEST,   // Drop the record being logged
+        BACKPRESSURE_DROP_OLDEST,   // Discard the oldest queued records to make room
+        BACKPRESSURE_BLOCK,         // Wait for the writer thread to make room, up to a timeout
+        BACKPRESSURE_DEGRADE        // Drop low levels once the buffer is half full, keeping the rest for higher levels
+    };
+
+    /**
+	 * @brief Exact counts of records lost to backpressure, see dropStats()
+	 */
+    struct DropStats {
+        uint32_t newest;            // Records dropped because their buffer was full
+        uint32_t oldest;            // Queued records discarded to make room (BACKPRESSURE_DROP_OLDEST)
+        uint32_t timeouts;          // Records dropped after blocking for the whole timeout (BACKPRESSURE_BLOCK)
+        uint32_t degraded;          // Low-level records dropped early (BACKPRESSURE_DEGRADE)
+    };
+
+    /**
+	 * @brief Snapshot of the handler's runtime statistics, see stats()
+	 */
+    struct Stats {
+        uint32_t messages;          // Records passed to logMessage() and FSLOG_TOKEN(), including rate limited and repeated ones
+        uint32_t drops;             // Records lost to backpressure, see dropStats()
+        uint64_t bytes_written;     // Bytes handed to ::write() for the logfile
+        uint32_t writes;            // ::write() calls for the logfile
+        uint32_t fsyncs;            // fsync() calls for the logfile
+        uint32_t buffer_high_water; // Most bytes ever queued in the RAM buffer
+        uint32_t urgent_high_water; // Most bytes ever queued in the urgent lane
+        uint32_t bulk_high_water;   // Most bytes ever queued in the bulk lane
+        uint32_t log_us[FS_LOG_HANDLER_STATS_BUCKETS];      // logMessage() durations, only with configureStats()
+        uint32_t write_us[FS_LOG_HANDLER_STATS_BUCKETS];    // ::write() durations
+        uint32_t fsync_us[FS_LOG_HANDLER_STATS_BUCKETS];    // fsync() durations
+        uint32_t sync_interval_ms;  // How long written data may wait for its fsync(), chosen by configureDurability()
+        uint32_t fsync_cost_us;     // Expected fsync() duration: jumps to a slower fsync(), decays after faster ones
+        uint32_t byte_rate;         // Average bytes per second reaching the logfile
+        uint32_t bytes_per_sync;    // Average bytes made durable by one fsync()
+        uint32_t poll_ms;           // Average gap between loop() calls or writer thread passes
+        uint32_t unsynced_ms_max;   // Longest any written data waited for its fsync()
+    };
+
+    /**
+	 * @brief Background writer thread counters, see writerStats()
+	 */
+    struct WriterStats {
+        uint32_t wakeups;           // Number of times the writer thread woke up
+        uint32_t batches;           // Wake-ups that found data to write
+        uint32_t batch_bytes_last;  // Bytes written by the most recent batch
+        uint32_t batch_bytes_max;   // Largest batch written
+        uint64_t batch_bytes_total; // Total bytes written by the writer thread
+        uint32_t fsyncs;            // Number of fsync() calls
+        uint32_t fsync_us_last;     // Duration of the most recent fsync() in microseconds
+        uint32_t fsync_us_max;      // Longest fsync() in microseconds
+    };
+
+    /**
+	 * @brief Outcome of the last journal recovery scan, see configureJournal()
+	 */
+    struct JournalRecovery {
+        uint32_t recover_us;        // Time spent finding the end of the valid data
+        uint32_t bytes_scanned;     // Bytes read to find it
+        uint32_t bytes_discarded;   // Torn or corrupt bytes cut off the end of the file
+    };
+
+    /**
+	 * @brief Flight recorder counters, see configureFlightRecorder().  Byte counts are of records as queued in RAM.
+	 */
+    struct FlightRecorderStats {
+        uint32_t triggers;          // Number of triggers
+        uint64_t bytes_persisted;   // Buffered record bytes written to the logfile around a trigger
+        uint64_t bytes_avoided;     // Buffered record bytes that aged out without being written
+        uint32_t dropped;           // Records lost because the flight recorder ring was full
+    };
+
+    /**
+	 * @brief Logfile write failures and recovery, see faultStats()
+	 */
+    struct FaultStats {
+        uint32_t failures;          // Failed or short logfile writes, including failed retries
+        uint32_t short_writes;      // Writes that returned less than asked, usually a full filesystem
+        uint32_t retries;           // Retries of a held write block
+        uint32_t reopens;           // Logfile reopened after an I/O error
+        uint32_t evictions;         // Oldest rotated logfiles deleted to free space
+        uint32_t faults;            // Faults recovered from
+        uint32_t fsync_stalls;      // fsync() calls that took longer than the time since the previous one ended
+        uint32_t records_lost;      // Records dropped from the RAM buffers while a fault or a run of stalls lasted
+        uint32_t bytes_lost;        // Staged bytes discarded because the held block could not be written
+        uint32_t recovery_ms_last;  // Time from the first failure to the successful retry, for the last fault
+        uint32_t recovery_ms_max;   // Longest recovery time
+        int error;                  // errno of the fault in progress, 0 when writes succeed
+    };
+
+    /**
+	 * @brief Millisecond time source for flush, sync, rate limit and flight recorder decisions, see configureClock()
+	 */
+    typedef uint32_t (*Clock)();
+
+    /**
+	 * @brief Logfile operation passed to the configureIoObserver() callback
+	 */
+    struct IoEvent {
+        enum Type {
+            WRITE,                  // A write block or file header appended to the storage
+            FSYNC                   // FSLogStorage::sync(), fsync() of the logfile
+        } type;
+        uint32_t time_ms;           // Handler clock when the call returned
+        uint32_t bytes;             // Bytes written, or bytes queued since the previous sync for FSYNC
+        uint32_t us;                // Duration of the call in microseconds
+        int result;                 // Return value of the call
+    };
+    typedef std::function<void(const IoEvent &event)> IoObserver;
+
 	/**
 	 * @brief Constructor. The object is normally instantiated as a global object.
 	 *
@@ -53,33 +454,142 @@ public:
 
     /**
 	 * @brief Required housekeeping function required to manage filesystem syncs.  Should be called periodically from main loop() function.  
+     * Also advances running dump jobs, see startDump().
      * 
      * See configureFsync() for configuration options
 	 */
     void loop();
 
+    /**
+	 * @brief Hand writing and syncing over to a dedicated thread.  The thread wakes up when the RAM buffer holds at least
+     * watermark bytes, or when the configureFsync() timeout expires, writes everything that is queued and then issues a
+     * single fsync() for the whole batch.  loop() no longer needs to be called once the thread is running.
+     *
+     * @param watermark Buffered bytes that wake the writer early (optional, default is half the buffer capacity)
+     * @return True if the thread is running
+	 */
+    bool startWriterThread(size_t watermark = 0);
+
+    /**
+	 * @brief Stop the writer thread started by startWriterThread().  Syncing reverts to loop().
+	 */
+    void stopWriterThread();
+
+    /**
+	 * @brief Get the writer thread counters.  fsync() counters are also updated when syncing from loop().
+	 */
+    WriterStats writerStats();
+
+    /**
+	 * @brief Get a consistent snapshot of the runtime statistics.  Counters updated by the writer are read under a
+     * seqlock, so the snapshot never mixes two updates; the logging side counters are individual atomics.  Safe to call
+     * from any thread except an ISR.
+	 */
+    Stats stats();
+
+    /**
+	 * @brief Configure the optional parts of stats().  Counters, high-water marks and the write/fsync histograms are
+     * always kept.
+     *
+     * @param time_messages Also time every logMessage() call for the log_us histogram, which costs two micros() calls
+     * @param period_s Write a summary INFO record in category "fslog" every period_s seconds, 0 for none (optional, default is 0)
+	 */
+    inline FSLogHandler &configureStats(bool time_messages, unsigned int period_s = 0) {
+        _stats_timing = time_messages;
+        _stats_period_ms = period_s * 1000;
+        return *this;   // Allow for chaining with other setters
+    };
+
+    /**
+	 * @brief Replace millis() as the clock behind the handler's timing decisions: the loop() fsync timeout, urgent
+     * sync deadlines, bulk lane flushes, rate limits, repeat suppression, the flight recorder and summary records.
+     * Driving it from a virtual clock and calling loop() makes those decisions reproducible without waiting in real
+     * time.  The writer thread still sleeps in real time, so use it without startWriterThread().  Only takes effect
+     * while logging is disabled.
+     *
+     * @param clock Function returning milliseconds, nullptr for millis()
+	 */
+    inline FSLogHandler &configureClock(Clock clock) {
+        if (!_enabled) {
+            _clock = clock;
+            _last_sync_ms = clockMs();
+            _unsynced_since_ms = _last_sync_ms;
+            _last_pass_ms = _last_sync_ms;
+        }
+        return *this;   // Allow for chaining with other setters
+    };
+
+    /**
+	 * @brief Call observer after every append to and sync of the storage, with the lock held on the thread that drains
+     * the buffer.  Together with configureClock() this records the write and sync trace of a workload, so the
+     * durability latency and flash wear of configureFsync() settings can be compared; tools/fslog_sim.cpp does this on
+     * the host.  Only takes effect while logging is disabled.
+     *
+     * @param observer Callback, or an empty function to stop observing
+	 */
+    inline FSLogHandler &configureIoObserver(IoObserver observer) {
+        if (!_enabled) {
+            _io_observer = observer;
+        }
+        return *this;   // Allow for chaining with other setters
+    };
+
 	/**
-	 * @brief Public function to dump the target logfile to a supplied stream
+	 * @brief Public function to dump the target logfile to a supplied stream.  With rotation, all generations on flash are
+     * dumped oldest first.
 	 *
 	 * @param stream Stream object to dump data to
 	 * @param read_from_beginning Flag to indicate whether to continue reading, or read from beginning (optional, default is true)
+	 *
+	 * The incremental position belongs to this handler and is shared by all callers; use an FSLogReader per consumer
+	 * instead when several consumers read the same log.
 	 */
     void dump(Print &stream, bool read_from_beginning = true);
 
+	/**
+	 * @brief Dump only the text records timestamped from_ms to to_ms, inclusive.  The time index is binary searched for
+     * where to start, so only the requested range and at most one write block before it are read.  Records without a
+     * timestamp are kept with the record before them.  Records written late by a lane or the flight recorder are still
+     * found, as the dump reads on past to_ms by the same margin.  Needs configureIndex(), FORMAT_TEXT, and no compression
+     * or circular file.
+	 *
+	 * @param stream Stream object to dump data to
+	 * @param from_ms Earliest record time, as in LogAttributes::time
+	 * @param to_ms Latest record time
+	 */
+    void dump(Print &stream, uint32_t from_ms, uint32_t to_ms);
+
+	/**
+	 * @brief Start an incremental dump from the beginning of the log.  Every loop() call then writes one budgeted slice
+     * per running job (see FSLogDumpJob::budget()), so a large dump never holds up the application for long.  Jobs keep
+     * running while the writer thread is active.
+	 *
+	 * @return False if the job is already running
+	 */
+    bool startDump(FSLogDumpJob &job);
+
+	/**
+	 * @brief Stop a running dump job.  The completion callback is not called.
+	 */
+    void cancelDump(FSLogDumpJob &job);
+
     /**
 	 * @brief Clear/delete the current logfile
 	 */
     void clearLogs();
 
     /**
-	 * @brief Get current logfile size in bytes
+	 * @brief Get current logfile size in bytes, including data staged for the next write.  For circular logfiles and
+     * storage backends this is the amount of valid data.
+     *
+     * @return Size in bytes, or -1 if the log can't be read
 	 */
     long getLogSize();
 
     /* Setters and getters for private vars */
 
     /**
-	 * @brief Public function to get the full path to the target logfile
+	 * @brief Public function to get the full path to the target logfile (the current generation when rotating)
      * 
      * @return String of the full path
 	 */
@@ -88,7 +598,7 @@ public:
     /**
 	 * @brief Configure the filesystem synchronization routine. Set a number of bytes to buffer before writing, and a timeout
      * 
-     * @param max_bytes Number of bytes to allow to be buffered before triggering a fsync()
+     * @param max_bytes Number of bytes written since the last fsync() that trigger the next one
      * @param timeout_s Timeout before next fsync(), regardless of the number of bytes in the buffer
 	 */
     inline FSLogHandler &configureFsync(unsigned int max_bytes, unsigned int timeout_s) {
@@ -97,6 +607,280 @@ public:
         return *this;   // Allow for chaining with other setters
     };
 
+    /**
+	 * @brief Replace the configureFsync() thresholds with a durability target: sync as rarely as possible while no
+     * record waits longer than max_loss_ms between being logged and being fsync()ed, so a power cut loses at most that
+     * much of the log.  The sync interval is the target less the average gap between loop() calls (or writer thread
+     * passes) and the expected fsync() duration, which is scaled up when data arrives faster than recent syncs were
+     * sized for.  The estimates and the chosen interval are reported by stats().  Only takes effect while logging is
+     * disabled.
+     *
+     * @param max_loss_ms Durability target in milliseconds, 0 to go back to the configureFsync() thresholds
+	 */
+    inline FSLogHandler &configureDurability(unsigned int max_loss_ms) {
+        if (!_enabled) {
+            _durability_ms = max_loss_ms;
+            _counters.sync_interval_ms = max_loss_ms / 2;   // Until there are measurements
+        }
+        return *this;   // Allow for chaining with other setters
+    };
+
+    /**
+	 * @brief Configure the size of the RAM buffer between logMessage() and the filesystem.  Records that arrive while the
+     * buffer is full are dropped.  Only takes effect while logging is disabled.
+     *
+     * @param bytes Buffer capacity, rounded down to a power of two
+	 */
+    inline FSLogHandler &configureBuffer(size_t bytes) {
+        if (!_enabled) {
+            _buffer.resize(bytes);
+        }
+        return *this;   // Allow for chaining with other setters
+    };
+
+    /**
+	 * @brief Configure the read size used by dump() and dump jobs.  Reads are aligned to multiples of this size within the
+     * file and handed to the stream's write(buf, len) unchanged, so a multiple of the filesystem block size is best.
+     *
+     * @param bytes Read size, rounded down to a multiple of 64 bytes (default is 1024)
+	 */
+    inline FSLogHandler &configureDumpChunk(size_t bytes) {
+        _dump_chunk = bytes < 64 ? 64 : bytes & ~(size_t)63;
+        return *this;   // Allow for chaining with other setters
+    };
+
+    /**
+	 * @brief Select the on-flash record encoding.  The binary format stores delta timestamps, interned categories and
+     * call-sites, and length-prefixed messages; use tools/fslog_decode to turn it back into text.  Only takes effect while
+     * logging is disabled, and starts a new logfile.
+	 */
+    FSLogHandler &configureFormat(Format format);
+
+    /**
+	 * @brief Compress each write block with LZ4 before it goes to the filesystem.  Blocks are independently decodable, blocks
+     * that don't shrink are stored raw, and dump() decompresses transparently.  Larger write blocks compress better, see
+     * configureWriteBlock().  Only takes effect while logging is disabled, and starts a new logfile.
+	 */
+    FSLogHandler &configureCompression(bool enable = true);
+
+    /**
+	 * @brief Use a fixed-size circular logfile.  The file is preallocated once; writes then wrap around and overwrite the
+     * oldest data, so the flash footprint is bounded and nothing is truncated or reallocated in steady state.  An existing
+     * circular file of the same capacity is resumed instead of cleared.  Circular files are text only: they can't be
+     * combined with FORMAT_BINARY or compression.  Only takes effect while logging is disabled, and starts a new logfile.
+     *
+     * @param capacity Size of the data region in bytes, or 0 for a regular growing file
+	 */
+    FSLogHandler &configureCircular(size_t capacity);
+
+    /**
+	 * @brief Rotate across a bounded set of files instead of one growing file.  Logs go to /log/<name>.0 ... .<max_files-1>,
+     * picked by a generation counter kept in /log/<name>.gen.  When the current file reaches max_bytes the next generation
+     * replaces the oldest file, so a rotation is one unlink and one open regardless of max_files.  Each boot starts a new
+     * generation, keeping the previous sessions.  Can't be combined with configureCircular().  Only takes effect while
+     * logging is disabled.
+     *
+     * @param max_bytes File size that triggers a rotation, or 0 to disable rotation
+     * @param max_files Number of files to keep
+	 */
+    FSLogHandler &configureRotation(size_t max_bytes, unsigned int max_files);
+
+    /**
+	 * @brief Frame every record with its length and a CRC-32 so a power cut can only lose the record being written.  The
+     * logfile is no longer truncated at boot: the torn tail, if any, is cut off and the new session is appended.  Sync
+     * markers written once per write block bound the recovery scan to the last block or so, whatever the file size; see
+     * journalRecovery().  Can't be combined with compression or configureCircular().  With configureRotation(), boots
+     * append to the current generation instead of starting a new one.  Only takes effect while logging is disabled.
+	 */
+    FSLogHandler &configureJournal(bool enable = true);
+
+    /**
+	 * @brief Keep a sparse time index next to the logfile, with one entry for the first timestamped record in each write
+     * block, for dump(stream, from_ms, to_ms).  Entries are buffered and written with the log data.  Text format only;
+     * ignored with compression or configureCircular().  Only takes effect while logging is disabled.
+	 */
+    FSLogHandler &configureIndex(bool enable = true);
+
+    /**
+	 * @brief Send the log to a storage backend instead of a logfile on the filesystem, e.g. an FSLogFlashStorage on a raw
+     * flash region, which skips the filesystem's metadata updates on every append.  Write blocks are appended as they
+     * fill, fsync() becomes FSLogStorage::sync(), and loop() or the writer thread give the backend time for maintain().
+     * dump(), startDump() and FSLogReader read the backend.  Stored data carries over between boots, as the backend
+     * decides.  Text format only, and can't be combined with compression, configureCircular(), configureRotation(),
+     * configureJournal() or configureIndex().  Only takes effect while logging is disabled.
+     *
+     * @param storage Backend, which must outlive the handler, or nullptr for the logfile
+	 */
+    FSLogHandler &configureStorage(FSLogStorage *storage);
+
+    /**
+	 * @brief Limit a category and its subcategories to a sustained rate with a token bucket, e.g. next to the constructor's
+     * filters: configureRateLimit("app.gps.nmea", 5, 20).  The most specific limit wins.  Limits are kept in a hash table
+     * built here, so the check in logMessage() costs one lookup per level of the category name.  Records over the limit
+     * are counted, and every FS_LOG_HANDLER_RATE_SUMMARY_S seconds a WARN record "N records suppressed" is written in
+     * the limited category.  Up to FS_LOG_HANDLER_MAX_RATE_LIMITS limits; calling again for a category replaces its
+     * limit.  Only takes effect while logging is disabled.
+     *
+     * @param category Category name
+     * @param per_second Sustained records per second
+     * @param burst Records allowed in a burst after a quiet period
+     * @param per_callsite Give each call-site its own bucket instead of sharing one per category.  Call-sites are hashed
+     * into FS_LOG_HANDLER_RATE_CALLSITE_BUCKETS buckets, so a few may share. (optional, default is false)
+	 */
+    FSLogHandler &configureRateLimit(const char *category, unsigned int per_second, unsigned int burst, bool per_callsite = false);
+
+    /**
+	 * @brief Suppress repeated messages.  Each record's category, level and message are hashed and compared with the
+     * last history distinct messages; a match is counted instead of logged.  When a repeated message drops out of the
+     * history, or timeout_s after the previous summary, one record '"<message>" repeated N times' is logged in its
+     * category and level.  Records logged concurrently by another thread skip the check rather than wait.  Only takes
+     * effect while logging is disabled.
+     *
+     * @param history Distinct messages remembered, at most FS_LOG_HANDLER_DEDUP_HISTORY, or 0 to disable
+     * @param timeout_s Longest time a run of repeats goes unreported
+	 */
+    FSLogHandler &configureDedup(unsigned int history, unsigned int timeout_s);
+
+    /**
+	 * @brief Choose what happens when a record doesn't fit in its RAM buffer.  Whatever the policy, the next time the
+     * buffers are drained a synthetic "N records dropped" WARN record (category "fslog") is written, so the gap is
+     * visible in the log.
+     *
+     * BACKPRESSURE_DROP_OLDEST pops queued records from the logging thread, so it falls back to dropping the newest
+     * record in an ISR or while the buffer is being drained.  BACKPRESSURE_BLOCK waits for the writer thread, so it falls
+     * back to dropping the newest record in an ISR, on the system thread, on the writer thread or when the writer thread
+     * isn't running.  Both fallbacks are counted as dropping the newest record.
+     *
+     * @param policy Backpressure policy (default is BACKPRESSURE_DROP_NEWEST)
+     * @param block_ms Longest wait for BACKPRESSURE_BLOCK (optional, default is 10)
+     * @param degrade_level Records below this level are dropped first by BACKPRESSURE_DEGRADE (optional, default is LOG_LEVEL_INFO)
+	 */
+    inline FSLogHandler &configureBackpressure(Backpressure policy, unsigned int block_ms = 10, LogLevel degrade_level = LOG_LEVEL_INFO) {
+        _backpressure = policy;
+        _block_ms = block_ms;
+        _degrade_level = degrade_level;
+        return *this;   // Allow for chaining with other setters
+    };
+
+    /**
+	 * @brief Get the exact counts of records lost to backpressure
+	 */
+    DropStats dropStats();
+
+    /**
+	 * @brief Give records at or above level their own RAM ring (the urgent lane), written ahead of every other lane and
+     * fsynced within sync_ms of being written, so an ERROR never waits behind a backlog of lower-level records.  The
+     * writer thread is woken as soon as an urgent record is queued; without it, loop() writes urgent records on its next
+     * call.  Bursts of urgent records within sync_ms share one fsync().  Records from different lanes can appear in the
+     * file out of order, by up to the configureFsync() timeout.  Only takes effect while logging is disabled.
+     *
+     * @param level Lowest urgent level
+     * @param sync_ms Longest time an urgent record stays written but unsynced, 0 to sync as soon as it is written
+     * @param ram_bytes Size of the urgent ring, rounded down to a power of two, or 0 to disable
+	 */
+    FSLogHandler &configureUrgentLane(LogLevel level, unsigned int sync_ms, size_t ram_bytes);
+
+    /**
+	 * @brief Give records below level their own RAM ring (the bulk lane), written only once it is half full or the
+     * configureFsync() timeout has passed since the last sync.  Chatty low-level records then cost few large writes and
+     * fsyncs, and never delay the higher levels queued behind them.  Only takes effect while logging is disabled.
+     *
+     * @param level Records below this level are bulk
+     * @param ram_bytes Size of the bulk ring, rounded down to a power of two, or 0 to disable
+	 */
+    FSLogHandler &configureBulkLane(LogLevel level, size_t ram_bytes);
+
+    /**
+	 * @brief Keep low-level records in RAM and only persist them around a trigger.  Records that pass the constructor's
+     * level and filters (the capture level) but are below persist_level go to a separate RAM ring instead of the file.
+     * When a trigger fires, the buffered records from the last pre_s seconds are written to the logfile ahead of the
+     * records queued at that moment, and for the next post_s seconds everything captured goes straight to the file.
+     * Buffered records older than pre_s, or the oldest ones once the ring is three quarters full, are discarded and
+     * counted in flightRecorderStats().  Only takes effect while logging is disabled.
+     *
+     * @param persist_level Lowest level that is always written to the file
+     * @param ram_bytes Size of the flight recorder ring, rounded down to a power of two, or 0 to disable
+     * @param pre_s Seconds of records before the trigger to persist
+     * @param post_s Seconds after the trigger during which all captured records are persisted
+	 */
+    FSLogHandler &configureFlightRecorder(LogLevel persist_level, size_t ram_bytes, unsigned int pre_s, unsigned int post_s);
+
+    /**
+	 * @brief Choose what fires the flight recorder: any record at or above level, and any record in category or its
+     * subcategories (optional).  The default is LOG_LEVEL_ERROR and no category.  Only takes effect while logging is
+     * disabled.
+	 */
+    FSLogHandler &configureFlightTrigger(LogLevel level, const char *category = nullptr);
+
+    /**
+	 * @brief Fire the flight recorder from application code.  Safe to call from any thread.
+	 */
+    void triggerFlightRecorder();
+
+    /**
+	 * @brief Get the flight recorder counters
+	 */
+    FlightRecorderStats flightRecorderStats();
+
+    /**
+	 * @brief Get the result of the journal recovery done when the logfile was last opened
+	 */
+    JournalRecovery journalRecovery() { return _journal_recovery; };
+
+    /**
+	 * @brief Get the logfile write fault counters.  A write block that fails or is cut short is held and retried,
+     * with backoff from FS_LOG_HANDLER_RETRY_MIN_MS to FS_LOG_HANDLER_RETRY_MAX_MS, before anything else is written;
+     * until then new records wait in the RAM buffers under the configureBackpressure() policy.  Before each retry a
+     * full filesystem (ENOSPC) has the oldest rotated logfile deleted, see configureRotation(), and any other error
+     * reopens the logfile.  Only rotated logfiles are evicted: without configureRotation() the block is held until
+     * space is freed some other way.  An fsync() that takes longer than the time since the previous one ended means
+     * syncing can't keep up with the load, and records dropped until it does again are counted in records_lost too,
+     * as are those dropped so far in a fault that is still in progress.  tools/fslog_faults.cpp injects these faults
+     * on the host and reports the recovery.
+	 */
+    FaultStats faultStats();
+
+    /**
+	 * @brief Route FSLOG_TOKEN() records to this handler.  Only one handler receives tokens at a time; the records are subject
+     * to the level and category filters passed to the constructor, and are dropped unless the handler uses FORMAT_BINARY.
+	 */
+    inline FSLogHandler &setTokenSink() {
+        _token_sink = this;
+        return *this;   // Allow for chaining with other setters
+    };
+
+    /**
+	 * @brief Entry point of FSLOG_TOKEN(), not normally called directly
+	 */
+    template <typename... Args>
+    static void logToken(LogLevel level, const char *category, uint32_t token, Args... args) {
+        FSLogHandler *sink = _token_sink;
+        if (!sink || !sink->acceptsToken(level, category)) {
+            return;
+        }
+        FSLogTokenArgs packed;
+        packed.pack(args...);
+        sink->writeToken(level, category, token, packed.data(), packed.size());
+    };
+
+    /**
+	 * @brief Size of the token database linked into the firmware, in bytes
+	 */
+    static size_t tokenDatabaseSize();
+
+    /**
+	 * @brief Configure the write coalescing block.  Records are collected in RAM and only handed to the filesystem as full,
+     * block-aligned writes, except when syncing or closing the file.  Use a multiple of the filesystem's program/cache size.
+     *
+     * @param bytes Block size in bytes (default is 512, at most 65535 with compression)
+	 */
+    FSLogHandler &configureWriteBlock(size_t bytes);
+
+    /**
+	 * @brief Get the number of records lost because the RAM buffer or a lane's ring was full, see dropStats()
+	 */
+    uint32_t getDropCount();
+
     /**
 	 * @brief Start or stop logging to file.  Logs are dropped if not enabled.
 	 */
@@ -116,14 +900,262 @@ private:
     const char* extractFuncName(const char *s, size_t *size);
 
     bool _enabled;                  // Whether or not we are logging
-    int _fd;                        // File descriptor
     bool _open;                     // File open flag
     String _path;                   // Full logfile path
+    String _base;                   // Logfile path without extension
     unsigned int _bytes_queued;     // Num of bytes queued for fs write
     unsigned int _max_bytes_queued; // Max number of bytes to be queued before forcing a fsync()
     unsigned int _fsync_timeout_s;  // Max number of seconds elapsed before manually triggering a fsync(), given bytes available.
+    FSLogRingBuffer _buffer;        // Records waiting to be written, filled by logMessage() and drained by loop()
+    char *_block;                   // Write coalescing block
+    size_t _block_size;             // Size of _block
+    size_t _block_used;             // Bytes staged in _block
+    off_t _file_offset;             // Bytes handed to the filesystem since the file was opened
+    bool _compress;                 // Compress write blocks
+    uint8_t *_zblock;               // Compressed frame output, sized for the worst case of one write block
+    uint16_t _lz_table[1 << FSLOG_LZ_HASH_BITS];   // Compressor match finder
+    size_t _circ_capacity;          // Circular data region size, 0 for a regular file
+    unsigned int _rot_files;        // Number of rotated files, 0 for no rotation
+    size_t _rot_bytes;              // File size that triggers a rotation
+    uint32_t _generation;           // Current rotation generation, the file is generation % _rot_files
+    bool _generation_loaded;        // _generation has been read from the manifest
+    bool _journal;                  // Frame records with a CRC and append across boots
+    off_t _journal_end;             // End of the valid data found when the journal was opened
+    off_t _journal_block;           // Write block holding the most recent sync marker
+    uint8_t *_jrec;                 // Binary record being assembled for framing
+    size_t _jrec_size;              // Size of _jrec
+    size_t _jrec_used;              // Bytes in _jrec, or more than _jrec_size if the record overflowed
+    JournalRecovery _journal_recovery;  // Result of the last recovery scan
+    bool _index;                    // Maintain the time index sidecar
+    int _idx_fd;                    // Index file descriptor, -1 if not open
+    off_t _idx_block;               // Write block of the most recent index entry
+    uint32_t _idx_last_time;        // Time of the most recent index entry
+    uint8_t _idx_pending[16 * FSLOG_IDX_ENTRY_SIZE];   // Entries not yet written to the index
+    uint8_t _idx_pending_count;     // Number of entries in _idx_pending
+    Format _format;                 // On-flash record encoding
+    uint32_t _last_time;            // Timestamp of the previous binary record, for delta encoding
+    uint32_t _categories[FS_LOG_HANDLER_MAX_CATEGORIES];   // Hashes of the categories defined in the current file
+    uint32_t _callsites[FS_LOG_HANDLER_MAX_CALLSITES];     // Hashes of the call-sites defined in the current file
+    uint8_t _category_count;
+    uint8_t _callsite_count;
+    LogCategoryFilters _filters;    // Copy of the constructor filters, for records that bypass LogManager
+    static FSLogHandler *_token_sink;   // Destination of FSLOG_TOKEN()
+
+    bool acceptsToken(LogLevel level, const char *category);
+    void writeToken(LogLevel level, const char *category, uint32_t token, const uint8_t *args, size_t len);
+    LogLevel categoryLevel(const char *category);
+    uint32_t _last_sync_ms;         // Clock time of the last fsync()
+    uint32_t _unsynced_since_ms;    // Clock time of the drain that wrote the oldest unsynced data
+    uint32_t _last_pass_ms;         // Clock time of the last loop() or writer thread pass
+    uint32_t _durability_ms;        // configureDurability() target, 0 to use the configureFsync() thresholds
+    Clock _clock;                   // Time source, nullptr for millis()
+    IoObserver _io_observer;        // Called for every logfile write and fsync()
+    uint8_t *_held;                 // Write block that failed, retried before anything else is written
+    size_t _held_size;              // Size of _held
+    size_t _held_len;               // Bytes in _held, 0 when writes are succeeding
+    uint32_t _fault_since_ms;       // Clock time of the first failure of the held block
+    uint32_t _fault_retry_ms;       // Clock time of the last attempt
+    uint32_t _fault_backoff_ms;     // Delay before the next retry
+    uint32_t _fault_drops;          // getDropCount() when the fault started
+    bool _stalled;                  // The last fsync() took longer than the time since the one before
+    uint32_t _stall_drops;          // getDropCount() before the first fsync() of the current run of stalls
+    FaultStats _fault_stats;        // Fault and recovery counters
+    FSLogFileStorage _file;         // The logfile, for every layout but the ones configureStorage() replaces it with
+    FSLogStorage *_storage;         // Where the log goes: &_file, or the configureStorage() backend
+    os_mutex_t _lock;               // Serializes file access between loop()/the writer thread and the public API
+    std::atomic<os_thread_t> _writer;   // Background writer thread, or nullptr when syncing from loop().  Read without the lock by logMessage().
+    os_semaphore_t _writer_wake;    // Given by logMessage() when the buffer crosses the watermark.  Created by the first startWriterThread(), destroyed with the handler.
+    size_t _writer_watermark;       // Buffered bytes that wake the writer thread
+    std::atomic<bool> _writer_stop; // Asks the writer thread to exit
+    WriterStats _writer_stats;      // Writer thread counters, under _lock
+    FSLogDumpJob *_dump_jobs;       // Running dump jobs
+    FSLogCursor _dump_cursor;       // Position of the incremental dump()
+    uint32_t _epoch;                // Bumped whenever the log is cleared or truncated, invalidating read positions
+    size_t _dump_chunk;             // Dump read size
+    bool _urgent_on;                // Urgent lane configured
+    FSLogRingBuffer _urgent;        // Records at or above _urgent_level, written ahead of the other lanes
+    LogLevel _urgent_level;         // Lowest urgent level
+    uint32_t _urgent_sync_ms;       // Longest time urgent records stay unsynced
+    uint32_t _urgent_written_ms;    // clockMs() when the oldest unsynced urgent record was written
+    bool _urgent_unsynced;          // Urgent records written since the last fsync()
+    bool _bulk_on;                  // Bulk lane configured
+    FSLogRingBuffer _bulk;          // Records below _bulk_level, written in large batches
+    LogLevel _bulk_level;           // Records below this level are bulk
+    Backpressure _backpressure;     // What happens when a lane is full
+    unsigned int _block_ms;         // Longest wait for BACKPRESSURE_BLOCK
+    LogLevel _degrade_level;        // Records below this level are dropped first by BACKPRESSURE_DEGRADE
+    std::atomic<uint32_t> _drops_newest;    // See DropStats
+    std::atomic<uint32_t> _drops_oldest;
+    std::atomic<uint32_t> _drops_timeouts;
+    std::atomic<uint32_t> _drops_degraded;
+    uint32_t _drops_reported;       // getDropCount() when the last drop marker was written
+    // Token bucket, refilled lazily by whichever producer finds it out of date
+    struct RateBucket {
+        std::atomic<uint32_t> tokens;   // Milli-records available
+        std::atomic<uint32_t> last_ms;  // clockMs() of the last refill
+    };
+    struct RateLimit {
+        uint32_t hash;              // fslogHash() of the category
+        String category;            // For summary records
+        uint32_t rate;              // Milli-records added per millisecond, which is records per second
+        uint32_t capacity;          // Burst in milli-records
+        uint8_t buckets;            // 1, or FS_LOG_HANDLER_RATE_CALLSITE_BUCKETS for per-call-site limits
+        RateBucket bucket[FS_LOG_HANDLER_RATE_CALLSITE_BUCKETS];
+        std::atomic<uint32_t> suppressed;   // Records refused since the last summary
+    };
+    RateLimit _rate_limits[FS_LOG_HANDLER_MAX_RATE_LIMITS];
+    int8_t _rate_table[FS_LOG_HANDLER_MAX_RATE_LIMITS * 2];    // Open addressing on the category hash, -1 for empty
+    uint8_t _rate_count;            // Limits in use
+    uint32_t _rate_summary_ms;      // clockMs() of the last summary pass
+    struct DedupEntry {
+        uint32_t hash;              // Hash of category, level and message, 0 for an unused entry
+        uint32_t count;             // Repeats not yet reported
+        uint32_t reported_ms;       // clockMs() when the message was first seen or last reported
+        LogLevel level;
+        char category[32];          // Truncated copies for the summary record
+        char message[24];
+    };
+    DedupEntry _dedup[FS_LOG_HANDLER_DEDUP_HISTORY];
+    uint8_t _dedup_size;            // Entries in use, 0 when disabled
+    uint8_t _dedup_next;            // Entry replaced by the next new message
+    uint32_t _dedup_timeout_ms;     // Longest time repeats go unreported
+    std::atomic_flag _dedup_busy;   // Held while _dedup is being updated
+    // Writer side statistics, guarded by _stats_seq
+    struct WriterCounters {
+        uint64_t bytes_written;
+        uint32_t writes;
+        uint32_t fsyncs;
+        uint32_t write_us[FS_LOG_HANDLER_STATS_BUCKETS];
+        uint32_t fsync_us[FS_LOG_HANDLER_STATS_BUCKETS];
+        uint32_t sync_interval_ms;  // Sync scheduler state, only changed by the thread that drains the buffer
+        uint32_t fsync_cost_us;
+        uint32_t byte_rate;
+        uint32_t bytes_per_sync;
+        uint32_t poll_ms;
+        uint32_t unsynced_ms_max;
+    };
+    WriterCounters _counters;       // See Stats
+    std::atomic<uint32_t> _stats_seq;   // Seqlock sequence, odd while _counters is being updated
+    std::atomic<uint32_t> _stat_messages;   // See Stats
+    std::atomic<uint32_t> _stat_log_us[FS_LOG_HANDLER_STATS_BUCKETS];
+    std::atomic<uint32_t> _stat_high_water[3];  // RAM buffer, urgent lane, bulk lane
+    bool _stats_timing;             // Time logMessage() calls
+    uint32_t _stats_period_ms;      // Interval between summary records, 0 for none
+    uint32_t _stats_emit_ms;        // clockMs() of the last summary record
+    bool _flight_on;                // Flight recorder configured
+    FSLogRingBuffer _flight;        // Records below _flight_persist, each prefixed with its u32 capture clockMs()
+    LogLevel _flight_persist;       // Lowest level that bypasses the flight recorder
+    LogLevel _flight_trigger_level; // Records at or above this level fire the flight recorder
+    String _flight_trigger_category;    // Category that fires the flight recorder, empty for none
+    uint32_t _flight_pre_ms;        // Buffered history persisted on a trigger
+    uint32_t _flight_post_ms;       // Time after a trigger during which records bypass the flight recorder
+    std::atomic<uint32_t> _flight_trigger_ms;   // clockMs() of the most recent trigger
+    std::atomic<bool> _flight_post; // Post-trigger window may still be open, cleared by the consumer
+    std::atomic<uint32_t> _flight_triggers;     // Triggers fired
+    std::atomic<uint32_t> _flight_pending_ms;   // clockMs() of the earliest trigger whose window isn't written yet, 0 for none
+    uint64_t _flight_persisted;     // See FlightRecorderStats
+    uint64_t _flight_avoided;       // See FlightRecorderStats
+
+    static void writerThread(void *arg);
+    inline void notifyWriter() {
+        if (_writer && _buffer.used() >= _writer_watermark) {
+            os_semaphore_give(_writer_wake, false);
+        }
+    };
+    void timedSync();
+    bool syncDue();
+    uint32_t writerWait();
+    void schedulePass();
+    void updateSchedule(uint32_t fsync_us, uint32_t bytes);
+    uint32_t syncFile();
+    int writeData(const void *data, size_t len);
+    void holdWrite(const void *data, size_t len, int result);
+    bool retryHeld(bool force);
+    void endStall();
+    bool evictOldest();
+    void reportIo(IoEvent::Type type, uint32_t bytes, uint32_t us, int result);
+    inline uint32_t clockMs() const {
+        return _clock ? _clock() : millis();
+    };
+    size_t drain(bool all = true);
+    size_t drainLane(FSLogRingBuffer &lane);
+    size_t drainUrgent();
+    void urgentSync();
+    size_t drainFlight();
+    size_t largestRecord();
+    uint32_t reorderWindow();
+    bool writeRecord(const char *data, size_t len);
+    char *reserveRecord(LogLevel level, const char *category, size_t len, FSLogRingBuffer **ring);
+    char *reserveLane(FSLogRingBuffer &lane, LogLevel level, size_t len);
+    char *reserveEvicting(FSLogRingBuffer &lane, size_t len);
+    char *reserveBlocking(FSLogRingBuffer &lane, size_t len);
+    void writeNotice(const char *category, uint32_t count, const char *what);
+    void writeSynthetic(LogLevel level, const char *category, const char *msg, size_t msg_len);
+    void writeStatsRecord();
+    inline void countersBegin() {
+        _stats_seq.store(_stats_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    };
+    inline void countersEnd() {
+        _stats_seq.store(_stats_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    };
+    void queueMessage(const char *msg, LogLevel level, const char *category, const LogAttributes &attr);
+    bool dedupRecord(const char *msg, LogLevel level, const char *category);
+    void dedupReport(const DedupEntry &entry);
+    void dedupFlush(bool all);
+    bool admitRecord(const char *category, uint32_t callsite);
+    RateLimit *findRateLimit(uint32_t hash, const char *category, size_t len);
+    void writeRateSummaries();
+    void commitRecord(FSLogRingBuffer *ring, char *span, size_t len);
+    void writeToFile(const char *data, size_t len);
+    void stage(const char *data, size_t len);
+    void writeBinaryRecord(const char *data, size_t len);
+    void writeCallsite(const struct PackedRecord *r, uint8_t flags, const char *file, const char *func);
+    void writeVarint(uint32_t value);
+    void writeLengthPrefixed(const char *data, size_t len);
+    uint32_t internString(uint32_t *table, uint8_t *count, size_t max, uint32_t hash, bool *is_new);
+    void flushBlock();
+    bool flushStaged();
+    bool allocCompressBuffer();
+    bool logfileInit();
+    // Limits and read buffer of one dump slice
+    struct DumpSlice {
+        size_t max_bytes;           // Byte limit
+        size_t written;             // Bytes written so far
+        uint32_t start_us;          // micros() when the slice started
+        uint32_t max_us;            // Time limit, 0 for none
+        uint8_t *buf;               // Read buffer of _dump_chunk bytes, set by dumpStep()
+
+        bool exhausted() const { return written >= max_bytes || (max_us && micros() - start_us >= max_us); };
+        void spend(size_t n) { written += n; };
+    };
 
-    void writeToFile(String message);
+    void runDumpJobs();
+    bool dumpStep(Print &stream, FSLogCursor *cursor, int *fd, DumpSlice *slice);
+    bool dumpFiles(Print &stream, FSLogCursor *cursor, int *fd, DumpSlice *slice);
+    bool storageDump() { return !_rot_files && !_compress && !(_journal && _format == FORMAT_TEXT); };
+    bool dumpStorage(Print &stream, FSLogCursor *cursor, DumpSlice *slice);
+    bool dumpRaw(Print &stream, int fd, FSLogCursor *cursor, DumpSlice *slice);
+    String generationPath(uint32_t generation);
+    bool readGeneration(uint32_t *generation);
+    void loadGeneration();
+    void saveGeneration();
+    void rotate();
+    bool dumpFrames(Print &stream, int fd, FSLogCursor *cursor, DumpSlice *slice);
+    bool journalInit();
+    off_t journalRecover(off_t size);
+    off_t journalScan(off_t pos, off_t size);
+    void journalRecord(const char *data, size_t len);
+    void journalCommit();
+    bool dumpJournal(Print &stream, int fd, FSLogCursor *cursor, DumpSlice *slice);
+    size_t dumpJournalPayload(Print &stream, int fd, off_t offset, size_t len, DumpSlice *slice);
+    bool indexActive();
+    void indexInit();
+    void indexRecord(const char *data, size_t len);
+    void indexFlush();
+    void indexClose();
+    off_t indexLookup(const char *path, uint32_t time);
+    void dumpRange(Print &stream, const char *path, uint32_t from_ms, uint32_t to_ms);
     bool fileInit();
     void syncAndClose();
     static bool createDirIfNecessary(const char *path);
@@ -0,0 +1,128 @@
+// FSLogRingBuffer: Lock-free multi-producer/single-consumer byte ring used by FSLogHandler
+// Company: Particle
+
+#include "FSLogRingBuffer.h"
+#include <new>
+#include <string.h>
+
+FSLogRingBuffer::FSLogRingBuffer(size_t capacity) :
+        _buf(nullptr), _capacity(0), _mask(0), _peek_size(0), _head(0), _tail(0), _dropped(0) {
+    if (capacity) {
+        resize(capacity);
+    }
+}
+
+FSLogRingBuffer::~FSLogRingBuffer() {
+    delete[] _buf;
+}
+
+bool FSLogRingBuffer::resize(size_t capacity) {
+    delete[] _buf;
+    _buf = nullptr;
+    _capacity = 0;
+    _mask = 0;
+    _head.store(0);
+    _tail.store(0);
+
+    // Round down to a power of two so positions can run freely and wrap with a mask
+    uint32_t size = 64;
+    while (size * 2 <= capacity) {
+        size *= 2;
+    }
+
+    _buf = new (std::nothrow) char[size];
+    if (!_buf) {
+        return false;
+    }
+    memset(_buf, 0, size);
+    _capacity = size;
+    _mask = size - 1;
+    return true;
+}
+
+char *FSLogRingBuffer::reserve(size_t len) {
+    uint32_t size = (sizeof(Header) + len + sizeof(Header) - 1) & ~(uint32_t)(sizeof(Header) - 1);
+    if (!_buf || len > LEN_MASK || size > _capacity) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    uint32_t pad;
+    for (;;) {
+        // Records are never split, so skip to the start of the buffer if this one doesn't fit before the end
+        uint32_t offset = head & _mask;
+        pad = (_capacity - offset < size) ? _capacity - offset : 0;
+
+        uint32_t tail = _tail.load(std::memory_order_acquire);
+        if (head + pad + size - tail > _capacity) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        if (_head.compare_exchange_weak(head, head + pad + size, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    if (pad) {
+        Header *p = at(head);
+        p->size = pad;
+        __atomic_store_n(&p->state, COMMITTED | PADDING, __ATOMIC_RELEASE);
+        head += pad;
+    }
+
+    Header *h = at(head);
+    h->size = size;
+    return reinterpret_cast<char *>(h + 1);
+}
+
+void FSLogRingBuffer::commit(char *span, size_t len) {
+    Header *h = reinterpret_cast<Header *>(span) - 1;
+    __atomic_store_n(&h->state, COMMITTED | ((uint32_t)len & LEN_MASK), __ATOMIC_RELEASE);
+}
+
+bool FSLogRingBuffer::write(const char *data, size_t len) {
+    char *span = reserve(len);
+    if (!span) {
+        return false;
+    }
+    memcpy(span, data, len);
+    commit(span, len);
+    return true;
+}
+
+const char *FSLogRingBuffer::peek(size_t *len) {
+    for (;;) {
+        uint32_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+
+        Header *h = at(tail);
+        uint32_t state = __atomic_load_n(&h->state, __ATOMIC_ACQUIRE);
+        if (!(state & COMMITTED)) {
+            return nullptr;     // Oldest slot is still being filled in
+        }
+        if (state & PADDING) {
+            release(tail, h->size);
+            continue;
+        }
+
+        _peek_size = h->size;
+        *len = state & LEN_MASK;
+        return reinterpret_cast<const char *>(h + 1);
+    }
+}
+
+void FSLogRingBuffer::pop() {
+    if (_peek_size) {
+        release(_tail.load(std::memory_order_relaxed), _peek_size);
+        _peek_size = 0;
+    }
+}
+
+void FSLogRingBuffer::release(uint32_t tail, uint32_t size) {
+    // Clear the slot so a stale COMMITTED flag can't be mistaken for a header once the space is reused
+    memset(_buf + (tail & _mask), 0, size);
+    _tail.store(tail + size, std::memory_order_release);
+}
@@ -0,0 +1,100 @@
+// FSLogRingBuffer: Lock-free multi-producer/single-consumer byte ring used by FSLogHandler
+// Company: Particle
+
+#ifndef __FSLOGRINGBUFFER_H
+#define __FSLOGRINGBUFFER_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Fixed-size, lock-free multi-producer/single-consumer ring of variable length records
+ *
+ * Any number of producers may reserve() a contiguous span, fill it in and commit() it.  A single consumer
+ * walks the committed records in order with peek() and pop().  Records never straddle the end of the buffer,
+ * so every span handed out is contiguous.  When the ring is full, reserve() fails and the record is counted
+ * as dropped; producers never block.
+ *
+ * The capacity is rounded down to a power of two.
+ */
+class FSLogRingBuffer {
+public:
+    /**
+	 * @brief Constructor
+     *
+     * @param capacity Size of the ring in bytes (optional, default is 0 - call resize() before use)
+	 */
+    explicit FSLogRingBuffer(size_t capacity = 0);
+    ~FSLogRingBuffer();
+
+    /**
+	 * @brief Reallocate the ring, discarding any queued records.  Not thread safe: no producers or consumer may be active.
+     *
+     * @return True if the buffer was allocated
+	 */
+    bool resize(size_t capacity);
+
+    /**
+	 * @brief Reserve a contiguous span of len bytes.  Safe to call from any number of threads.
+     *
+     * @return Pointer to the span, or nullptr if the ring is full
+	 */
+    char *reserve(size_t len);
+
+    /**
+	 * @brief Publish a span returned by reserve() to the consumer
+     *
+     * @param span Pointer returned by reserve()
+     * @param len Number of bytes actually used, which may be less than the reserved length
+	 */
+    void commit(char *span, size_t len);
+
+    /**
+	 * @brief Convenience wrapper around reserve(), memcpy() and commit()
+     *
+     * @return False if the record was dropped
+	 */
+    bool write(const char *data, size_t len);
+
+    /**
+	 * @brief Consumer only: get the oldest committed record without removing it
+     *
+     * @param len Set to the record length
+     * @return Pointer to the record data, or nullptr if nothing is ready
+	 */
+    const char *peek(size_t *len);
+
+    /**
+	 * @brief Consumer only: release the record returned by the last peek()
+	 */
+    void pop();
+
+    size_t capacity() const { return _capacity; };
+    size_t used() const { return _head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_relaxed); };
+    bool empty() const { return used() == 0; };
+    uint32_t dropped() const { return _dropped.load(std::memory_order_relaxed); };
+
+private:
+    struct Header {
+        uint32_t state;             // COMMITTED/PADDING flags and payload length, accessed atomically
+        uint32_t size;              // Total size of this slot including the header
+    };
+
+    static const uint32_t COMMITTED = 0x80000000;
+    static const uint32_t PADDING   = 0x40000000;
+    static const uint32_t LEN_MASK  = 0x3FFFFFFF;
+
+    inline Header *at(uint32_t pos) { return reinterpret_cast<Header *>(_buf + (pos & _mask)); };
+    void release(uint32_t tail, uint32_t size);
+
+    char *_buf;                     // Ring storage
+    uint32_t _capacity;             // Ring size in bytes, power of two
+    uint32_t _mask;                 // _capacity - 1
+    uint32_t _peek_size;            // Slot size of the record returned by the last peek()
+    std::atomic<uint32_t> _head;    // Next free byte, advanced by producers
+    std::atomic<uint32_t> _tail;    // Oldest unreleased byte, advanced by the consumer
+    std::atomic<uint32_t> _dropped; // Records refused because the ring was full
+};
+
+#endif  //__FSLOGRINGBUFFER_H
@@ -0,0 +1,132 @@
+// FSLogSpiFlash: FSLogFlash driver for an external SPI NOR flash
+// Company: Particle
+
+#include "FSLogSpiFlash.h"
+#include <errno.h>
+
+#define SPI_FLASH_READ          0x03
+#define SPI_FLASH_PAGE_PROGRAM  0x02
+#define SPI_FLASH_SECTOR_ERASE  0x20
+#define SPI_FLASH_WRITE_ENABLE  0x06
+#define SPI_FLASH_READ_STATUS   0x05
+#define SPI_FLASH_JEDEC_ID      0x9F
+#define SPI_FLASH_RELEASE_PD    0xAB
+
+#define SPI_FLASH_STATUS_BUSY   0x01
+#define SPI_FLASH_STATUS_WEL    0x02
+
+// Worst cases from the datasheets of common parts, with margin
+#define SPI_FLASH_PROGRAM_MS    10
+#define SPI_FLASH_ERASE_MS      1000
+
+void FSLogSpiFlash::begin() {
+    pinMode(_cs, OUTPUT);
+    digitalWrite(_cs, HIGH);
+    _spi.begin();
+    simpleCommand(SPI_FLASH_RELEASE_PD);
+    delayMicroseconds(50);  // tRES1
+}
+
+uint32_t FSLogSpiFlash::jedecId() {
+    uint8_t id[3];
+    select();
+    _spi.transfer(SPI_FLASH_JEDEC_ID);
+    _spi.transfer(nullptr, id, sizeof(id), nullptr);
+    deselect();
+    return (uint32_t)id[0] << 16 | (uint32_t)id[1] << 8 | id[2];
+}
+
+int FSLogSpiFlash::read(uint32_t address, void *data, size_t len) {
+    select();
+    command(SPI_FLASH_READ, address);
+    _spi.transfer(nullptr, data, len, nullptr);
+    deselect();
+    return 0;
+}
+
+// Split at page boundaries, as a program that reaches the end of a page wraps to its start
+int FSLogSpiFlash::program(uint32_t address, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (len) {
+        size_t n = PAGE_SIZE - address % PAGE_SIZE;
+        if (n > len) {
+            n = len;
+        }
+        if (!writeEnable()) {
+            return -EIO;
+        }
+        select();
+        command(SPI_FLASH_PAGE_PROGRAM, address);
+        _spi.transfer((void *)p, nullptr, n, nullptr);
+        deselect();
+        int result = waitReady(SPI_FLASH_PROGRAM_MS, false);
+        if (result) {
+            return result;
+        }
+        address += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int FSLogSpiFlash::eraseSector(uint32_t address) {
+    if (!writeEnable()) {
+        return -EIO;
+    }
+    select();
+    command(SPI_FLASH_SECTOR_ERASE, address - address % SECTOR_SIZE);
+    deselect();
+    return waitReady(SPI_FLASH_ERASE_MS, true);
+}
+
+void FSLogSpiFlash::select() {
+    _spi.beginTransaction(SPISettings(_clock_hz, MSBFIRST, SPI_MODE0));
+    digitalWrite(_cs, LOW);
+}
+
+void FSLogSpiFlash::deselect() {
+    digitalWrite(_cs, HIGH);
+    _spi.endTransaction();
+}
+
+void FSLogSpiFlash::command(uint8_t cmd, uint32_t address) {
+    uint8_t buf[4] = { cmd, (uint8_t)(address >> 16), (uint8_t)(address >> 8), (uint8_t)address };
+    _spi.transfer(buf, nullptr, sizeof(buf), nullptr);
+}
+
+void FSLogSpiFlash::simpleCommand(uint8_t cmd) {
+    select();
+    _spi.transfer(cmd);
+    deselect();
+}
+
+// Returns false if the chip didn't latch the enable, e.g. because it is write protected or missing
+bool FSLogSpiFlash::writeEnable() {
+    simpleCommand(SPI_FLASH_WRITE_ENABLE);
+    select();
+    _spi.transfer(SPI_FLASH_READ_STATUS);
+    uint8_t status = _spi.transfer(0xFF);
+    deselect();
+    return (status & (SPI_FLASH_STATUS_WEL | SPI_FLASH_STATUS_BUSY)) == SPI_FLASH_STATUS_WEL;
+}
+
+// Poll the busy bit.  Erases take tens of milliseconds, so their wait gives the CPU to other threads between polls.
+int FSLogSpiFlash::waitReady(uint32_t timeout_ms, bool yield) {
+    uint32_t start = millis();
+    for (;;) {
+        select();
+        _spi.transfer(SPI_FLASH_READ_STATUS);
+        uint8_t status = _spi.transfer(0xFF);
+        deselect();
+        if (!(status & SPI_FLASH_STATUS_BUSY)) {
+            return 0;
+        }
+        if (millis() - start > timeout_ms) {
+            return -ETIMEDOUT;
+        }
+        if (yield) {
+            delay(1);
+        }
+    }
+}
@@ -0,0 +1,69 @@
+// FSLogSpiFlash: FSLogFlash driver for an external SPI NOR flash
+// Company: Particle
+//
+// Lets FSLogFlashStorage keep the log on a standard SPI NOR chip (W25Q, MX25L, GD25Q and the like) wired to one of the
+// device's SPI ports, away from the internal flash that holds the DeviceOS filesystem.  Uses the commands every such chip
+// shares: 0x03 read, 0x02 page program, 0x20 4 KB sector erase, and the busy bit of status register 1.  Addresses are
+// 24 bits, so up to 16 MB.  Device only; the host tools use a file-backed emulator instead.
+//
+//     FSLogSpiFlash flash(SPI, D5);
+//     FSLogFlashStorage storage(flash, 0, FSLogSpiFlash::SECTOR_SIZE, 256);   // First 1 MB of the chip
+//
+//     flash.begin();
+//     logHandler.configureStorage(&storage);
+
+#ifndef __FSLOGSPIFLASH_H
+#define __FSLOGSPIFLASH_H
+
+#include "Particle.h"
+#include "FSLogFlashStorage.h"
+
+/**
+ * @brief SPI NOR flash for FSLogFlashStorage.  Erases and programs wait for the chip, so they belong on the thread that
+ * drains the log (loop() or the writer thread), which is where FSLogHandler calls them.
+ */
+class FSLogSpiFlash : public FSLogFlash {
+public:
+    static const size_t SECTOR_SIZE = 4096;     // Erase unit, the sector_size to give FSLogFlashStorage
+    static const size_t PAGE_SIZE = 256;        // A program can't cross a page boundary
+
+    /**
+	 * @brief Constructor
+     *
+     * @param spi SPI port the chip is on
+     * @param cs Chip select pin
+     * @param clock_hz SPI clock (optional, default is 30 MHz)
+	 */
+    FSLogSpiFlash(SPIClass &spi, pin_t cs, uint32_t clock_hz = 30000000) : _spi(spi), _cs(cs), _clock_hz(clock_hz) {}
+
+    /**
+	 * @brief Set up the chip select pin and wake the chip from deep power down.  Call from setup() before the storage is
+     * used.
+	 */
+    void begin();
+
+    /**
+	 * @brief Read the JEDEC manufacturer and device id, to check the chip is there
+     *
+     * @return Id in the low 24 bits, 0 or 0xFFFFFF if nothing answered
+	 */
+    uint32_t jedecId();
+
+    int read(uint32_t address, void *data, size_t len) override;
+    int program(uint32_t address, const void *data, size_t len) override;
+    int eraseSector(uint32_t address) override;
+
+private:
+    SPIClass &_spi;
+    pin_t _cs;                      // Chip select, active low
+    uint32_t _clock_hz;             // SPI clock
+
+    void select();
+    void deselect();
+    void command(uint8_t cmd, uint32_t address);
+    void simpleCommand(uint8_t cmd);
+    bool writeEnable();
+    int waitReady(uint32_t timeout_ms, bool yield);
+};
+
+#endif  //__FSLOGSPIFLASH_H
@@ -0,0 +1,81 @@
+// FSLogStorage: Storage backend interface for FSLogHandler
+// Company: Particle
+//
+// FSLogHandler writes its log through this interface: to a logfile on the DeviceOS filesystem by default (see
+// FSLogFileStorage.h), or with FSLogHandler::configureStorage() to another backend, which only has to append, sync and
+// read back a byte stream.  The interface has no DeviceOS dependencies, so backends can be built and measured on a host
+// (see tools/fslog_bench.cpp).
+
+#ifndef __FSLOGSTORAGE_H
+#define __FSLOGSTORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Persistent byte stream that FSLogHandler appends its write blocks to
+ *
+ * The handler calls every method from one thread at a time, with its lock held.  Data survives across boots: open()
+ * continues after whatever the previous session left, and the backend decides what to discard when it fills up.
+ */
+class FSLogStorage {
+public:
+    virtual ~FSLogStorage() {}
+
+    /**
+	 * @brief Prepare for appending after the data already stored
+     *
+     * @return False if the storage can't be used
+	 */
+    virtual bool open() = 0;
+
+    /**
+	 * @brief Append bytes to the log.  Bytes reported as appended are kept even if the call fails part way, so only the
+     * rest is retried.
+     *
+     * @return len, fewer bytes if the call failed part way, or -1 with errno set (ENOSPC, EIO) if nothing was appended
+	 */
+    virtual int append(const void *data, size_t len) = 0;
+
+    /**
+	 * @brief Make everything appended so far survive a power cut
+     *
+     * @return 0, or -1 with errno set
+	 */
+    virtual int sync() = 0;
+
+    /**
+	 * @brief Sync and release the storage.  open() is called again before the next append().
+	 */
+    virtual void close() = 0;
+
+    /**
+	 * @brief Copy stored data to data, starting at *position, and advance *position past it.  Reading the same position
+     * again gives the same bytes for as long as they are stored.  A position of 0, or one whose data has since been
+     * discarded, reads from the oldest data.  With len 0 nothing is read, but *position is still moved to where the next
+     * read would start, which tells whether a saved position is still valid.  May be called before open().
+     *
+     * @return Number of bytes read, 0 at the end of the log, or -1 on error
+	 */
+    virtual int read(uint64_t *position, uint8_t *data, size_t len) = 0;
+
+    /**
+	 * @brief Discard everything stored
+	 */
+    virtual void clear() = 0;
+
+    /**
+	 * @brief Get the number of bytes of log data stored.  May be called before open().
+     *
+     * @return Bytes stored, or -1 if they can't be counted
+	 */
+    virtual long size() = 0;
+
+    /**
+	 * @brief Do a bounded piece of background work, such as erasing ahead of the writer.  Called by FSLogHandler::loop()
+     * or the writer thread after each pass.
+	 */
+    virtual void maintain() {}
+};
+
+#endif  //__FSLOGSTORAGE_H
@@ -0,0 +1,963 @@
+// fslog_bench: Host-side benchmarks for FSLogHandler
+// Company: Particle
+//
+// Measures the RAM buffer that logMessage() writes into, the LZ4 block compressor used by configureCompression(), the
+// CRC-32 used by configureJournal(), FSLogFlashStorage against appending to a file, and FSLogHandler itself built
+// against tools/host: logMessage() cost and heap allocations per record, formatting cost per attribute combination
+// against the String/concat() formatter it replaced, the writer thread, dump() and FSLogReader throughput per file
+// layout, time range dumps, write block sizes with their flash cost under a model of littlefs, and configureFsync()
+// thresholds.  The handler runs on the host filesystem in a scratch directory, so its numbers show relative costs
+// rather than what a device achieves.  Results are written to stdout as JSON, one object per benchmark, so runs of two
+// versions can be compared.
+//
+// Build:   make -C tools
+// Usage:   fslog_bench [--quick] [--corpus FILE] > results.json
+//
+// --corpus adds a captured log to the compressor benchmarks and replaces the generated sample log with it for the CRC
+// and storage ones.  tools/corpus/mixed.log, which make bench and make check pass, interleaves NMEA sentences and AT
+// command traffic logged as text records with runs of raw UBX NAV-PVT and RXM-RAWX frames, so its blocks show both
+// sides of the compressor's choice between compressing a block and storing it.
+
+#include "../src/FSLogCompress.h"
+#include "../src/FSLogCrc.h"
+#include "../src/FSLogFlashStorage.h"
+#include "../src/FSLogFormat.h"
+#include "../src/FSLogHandler.h"
+#include "../src/FSLogRingBuffer.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedNs(Clock::time_point start) {
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+static bool _first_result = true;
+
+static void result(const char *name, const char *unit, double value, const char *extra = nullptr) {
+    printf("%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.3f%s%s}", _first_result ? "" : ",", name, unit, value,
+            extra ? ", " : "", extra ? extra : "");
+    _first_result = false;
+}
+
+// Heap allocations made by the benchmark process, to check the logging path doesn't allocate.  The replacements are
+// kept out of line so the compiler doesn't pair the inlined malloc() and free() with the std::allocator calls.
+static std::atomic<uint64_t> _allocations(0);
+
+__attribute__((noinline)) void *operator new(size_t size) {
+    _allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t size) noexcept {
+    (void)size;
+    free(p);
+}
+
+static std::string _corpus;
+static const char *_corpus_path;
+
+// Text records in the layout FSLogHandler writes, with enough variety for the compressor to work on
+static std::string generatedLog(size_t len) {
+    static const char *categories[] = { "app", "app.gps", "app.gps.nmea", "net.cell", "comm.protocol" };
+    static const char *levels[] = { "TRACE", "INFO", "WARN", "ERROR" };
+    std::string log;
+    uint32_t time = 1000;
+    uint32_t seed = 1;
+    while (log.size() < len) {
+        seed = seed * 1103515245 + 12345;
+        time += seed % 97;
+        char line[160];
+        snprintf(line, sizeof(line), "%010u [%s] %s: fix=%u hdop=%u.%02u sats=%u lat=%d\n\r", time,
+                categories[(seed >> 8) % 5], levels[(seed >> 12) % 4], (seed >> 4) % 4, (seed >> 16) % 5, (seed >> 6) % 100,
+                (seed >> 20) % 14, (int)(seed % 2000000) - 1000000);
+        log += line;
+    }
+    log.resize(len);
+    return log;
+}
+
+// The --corpus file repeated to length
+static std::string corpusLog(size_t len) {
+    std::string log;
+    while (log.size() < len) {
+        log += _corpus;
+    }
+    log.resize(len);
+    return log;
+}
+
+// The generated log, or the --corpus file
+static std::string sampleLog(size_t len) {
+    return _corpus.empty() ? generatedLog(len) : corpusLog(len);
+}
+
+// One producer and one consumer on the same thread: the uncontended cost of reserve/commit plus peek/pop
+static void benchRingSingle(size_t records, size_t record_len) {
+    FSLogRingBuffer ring(16384);
+    std::vector<char> data(record_len, 'x');
+    auto start = Clock::now();
+    for (size_t i = 0; i < records; i++) {
+        char *span = ring.reserve(record_len);
+        memcpy(span, data.data(), record_len);
+        ring.commit(span, record_len);
+        size_t len;
+        ring.peek(&len);
+        ring.pop();
+    }
+    char extra[64];
+    snprintf(extra, sizeof(extra), "\"record_bytes\": %u", (unsigned)record_len);
+    result("ring.single_thread", "ns/record", elapsedNs(start) / records, extra);
+}
+
+// Several producers racing a consumer thread, as with logging from multiple threads and the writer thread running.
+// Producers retry when the ring is full, so this is end-to-end throughput; the retries show up as full_retries.
+static void benchRingContended(size_t records, unsigned producers) {
+    FSLogRingBuffer ring(16384);
+    std::atomic<bool> done(false);
+    std::atomic<size_t> consumed(0);
+    std::thread consumer([&]() {
+        size_t len;
+        while (!done.load() || !ring.empty()) {
+            if (ring.peek(&len)) {
+                ring.pop();
+                consumed++;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < producers; t++) {
+        threads.emplace_back([&]() {
+            char data[64] = {};
+            for (size_t i = 0; i < records / producers; i++) {
+                while (!ring.write(data, sizeof(data))) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    done = true;
+    consumer.join();
+    double ns = elapsedNs(start);
+
+    char extra[96];
+    snprintf(extra, sizeof(extra), "\"producers\": %u, \"full_retries\": %u, \"consumed\": %u", producers, ring.dropped(),
+            (unsigned)consumed.load());
+    result("ring.contended", "ns/record", ns / records, extra);
+}
+
+// configureCompression() frames of one write block each: like flushBlock(), a block that doesn't shrink is stored
+// rather than compressed, and the ratio includes the frame headers
+static void benchCompress(const char *input, const std::string &log, size_t block) {
+    std::vector<uint8_t> out(block);
+    std::vector<uint8_t> back(block);
+    uint16_t table[1 << FSLOG_LZ_HASH_BITS];
+    std::vector<std::vector<uint8_t>> frames;
+
+    size_t total = log.size();
+    size_t packed = 0;
+    uint32_t stored = 0;
+    auto start = Clock::now();
+    for (size_t off = 0; off + block <= total; off += block) {
+        size_t n = fslogCompress((const uint8_t *)log.data() + off, block, out.data(), out.size(), table);
+        if (n) {
+            frames.emplace_back(out.begin(), out.begin() + n);
+        } else {
+            n = block;
+            stored++;
+        }
+        packed += FSLOG_Z_FRAME_HEADER_SIZE + n;
+    }
+    double compress_ns = elapsedNs(start);
+
+    start = Clock::now();
+    for (const std::vector<uint8_t> &frame : frames) {
+        fslogDecompress(frame.data(), frame.size(), back.data(), back.size());
+    }
+    double decompress_ns = elapsedNs(start);
+
+    size_t raw = (frames.size() + stored) * block;
+    char extra[192];
+    snprintf(extra, sizeof(extra), "\"input\": \"%s\", \"block_bytes\": %u, \"ratio\": %.3f, \"frames\": %u, "
+            "\"compressed_frames\": %u, \"stored_frames\": %u", input, (unsigned)block, (double)packed / raw,
+            (unsigned)frames.size() + stored, (unsigned)frames.size(), stored);
+    result("lz4.compress", "MB/s", raw / compress_ns * 1000, extra);
+    snprintf(extra, sizeof(extra), "\"input\": \"%s\", \"block_bytes\": %u", input, (unsigned)block);
+    result("lz4.decompress", "MB/s", frames.size() * block / decompress_ns * 1000, extra);
+}
+
+static void benchCrc(size_t record_len, size_t total) {
+    std::string log = sampleLog(total);
+    volatile uint32_t crc = 0;
+    auto start = Clock::now();
+    for (size_t off = 0; off + record_len <= total; off += record_len) {
+        crc = fslogCrc32(log.data() + off, record_len);
+    }
+    (void)crc;
+    char extra[64];
+    snprintf(extra, sizeof(extra), "\"record_bytes\": %u", (unsigned)record_len);
+    result("crc32", "MB/s", total / elapsedNs(start) * 1000, extra);
+}
+
+// NOR flash emulated in a file: erased bytes are 0xFF and programming can only clear bits, as on the device.  Programs
+// that would need to set a bit are counted as violations and leave the bit cleared.
+class FileFlash : public FSLogFlash {
+public:
+    FileFlash(const char *path, size_t sector_size, size_t sectors) :
+            erases(0), programs(0), violations(0), _sector_size(sector_size) {
+        _fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        std::vector<uint8_t> erased(sector_size, 0xFF);
+        for (size_t i = 0; i < sectors; i++) {
+            pwrite(_fd, erased.data(), sector_size, i * sector_size);
+        }
+    }
+    ~FileFlash() {
+        close(_fd);
+    }
+
+    int read(uint32_t address, void *data, size_t len) override {
+        return pread(_fd, data, len, address) == (ssize_t)len ? 0 : -1;
+    }
+
+    int program(uint32_t address, const void *data, size_t len) override {
+        std::vector<uint8_t> cells(len);
+        if (pread(_fd, cells.data(), len, address) != (ssize_t)len) {
+            return -1;
+        }
+        const uint8_t *p = (const uint8_t *)data;
+        for (size_t i = 0; i < len; i++) {
+            violations += (cells[i] & p[i]) != p[i];
+            cells[i] &= p[i];
+        }
+        programs++;
+        return pwrite(_fd, cells.data(), len, address) == (ssize_t)len ? 0 : -1;
+    }
+
+    int eraseSector(uint32_t address) override {
+        std::vector<uint8_t> erased(_sector_size, 0xFF);
+        erases++;
+        return pwrite(_fd, erased.data(), _sector_size, address) == (ssize_t)_sector_size ? 0 : -1;
+    }
+
+    uint32_t erases;
+    uint32_t programs;
+    uint32_t violations;
+
+private:
+    int _fd;
+    size_t _sector_size;
+};
+
+// The handler's write pattern: 512 byte write blocks, synced every 4096 bytes as with the default configureFsync().
+// First through FSLogFlashStorage on an emulated 256 KiB region, then appended to a host file with fsync().  The host
+// file only shows the cost of a sync, as the host filesystem reports no erases.
+static void benchStorage(size_t total) {
+    const size_t block = 512;
+    const size_t sector_size = 4096;
+    const size_t sectors = 64;
+    std::string log = sampleLog(total);
+    char extra[256];
+
+    {
+        FileFlash flash("/tmp/fslog_bench.flash", sector_size, sectors);
+        FSLogFlashStorage storage(flash, 0, sector_size, sectors, 2);
+        storage.open();
+        auto start = Clock::now();
+        for (size_t off = 0; off + block <= total; off += block) {
+            storage.append(log.data() + off, block);
+            if ((off / block) % 8 == 7) {
+                storage.sync();
+                storage.maintain();
+            }
+        }
+        double ns = elapsedNs(start);
+
+        // Read back what survived the wrap-arounds and check it is the end of what was written
+        std::string stored;
+        std::vector<uint8_t> buf(1024);
+        uint64_t position = 0;
+        int n;
+        while ((n = storage.read(&position, buf.data(), buf.size())) > 0) {
+            stored.append((const char *)buf.data(), n);
+        }
+        size_t written = total / block * block;
+        bool intact = stored.size() <= written && log.compare(written - stored.size(), stored.size(), stored) == 0;
+
+        FSLogFlashStorage::Stats stats = storage.stats();
+        snprintf(extra, sizeof(extra), "\"erases\": %u, \"erases_per_mb\": %.1f, \"erase_stalls\": %u, \"programs\": %u, "
+                "\"overhead\": %.4f, \"violations\": %u, \"retained_bytes\": %u, \"intact\": %s", flash.erases,
+                flash.erases * 1048576.0 / written, stats.erase_stalls, flash.programs,
+                (double)stats.bytes_programmed / written - 1, flash.violations, (unsigned)stored.size(), intact ? "true" : "false");
+        result("storage.flash", "MB/s", written / ns * 1000, extra);
+        unlink("/tmp/fslog_bench.flash");
+    }
+
+    {
+        int fd = open("/tmp/fslog_bench.log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        uint32_t fsyncs = 0;
+        auto start = Clock::now();
+        for (size_t off = 0; off + block <= total; off += block) {
+            write(fd, log.data() + off, block);
+            if ((off / block) % 8 == 7) {
+                fsync(fd);
+                fsyncs++;
+            }
+        }
+        double ns = elapsedNs(start);
+        close(fd);
+        unlink("/tmp/fslog_bench.log");
+        snprintf(extra, sizeof(extra), "\"fsyncs\": %u", fsyncs);
+        result("storage.file", "MB/s", total / block * block / ns * 1000, extra);
+    }
+}
+
+// Handler benchmarks.  Each one runs a fresh handler on logfile "bench" in the scratch directory, fed through message(),
+// the entry point LogManager uses, and deletes the files afterwards.
+
+// Counts what a dump writes without keeping it
+class NullSink : public Print {
+public:
+    NullSink() : bytes(0), writes(0) {}
+
+    size_t write(uint8_t c) override {
+        (void)c;
+        bytes++;
+        writes++;
+        return 1;
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override {
+        (void)buffer;
+        bytes += size;
+        writes++;
+        return size;
+    }
+
+    uint64_t bytes;
+    uint32_t writes;
+};
+
+static const char *_message = "fix=3 hdop=1.20 sats=9 lat=47.6062 lon=-122.3321";
+
+enum {
+    ATTR_TIME = 1,
+    ATTR_CATEGORY = 2,
+    ATTR_FILE = 4,
+    ATTR_FUNCTION = 8,
+    ATTR_CODE = 16
+};
+
+static LogAttributes attributes(unsigned attrs) {
+    LogAttributes attr = {};
+    attr.size = sizeof(attr);
+    if (attrs & ATTR_FILE) {
+        attr.file = "src/gps/GpsReceiver.cpp";
+        attr.line = 214;
+        attr.has_file = 1;
+        attr.has_line = 1;
+    }
+    if (attrs & ATTR_FUNCTION) {
+        attr.function = "void GpsReceiver::handleFix(const Fix&)";
+        attr.has_function = 1;
+    }
+    if (attrs & ATTR_CODE) {
+        attr.code = -210;
+        attr.details = "timeout";
+        attr.has_code = 1;
+        attr.has_details = 1;
+    }
+    attr.has_time = (attrs & ATTR_TIME) != 0;
+    return attr;
+}
+
+static void removeLogs() {
+    DIR *dir = opendir(FS_LOG_HANDLER_DIR);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_name[0] != '.') {
+            unlink((std::string(FS_LOG_HANDLER_DIR "/") + entry->d_name).c_str());
+        }
+    }
+    closedir(dir);
+}
+
+struct MessageRun {
+    double log_ns;              // Time spent in message()
+    double drain_ns;            // Time spent in loop()
+    uint64_t log_allocations;   // Heap allocations during message()
+    uint64_t drain_allocations; // Heap allocations during loop()
+};
+
+// Log records in batches that fit the RAM buffer, calling loop() between batches, timing the two separately.  Record
+// times continue from *time in steps of time_step_ms.
+static MessageRun logRecords(FSLogHandler &handler, size_t records, unsigned attrs, uint32_t *time,
+        uint32_t time_step_ms = 1, size_t batch = 64) {
+    MessageRun run = {};
+    LogAttributes attr = attributes(attrs);
+    const char *category = (attrs & ATTR_CATEGORY) ? "app.gps" : nullptr;
+    for (size_t i = 0; i < records; i += batch) {
+        uint64_t allocations = _allocations;
+        auto start = Clock::now();
+        for (size_t j = 0; j < batch; j++) {
+            *time += time_step_ms;
+            attr.time = *time;
+            handler.message(_message, LOG_LEVEL_INFO, category, attr);
+        }
+        run.log_ns += elapsedNs(start);
+        run.log_allocations += _allocations - allocations;
+
+        allocations = _allocations;
+        start = Clock::now();
+        handler.loop();
+        run.drain_ns += elapsedNs(start);
+        run.drain_allocations += _allocations - allocations;
+    }
+    return run;
+}
+
+// logMessage() cost per attribute combination and record format, with the heap allocations it makes (there should be
+// none) and the cost of writing the records out from loop()
+static void benchLogMessage(size_t records) {
+    static const struct {
+        const char *name;
+        unsigned attrs;
+    } combinations[] = {
+        { "none", 0 },
+        { "time", ATTR_TIME },
+        { "time+category", ATTR_TIME | ATTR_CATEGORY },
+        { "time+category+file+line", ATTR_TIME | ATTR_CATEGORY | ATTR_FILE },
+        { "time+category+function", ATTR_TIME | ATTR_CATEGORY | ATTR_FUNCTION },
+        { "time+category+code+details", ATTR_TIME | ATTR_CATEGORY | ATTR_CODE },
+        { "all", ATTR_TIME | ATTR_CATEGORY | ATTR_FILE | ATTR_FUNCTION | ATTR_CODE }
+    };
+    records = records / 64 * 64;
+    for (int binary = 0; binary < 2; binary++) {
+        for (const auto &combination : combinations) {
+            MessageRun run;
+            FSLogHandler::Stats stats;
+            {
+                FSLogHandler handler("bench", false, LOG_LEVEL_TRACE);
+                handler.configureBuffer(65536);
+                handler.configureFormat(binary ? FSLogHandler::FORMAT_BINARY : FSLogHandler::FORMAT_TEXT);
+                handler.enable();
+                uint32_t time = 0;
+                run = logRecords(handler, records, combination.attrs, &time);
+                stats = handler.stats();
+            }
+            removeLogs();
+
+            char extra[320];
+            snprintf(extra, sizeof(extra), "\"format\": \"%s\", \"attributes\": \"%s\", \"allocs_per_record\": %.3f, "
+                    "\"drain_ns_per_record\": %.1f, \"drain_allocs_per_record\": %.3f, \"file_bytes_per_record\": %.1f, "
+                    "\"drops\": %u", binary ? "binary" : "text", combination.name, (double)run.log_allocations / records,
+                    run.drain_ns / records, (double)run.drain_allocations / records, (double)stats.bytes_written / records,
+                    stats.drops);
+            result("handler.log_message", "ns/record", run.log_ns / records, extra);
+        }
+    }
+}
+
+// The formatter logMessage() used before records went through the RAM buffer: a String built with concat() for each
+// field and written out in one piece.  Kept here as the baseline for handler.log_message.  The host String wraps
+// std::string, whose short string optimisation avoids some of the heap allocations DeviceOS String makes, so its
+// allocation counts are a lower bound.
+static String legacyFormat(const char *msg, LogLevel level, const char *category, const LogAttributes &attr) {
+    String s;
+    if (attr.has_time) {
+        s.concat(String::format("%010u ", (unsigned)attr.time));
+    }
+    if (category) {
+        s.concat("[");
+        s.concat(category);
+        s.concat("] ");
+    }
+    if (attr.has_file) {
+        const char *name = strrchr(attr.file, '/');
+        s.concat(name ? name + 1 : attr.file);
+        if (attr.has_line) {
+            s.concat(":");
+            s.concat(String(attr.line));
+        }
+        s.concat(attr.has_function ? ", " : ": ");
+    }
+    if (attr.has_function) {
+        const char *end = strchr(attr.function, '(');
+        if (!end) {
+            end = attr.function + strlen(attr.function);
+        }
+        const char *start = end;
+        while (start > attr.function && start[-1] != ' ') {
+            start--;
+        }
+        s.concat(String(std::string(start, end - start)));
+        s.concat("(): ");
+    }
+    s.concat(LogHandler::levelName(level));
+    s.concat(": ");
+    if (msg) {
+        s.concat(msg);
+    }
+    if (attr.has_code || attr.has_details) {
+        s.concat(" [");
+        if (attr.has_code) {
+            s.concat(String::format("code = %p", (void *)(intptr_t)attr.code));
+        }
+        if (attr.has_details) {
+            if (attr.has_code) {
+                s.concat(", ");
+            }
+            s.concat("details = ");
+            s.concat(attr.details);
+        }
+        s.concat(']');
+    }
+    s.concat("\n\r");
+    return s;
+}
+
+// legacyFormat() per attribute combination, written to a sink that discards it, for comparison with the text rows of
+// handler.log_message
+static void benchLegacyFormat(size_t records) {
+    static const struct {
+        const char *name;
+        unsigned attrs;
+    } combinations[] = {
+        { "none", 0 },
+        { "time", ATTR_TIME },
+        { "time+category", ATTR_TIME | ATTR_CATEGORY },
+        { "time+category+file+line", ATTR_TIME | ATTR_CATEGORY | ATTR_FILE },
+        { "time+category+function", ATTR_TIME | ATTR_CATEGORY | ATTR_FUNCTION },
+        { "time+category+code+details", ATTR_TIME | ATTR_CATEGORY | ATTR_CODE },
+        { "all", ATTR_TIME | ATTR_CATEGORY | ATTR_FILE | ATTR_FUNCTION | ATTR_CODE }
+    };
+    for (const auto &combination : combinations) {
+        NullSink sink;
+        LogAttributes attr = attributes(combination.attrs);
+        const char *category = (combination.attrs & ATTR_CATEGORY) ? "app.gps" : nullptr;
+        uint64_t allocations = _allocations;
+        auto start = Clock::now();
+        for (size_t i = 0; i < records; i++) {
+            attr.time = (uint32_t)i;
+            String s = legacyFormat(_message, LOG_LEVEL_INFO, category, attr);
+            sink.write((const uint8_t *)s.c_str(), s.length());
+        }
+        double ns = elapsedNs(start);
+        allocations = _allocations - allocations;
+
+        char extra[160];
+        snprintf(extra, sizeof(extra), "\"format\": \"text\", \"attributes\": \"%s\", \"allocs_per_record\": %.3f, "
+                "\"bytes_per_record\": %.1f", combination.name, (double)allocations / records, (double)sink.bytes / records);
+        result("handler.log_message_legacy", "ns/record", ns / records, extra);
+    }
+}
+
+// Several threads logging while the writer thread drains and syncs: end-to-end cost per record until all are on file
+static void benchWriterThread(size_t records, unsigned producers) {
+    FSLogHandler::Stats stats;
+    FSLogHandler::WriterStats writer;
+    double ns;
+    {
+        FSLogHandler handler("bench", false, LOG_LEVEL_TRACE);
+        handler.configureBuffer(65536).configureBackpressure(FSLogHandler::BACKPRESSURE_BLOCK, 100);
+        handler.enable();
+        handler.startWriterThread();
+
+        auto start = Clock::now();
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < producers; t++) {
+            threads.emplace_back([&]() {
+                LogAttributes attr = attributes(ATTR_TIME);
+                for (size_t i = 0; i < records / producers; i++) {
+                    attr.time = millis();
+                    handler.message(_message, LOG_LEVEL_INFO, "app.gps", attr);
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        handler.stopWriterThread();
+        handler.loop();
+        ns = elapsedNs(start);
+        stats = handler.stats();
+        writer = handler.writerStats();
+    }
+    removeLogs();
+
+    char extra[192];
+    snprintf(extra, sizeof(extra), "\"producers\": %u, \"drops\": %u, \"batches\": %u, \"batch_bytes_max\": %u, "
+            "\"fsyncs\": %u", producers, stats.drops, writer.batches, writer.batch_bytes_max, stats.fsyncs);
+    result("handler.writer_thread", "ns/record", ns / records, extra);
+}
+
+typedef void (*Layout)(FSLogHandler &handler, size_t log_bytes);
+
+static void layoutPlain(FSLogHandler &handler, size_t log_bytes) {
+    (void)handler;
+    (void)log_bytes;
+}
+
+static void layoutBinary(FSLogHandler &handler, size_t log_bytes) {
+    (void)log_bytes;
+    handler.configureFormat(FSLogHandler::FORMAT_BINARY);
+}
+
+static void layoutCompressed(FSLogHandler &handler, size_t log_bytes) {
+    (void)log_bytes;
+    handler.configureCompression().configureWriteBlock(4096);
+}
+
+static void layoutCircular(FSLogHandler &handler, size_t log_bytes) {
+    handler.configureCircular(log_bytes / 2);
+}
+
+static void layoutRotation(FSLogHandler &handler, size_t log_bytes) {
+    handler.configureRotation(log_bytes / 4, 8);
+}
+
+static void layoutJournal(FSLogHandler &handler, size_t log_bytes) {
+    (void)log_bytes;
+    handler.configureJournal();
+}
+
+// dump() of the whole log to a sink that discards it, then the same through an FSLogReader in 4 KiB slices, for each
+// file layout.  Throughput is of the bytes the stream receives.
+static void benchDump(const char *name, Layout layout, size_t log_bytes) {
+    FSLogHandler handler("bench", false, LOG_LEVEL_TRACE);
+    handler.configureBuffer(65536);
+    layout(handler, log_bytes);
+    handler.enable();
+    uint32_t time = 0;
+    while (handler.stats().bytes_written < log_bytes) {
+        logRecords(handler, 640, ATTR_TIME | ATTR_CATEGORY, &time);
+    }
+    handler.loop();
+
+    NullSink dumped;
+    auto start = Clock::now();
+    handler.dump(dumped);
+    double dump_ns = elapsedNs(start);
+
+    NullSink read;
+    FSLogReader reader(handler);
+    uint32_t slices = 0;
+    start = Clock::now();
+    do {
+        reader.read(read, 4096);
+        slices++;
+    } while (!reader.caughtUp());
+    double read_ns = elapsedNs(start);
+
+    char extra[192];
+    snprintf(extra, sizeof(extra), "\"layout\": \"%s\", \"log_bytes\": %llu, \"dumped_bytes\": %llu, \"stream_writes\": %u",
+            name, (unsigned long long)handler.stats().bytes_written, (unsigned long long)dumped.bytes, dumped.writes);
+    result("handler.dump", "MB/s", dumped.bytes / dump_ns * 1000, extra);
+    snprintf(extra, sizeof(extra), "\"layout\": \"%s\", \"read_bytes\": %llu, \"slices\": %u", name,
+            (unsigned long long)read.bytes, slices);
+    result("handler.reader", "MB/s", read.bytes / read_ns * 1000, extra);
+    handler.clearLogs();
+    removeLogs();
+}
+
+// Time range dumps through the index sidecar, against dumping the whole log
+static void benchRangeDump(size_t log_bytes) {
+    const uint32_t step_ms = 10;
+    const unsigned queries = 20;
+    FSLogHandler handler("bench", false, LOG_LEVEL_TRACE);
+    handler.configureBuffer(65536).configureIndex();
+    handler.enable();
+    uint32_t end_ms = 0;
+    while (handler.stats().bytes_written < log_bytes) {
+        logRecords(handler, 640, ATTR_TIME | ATTR_CATEGORY, &end_ms, step_ms);
+    }
+    handler.loop();
+
+    NullSink full;
+    auto start = Clock::now();
+    handler.dump(full);
+    double full_ns = elapsedNs(start);
+
+    NullSink range;
+    uint32_t seed = 1;
+    start = Clock::now();
+    for (unsigned i = 0; i < queries; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t from = (seed >> 8) % (end_ms - 1000);
+        handler.dump(range, from, from + 1000);
+    }
+    double range_ns = elapsedNs(start);
+
+    char extra[192];
+    snprintf(extra, sizeof(extra), "\"log_bytes\": %llu, \"window_ms\": 1000, \"bytes_per_query\": %llu, \"full_dump_ms\": %.3f",
+            (unsigned long long)handler.stats().bytes_written, (unsigned long long)range.bytes / queries, full_ns / 1e6);
+    result("handler.range_dump", "ms/query", range_ns / queries / 1e6, extra);
+    handler.clearLogs();
+    removeLogs();
+}
+
+// configureFsync() byte thresholds on the host filesystem: throughput with loop() called every 8 records, and how many
+// fsync() calls each megabyte costs.  Time based policies are compared on a virtual clock by fslog_sim.
+static void benchFsync(unsigned max_bytes, size_t log_bytes) {
+    FSLogHandler::Stats stats;
+    double ns;
+    {
+        FSLogHandler handler("bench", false, LOG_LEVEL_TRACE);
+        handler.configureBuffer(65536).configureFsync(max_bytes, 1);
+        handler.enable();
+        uint32_t time = 0;
+        auto start = Clock::now();
+        while (handler.stats().bytes_written < log_bytes) {
+            logRecords(handler, 640, ATTR_TIME | ATTR_CATEGORY, &time, 1, 8);
+        }
+        ns = elapsedNs(start);
+        stats = handler.stats();
+    }
+    removeLogs();
+
+    char extra[192];
+    snprintf(extra, sizeof(extra), "\"max_bytes\": %u, \"fsyncs\": %u, \"fsyncs_per_mb\": %.1f, \"writes\": %u, "
+            "\"unsynced_ms_max\": %u", max_bytes, stats.fsyncs, stats.fsyncs * 1048576.0 / stats.bytes_written, stats.writes,
+            stats.unsynced_ms_max);
+    result("handler.fsync_policy", "MB/s", stats.bytes_written / ns * 1000, extra);
+}
+
+// Program and erase counts of littlefs appending to one file, fed with the handler's write() and fsync() calls from
+// configureIoObserver().  This is a model of the littlefs v2 append path, not littlefs itself, which isn't available to
+// the host build: data collects in a 256 byte cache and is programmed as the cache fills, each 4 KB block is erased
+// when it's allocated and starts with its CTZ skip list pointers, and lfs_file_sync() programs the partial cache plus
+// a 256 byte commit to the metadata pair, which is compacted into its other block (one erase) when full.  After a
+// sync leaves the head block partly filled, the next write makes lfs_ctz_extend() copy it into a fresh block.
+class LfsModel {
+public:
+    LfsModel() : programs(0), erases(0), programmed(0), _index(-1), _block_off(0), _meta_off(0), _dirty(false),
+            _synced(false) {}
+
+    void write(size_t len) {
+        if (_synced && _block_off > 0 && _block_off < LFS_BLOCK) {
+            size_t head = _block_off;
+            erase();
+            data(head);
+        }
+        _synced = false;
+        _dirty = _dirty || len > 0;
+        while (len > 0) {
+            if (_index < 0 || _block_off == LFS_BLOCK) {
+                extend();
+            }
+            size_t n = std::min(len, LFS_BLOCK - _block_off);
+            data(n);
+            len -= n;
+        }
+    }
+
+    void sync() {
+        if (!_dirty) {
+            return;
+        }
+        if (_block_off % LFS_CACHE) {
+            program(LFS_CACHE);
+        }
+        program(LFS_CACHE);
+        _meta_off += LFS_CACHE;
+        if (_meta_off >= LFS_BLOCK) {
+            erases++;
+            program(LFS_CACHE);
+            _meta_off = LFS_CACHE;
+        }
+        _dirty = false;
+        _synced = true;
+    }
+
+    uint64_t programs;              // Program operations
+    uint64_t erases;                // Block erases, data and metadata
+    uint64_t programmed;            // Bytes programmed, including padding, skip lists, copies and commits
+
+private:
+    static const size_t LFS_CACHE = 256;
+    static const size_t LFS_BLOCK = 4096;
+
+    void program(size_t len) {
+        programs++;
+        programmed += len;
+    }
+
+    void erase() {
+        erases++;
+        _block_off = 0;
+    }
+
+    // A new block at the end of the file: index n holds ctz(n) + 1 pointers to earlier blocks
+    void extend() {
+        erase();
+        if (++_index > 0) {
+            data(4 * (__builtin_ctz((unsigned)_index) + 1));
+        }
+    }
+
+    void data(size_t len) {
+        size_t units = (_block_off + len) / LFS_CACHE - _block_off / LFS_CACHE;
+        _block_off += len;
+        for (size_t i = 0; i < units; i++) {
+            program(LFS_CACHE);
+        }
+    }
+
+    int _index;                     // CTZ index of the head block, -1 before the first write
+    size_t _block_off;              // Bytes in the head block
+    size_t _meta_off;               // Bytes committed to the active metadata block
+    bool _dirty;                    // Written since the last sync
+    bool _synced;                   // Synced since the last write, so the next one copies a partly filled head block
+};
+
+// configureWriteBlock() sizes at a configureFsync() byte threshold: write() calls per megabyte and throughput on the
+// host filesystem, and what the same calls cost on flash under LfsModel.  A 64 byte block is about one write per
+// record, as before records were coalesced.
+static void benchWriteBlock(size_t block, unsigned max_bytes, size_t log_bytes) {
+    FSLogHandler::Stats stats;
+    LfsModel lfs;
+    double ns;
+    {
+        FSLogHandler handler("bench", false, LOG_LEVEL_TRACE);
+        handler.configureBuffer(65536).configureFsync(max_bytes, 1).configureWriteBlock(block);
+        handler.configureIoObserver([&](const FSLogHandler::IoEvent &event) {
+            if (event.result < 0) {
+                return;
+            }
+            if (event.type == FSLogHandler::IoEvent::WRITE) {
+                lfs.write(event.bytes);
+            } else {
+                lfs.sync();
+            }
+        });
+        handler.enable();
+        uint32_t time = 0;
+        auto start = Clock::now();
+        while (handler.stats().bytes_written < log_bytes) {
+            logRecords(handler, 640, ATTR_TIME | ATTR_CATEGORY, &time);
+        }
+        ns = elapsedNs(start);
+        stats = handler.stats();
+    }
+    removeLogs();
+
+    double mb = stats.bytes_written / 1048576.0;
+    char extra[320];
+    snprintf(extra, sizeof(extra), "\"block_bytes\": %u, \"max_bytes\": %u, \"writes\": %u, \"writes_per_mb\": %.1f, "
+            "\"fsyncs_per_mb\": %.1f, \"lfs_model_programs_per_mb\": %.1f, \"lfs_model_erases_per_mb\": %.1f, "
+            "\"lfs_model_amplification\": %.3f", (unsigned)block, max_bytes, stats.writes, stats.writes / mb,
+            stats.fsyncs / mb, lfs.programs / mb, lfs.erases / mb, (double)lfs.programmed / stats.bytes_written);
+    result("handler.write_block", "MB/s", stats.bytes_written / ns * 1000, extra);
+}
+
+static bool loadCorpus(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+        _corpus.append(buf, n);
+    }
+    fclose(file);
+    return !_corpus.empty();
+}
+
+int main(int argc, char **argv) {
+    size_t scale = 10;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            scale = 1;
+        } else if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+            _corpus_path = argv[++i];
+            if (!loadCorpus(_corpus_path)) {
+                fprintf(stderr, "fslog_bench: can't read %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "usage: fslog_bench [--quick] [--corpus FILE]\n");
+            return 1;
+        }
+    }
+
+    // The handler writes to FS_LOG_HANDLER_DIR relative to the current directory
+    char scratch[] = "/tmp/fslog_bench.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0) {
+        perror("fslog_bench: scratch directory");
+        return 1;
+    }
+
+    printf("{\n  \"tool\": \"fslog_bench\",\n  \"results\": [");
+    benchRingSingle(200000 * scale, 64);
+    benchRingSingle(200000 * scale, 256);
+    benchRingContended(200000 * scale, 1);
+    benchRingContended(200000 * scale, 4);
+    for (size_t block : { 512, 4096 }) {
+        benchCompress("generated", generatedLog(1000000 * scale), block);
+        if (!_corpus.empty()) {
+            benchCompress(_corpus_path, corpusLog(1000000 * scale), block);
+        }
+    }
+    benchCrc(64, 1000000 * scale);
+    benchCrc(1024, 1000000 * scale);
+    benchStorage(1000000 * scale);
+
+    benchLogMessage(20000 * scale);
+    benchLegacyFormat(20000 * scale);
+    benchWriterThread(50000 * scale, 1);
+    benchWriterThread(50000 * scale, 4);
+    benchDump("plain", layoutPlain, 1000000 * scale);
+    benchDump("binary", layoutBinary, 1000000 * scale);
+    benchDump("compressed", layoutCompressed, 1000000 * scale);
+    benchDump("circular", layoutCircular, 1000000 * scale);
+    benchDump("rotation", layoutRotation, 1000000 * scale);
+    benchDump("journal", layoutJournal, 1000000 * scale);
+    benchRangeDump(1000000 * scale);
+    benchRangeDump(4000000 * scale);
+    for (unsigned max_bytes : { 4096u, 32768u }) {
+        benchWriteBlock(64, max_bytes, 1000000 * scale);
+        benchWriteBlock(512, max_bytes, 1000000 * scale);
+        benchWriteBlock(4096, max_bytes, 1000000 * scale);
+    }
+    benchFsync(512, 1000000 * scale);
+    benchFsync(4096, 1000000 * scale);
+    benchFsync(32768, 1000000 * scale);
+    printf("\n  ]\n}\n");
+
+    rmdir(FS_LOG_HANDLER_DIR);
+    if (chdir("/") == 0) {
+        rmdir(scratch);
+    }
+    return 0;
+}
@@ -0,0 +1,565 @@
+// fslog_decode: Host-side decoder for FSLogHandler logfiles
+// Company: Particle
+//
+// Renders binary logfiles (FSLogHandler::FORMAT_BINARY) as the same text FSLogHandler writes in FORMAT_TEXT.
+// Circular logfiles are unwrapped, journals are checked and unframed, and compressed logfiles are decompressed first.  Text logfiles are passed through unchanged.  FSLOG_TOKEN() records are detokenized with the format strings found in
+// the "fslog_tokens" section of the firmware ELF given with --elf.
+//
+// Build:   g++ -std=c++14 -O2 -o fslog_decode tools/fslog_decode.cpp src/FSLogCompress.cpp src/FSLogCrc.cpp
+// Usage:   fslog_decode [--elf firmware.elf] <logfile>      (reads stdin if no file is given)
+
+#include "../src/FSLogCompress.h"
+#include "../src/FSLogCrc.h"
+#include "../src/FSLogFormat.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+struct Callsite {
+    uint8_t flags;
+    std::string file;
+    int32_t line;
+    std::string function;
+};
+
+typedef std::map<uint32_t, std::string> TokenDatabase;
+
+static bool readFile(const char *path, std::vector<uint8_t> *data) {
+    FILE *in = path ? fopen(path, "rb") : stdin;
+    if (!in) {
+        perror(path);
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        data->insert(data->end(), buf, buf + n);
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    return true;
+}
+
+template <typename T>
+static T field(const std::vector<uint8_t> &elf, size_t offset) {
+    T value = 0;
+    if (offset + sizeof(T) <= elf.size()) {
+        memcpy(&value, elf.data() + offset, sizeof(T));     // Little endian host and target
+    }
+    return value;
+}
+
+// Collect the format strings in the token section of a 32 or 64 bit little endian ELF file
+static bool loadTokens(const char *path, TokenDatabase *tokens) {
+    std::vector<uint8_t> elf;
+    if (!readFile(path, &elf)) {
+        return false;
+    }
+    if (elf.size() < 0x34 || memcmp(elf.data(), "\x7f" "ELF", 4) != 0 || elf[5] != 1) {
+        fprintf(stderr, "fslog_decode: %s is not a little endian ELF file\n", path);
+        return false;
+    }
+
+    bool is64 = elf[4] == 2;
+    uint64_t shoff = is64 ? field<uint64_t>(elf, 0x28) : field<uint32_t>(elf, 0x20);
+    uint16_t shentsize = field<uint16_t>(elf, is64 ? 0x3A : 0x2E);
+    uint16_t shnum = field<uint16_t>(elf, is64 ? 0x3C : 0x30);
+    uint16_t shstrndx = field<uint16_t>(elf, is64 ? 0x3E : 0x32);
+
+    auto sectionOffset = [&](uint16_t i) { return is64 ? field<uint64_t>(elf, shoff + i * shentsize + 0x18) : field<uint32_t>(elf, shoff + i * shentsize + 0x10); };
+    auto sectionSize = [&](uint16_t i) { return is64 ? field<uint64_t>(elf, shoff + i * shentsize + 0x20) : field<uint32_t>(elf, shoff + i * shentsize + 0x14); };
+    uint64_t names = sectionOffset(shstrndx);
+
+    for (uint16_t i = 0; i < shnum; i++) {
+        uint64_t name = names + field<uint32_t>(elf, shoff + i * shentsize);
+        if (name >= elf.size() || strcmp((const char *)elf.data() + name, FSLOG_TOKEN_SECTION) != 0) {
+            continue;
+        }
+
+        uint64_t offset = sectionOffset(i);
+        uint64_t size = sectionSize(i);
+        if (offset + size > elf.size()) {
+            break;
+        }
+        // Entries are NUL terminated strings, possibly with alignment padding in between
+        const char *p = (const char *)elf.data() + offset;
+        const char *end = p + size;
+        while (p < end) {
+            size_t len = strnlen(p, end - p);
+            if (len) {
+                (*tokens)[fslogHash(p, len)] = std::string(p, len);
+            }
+            p += len + 1;
+        }
+        return true;
+    }
+
+    fprintf(stderr, "fslog_decode: no %s section in %s\n", FSLOG_TOKEN_SECTION, path);
+    return false;
+}
+
+// Rebuild the text of a tokenized record.  Arguments are consumed in the order of the conversions in the format string.
+static bool detokenize(const std::string &fmt, const uint8_t *p, const uint8_t *end, std::string *out) {
+    char buf[256];
+
+    for (size_t i = 0; i < fmt.size(); i++) {
+        if (fmt[i] != '%') {
+            *out += fmt[i];
+            continue;
+        }
+        if (i + 1 < fmt.size() && fmt[i + 1] == '%') {
+            *out += '%';
+            i++;
+            continue;
+        }
+
+        // Copy flags, width and precision, drop length modifiers since arguments are widened when packed
+        std::string spec = "%";
+        bool long_long = false;
+        size_t j = i + 1;
+        for (; j < fmt.size() && strchr("-+ #0123456789.*", fmt[j]); j++) {
+            if (fmt[j] == '*') {
+                uint64_t width;
+                if (!(p = fslogGetVarint64(p, end, &width))) {
+                    return false;
+                }
+                spec += std::to_string(fslogUnzigzag64(width));
+            } else {
+                spec += fmt[j];
+            }
+        }
+        for (; j < fmt.size() && strchr("hlLqjzt", fmt[j]); j++) {
+            // Only 64 bit modifiers matter, plain long is 32 bits on the device
+            if (fmt[j] == 'j' || fmt[j] == 'q' || (fmt[j] == 'l' && j + 1 < fmt.size() && fmt[j + 1] == 'l')) {
+                long_long = true;
+            }
+        }
+        if (j >= fmt.size()) {
+            *out += fmt.substr(i);
+            break;
+        }
+        char conv = fmt[j];
+        i = j;
+
+        if (strchr("diouxXcp", conv)) {
+            uint64_t raw;
+            if (!(p = fslogGetVarint64(p, end, &raw))) {
+                return false;
+            }
+            int64_t value = fslogUnzigzag64(raw);
+            if (conv == 'p') {
+                snprintf(buf, sizeof(buf), "0x%x", (unsigned)(uint32_t)value);
+            } else if (conv == 'c') {
+                snprintf(buf, sizeof(buf), (spec + "c").c_str(), (int)value);
+            } else if (conv == 'd' || conv == 'i') {
+                snprintf(buf, sizeof(buf), (spec + "lld").c_str(), (long long)(long_long ? value : (int32_t)value));
+            } else {
+                // The device is 32 bit, so unsigned conversions of negative ints wrap at 32 bits
+                unsigned long long u = long_long ? (unsigned long long)value : (unsigned long long)(uint32_t)value;
+                snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(), u);
+            }
+        } else if (strchr("fFeEgGaA", conv)) {
+            float f;
+            if (end - p < (long)sizeof(f)) {
+                return false;
+            }
+            memcpy(&f, p, sizeof(f));
+            p += sizeof(f);
+            snprintf(buf, sizeof(buf), (spec + conv).c_str(), (double)f);
+        } else if (conv == 's') {
+            uint32_t len;
+            if (!(p = fslogGetVarint(p, end, &len)) || (uint32_t)(end - p) < len) {
+                return false;
+            }
+            std::string str((const char *)p, len);
+            p += len;
+            snprintf(buf, sizeof(buf), (spec + "s").c_str(), str.c_str());
+        } else {
+            snprintf(buf, sizeof(buf), "%%%c", conv);
+        }
+        *out += buf;
+    }
+    return true;
+}
+
+// Put the valid part of a circular logfile back in logical order
+static bool unwrapCircular(const std::vector<uint8_t> &data, std::vector<uint8_t> *out) {
+    uint32_t capacity;
+    uint64_t written;
+    memcpy(&capacity, data.data() + 8, sizeof(capacity));
+    memcpy(&written, data.data() + 16, sizeof(written));
+    if (!capacity || data.size() < FSLOG_CIRC_DATA_OFFSET + (size_t)capacity) {
+        fprintf(stderr, "fslog_decode: circular logfile is truncated\n");
+        return false;
+    }
+
+    const uint8_t *region = data.data() + FSLOG_CIRC_DATA_OFFSET;
+    uint64_t oldest = written > capacity ? written - capacity : 0;
+    for (uint64_t pos = oldest; pos < written; pos++) {
+        out->push_back(region[pos % capacity]);
+    }
+    return true;
+}
+
+// Concatenate the decompressed frames of a compressed logfile.  A torn frame at the end is ignored.
+static bool inflateFrames(const std::vector<uint8_t> &data, std::vector<uint8_t> *out) {
+    std::vector<uint8_t> raw(FSLOG_LZ_MAX_INPUT);
+    size_t pos = FSLOG_Z_HEADER_SIZE;
+
+    while (pos + FSLOG_Z_FRAME_HEADER_SIZE <= data.size()) {
+        const uint8_t *h = data.data() + pos;
+        size_t raw_len = h[2] | (h[3] << 8);
+        size_t zlen = h[4] | (h[5] << 8);
+        if (h[0] != FSLOG_Z_FRAME_MAGIC) {
+            fprintf(stderr, "fslog_decode: bad frame at offset %zu\n", pos);
+            return false;
+        }
+        if (pos + FSLOG_Z_FRAME_HEADER_SIZE + zlen > data.size()) {
+            fprintf(stderr, "fslog_decode: ignoring torn frame at offset %zu\n", pos);
+            break;
+        }
+
+        const uint8_t *z = h + FSLOG_Z_FRAME_HEADER_SIZE;
+        if (h[1] == FSLOG_Z_LZ4) {
+            if (fslogDecompress(z, zlen, raw.data(), raw_len) != (int)raw_len) {
+                fprintf(stderr, "fslog_decode: corrupt frame at offset %zu\n", pos);
+                return false;
+            }
+            out->insert(out->end(), raw.begin(), raw.begin() + raw_len);
+        } else {
+            out->insert(out->end(), z, z + zlen);
+        }
+        pos += FSLOG_Z_FRAME_HEADER_SIZE + zlen;
+    }
+    return true;
+}
+
+// Split a journal into sessions of concatenated payloads.  A payload holding a binary header starts a new session, since
+// the interning tables restart with it.  Decoding stops at the first torn or corrupt record, like the recovery scan on
+// the device.
+static void unwrapJournal(const std::vector<uint8_t> &data, std::vector<std::vector<uint8_t>> *sessions) {
+    size_t pos = FSLOG_J_HEADER_SIZE;
+    sessions->resize(1);
+
+    while (pos < data.size()) {
+        const uint8_t *h = data.data() + pos;
+        const uint8_t *end = data.data() + data.size();
+        if ((size_t)(end - h) >= FSLOG_J_SYNC_SIZE && memcmp(h, FSLOG_J_SYNC_MAGIC, FSLOG_J_SYNC_SIZE) == 0) {
+            pos += FSLOG_J_SYNC_SIZE;
+            continue;
+        }
+
+        uint32_t len, crc;
+        const uint8_t *p = end - h > 5 && h[0] == FSLOG_J_RECORD ? fslogGetVarint(h + 5, end, &len) : nullptr;
+        if (!p || (size_t)(end - p) < len) {
+            break;
+        }
+        memcpy(&crc, h + 1, sizeof(crc));
+        if (fslogCrc32(p, len, fslogCrc32(h + 5, p - (h + 5))) != crc) {
+            break;
+        }
+
+        if (len == FSLOG_BIN_HEADER_SIZE && memcmp(p, FSLOG_BIN_MAGIC, 4) == 0 && !sessions->back().empty()) {
+            sessions->emplace_back();
+        }
+        sessions->back().insert(sessions->back().end(), p, p + len);
+        pos = (p - data.data()) + len;
+    }
+
+    if (pos < data.size()) {
+        fprintf(stderr, "fslog_decode: ignoring %zu torn or corrupt bytes at offset %zu\n", data.size() - pos, pos);
+    }
+}
+
+class Decoder {
+public:
+    Decoder(const uint8_t *data, size_t len, const TokenDatabase &tokens) :
+            _begin(data), _p(data), _end(data + len), _last_time(0), _tokens(tokens) {}
+
+    bool run(FILE *out);
+
+private:
+    bool varint(uint32_t *value) {
+        const uint8_t *p = fslogGetVarint(_p, _end, value);
+        if (!p) {
+            return false;
+        }
+        _p = p;
+        return true;
+    }
+
+    bool byte(uint8_t *value) {
+        if (_p >= _end) {
+            return false;
+        }
+        *value = *_p++;
+        return true;
+    }
+
+    bool string(std::string *value) {
+        uint32_t len;
+        if (!varint(&len) || (size_t)(_end - _p) < len) {
+            return false;
+        }
+        value->assign((const char *)_p, len);
+        _p += len;
+        return true;
+    }
+
+    bool callsite(Callsite *cs) {
+        uint32_t line;
+        if (!byte(&cs->flags) || !string(&cs->file) || !varint(&line) || !string(&cs->function)) {
+            return false;
+        }
+        cs->line = fslogUnzigzag(line);
+        return true;
+    }
+
+    bool record(uint8_t tag, FILE *out);
+    bool tokenRecord(FILE *out);
+
+    const uint8_t *_begin;
+    const uint8_t *_p;
+    const uint8_t *_end;
+    uint32_t _last_time;
+    std::map<uint32_t, std::string> _categories;
+    std::map<uint32_t, Callsite> _callsites;
+    const TokenDatabase &_tokens;
+};
+
+static const char *levelName(int level) {
+    switch (level) {
+        case 1:  return "TRACE";
+        case 30: return "INFO";
+        case 40: return "WARN";
+        case 50: return "ERROR";
+        case 60: return "PANIC";
+        default: return "";
+    }
+}
+
+bool Decoder::run(FILE *out) {
+    while (_p < _end) {
+        const uint8_t *start = _p;
+        uint8_t tag = *_p++;
+        bool ok;
+
+        if (tag == FSLOG_BIN_DEF_CATEGORY) {
+            uint32_t id;
+            ok = varint(&id) && string(&_categories[id]);
+        } else if (tag == FSLOG_BIN_DEF_CALLSITE) {
+            uint32_t id;
+            ok = varint(&id) && callsite(&_callsites[id]);
+        } else if (tag == FSLOG_BIN_TOKEN) {
+            ok = tokenRecord(out);
+        } else if ((tag & FSLOG_BIN_LEVEL_MASK) != FSLOG_BIN_LEVEL_DEF) {
+            ok = record(tag, out);
+        } else {
+            fprintf(stderr, "fslog_decode: unknown record tag 0x%02x at offset %ld\n", tag, (long)(start - _begin));
+            return false;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "fslog_decode: truncated record at offset %ld\n", (long)(start - _begin));
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Decoder::record(uint8_t tag, FILE *out) {
+    std::string line;
+    char num[16];
+
+    if (tag & FSLOG_BIN_HAS_TIME) {
+        uint32_t delta;
+        if (!varint(&delta)) {
+            return false;
+        }
+        _last_time += (uint32_t)fslogUnzigzag(delta);
+        snprintf(num, sizeof(num), "%010u ", (unsigned)_last_time);
+        line += num;
+    }
+
+    if (tag & FSLOG_BIN_HAS_CATEGORY) {
+        uint32_t id;
+        std::string inline_name;
+        if (!varint(&id) || (!id && !string(&inline_name))) {
+            return false;
+        }
+        line += "[" + (id ? _categories[id] : inline_name) + "] ";
+    }
+
+    if (tag & FSLOG_BIN_HAS_CALLSITE) {
+        uint32_t id;
+        Callsite inline_cs;
+        if (!varint(&id) || (!id && !callsite(&inline_cs))) {
+            return false;
+        }
+        const Callsite &cs = id ? _callsites[id] : inline_cs;
+        if (cs.flags & FSLOG_BIN_CALLSITE_FILE) {
+            line += cs.file;
+            if (cs.flags & FSLOG_BIN_CALLSITE_LINE) {
+                snprintf(num, sizeof(num), ":%d", (int)cs.line);
+                line += num;
+            }
+            line += (cs.flags & FSLOG_BIN_CALLSITE_FUNCTION) ? ", " : ": ";
+        }
+        if (cs.flags & FSLOG_BIN_CALLSITE_FUNCTION) {
+            line += cs.function + "(): ";
+        }
+    }
+
+    uint8_t attr_flags = 0;
+    uint32_t code = 0;
+    std::string details;
+    if (tag & FSLOG_BIN_HAS_ATTRS) {
+        if (!byte(&attr_flags)) {
+            return false;
+        }
+        if ((attr_flags & FSLOG_BIN_ATTR_CODE) && !varint(&code)) {
+            return false;
+        }
+        if ((attr_flags & FSLOG_BIN_ATTR_DETAILS) && !string(&details)) {
+            return false;
+        }
+    }
+
+    std::string msg;
+    if (!string(&msg)) {
+        return false;
+    }
+
+    line += levelName(fslogNibbleToLevel(tag & FSLOG_BIN_LEVEL_MASK));
+    line += ": ";
+    line += msg;
+
+    if (attr_flags) {
+        line += " [";
+        if (attr_flags & FSLOG_BIN_ATTR_CODE) {
+            // Device pointers are 32 bits wide
+            snprintf(num, sizeof(num), "0x%x", (unsigned)(uint32_t)fslogUnzigzag(code));
+            line += "code = ";
+            line += num;
+        }
+        if (attr_flags & FSLOG_BIN_ATTR_DETAILS) {
+            if (attr_flags & FSLOG_BIN_ATTR_CODE) {
+                line += ", ";
+            }
+            line += "details = " + details;
+        }
+        line += "]";
+    }
+
+    line += "\n\r";
+    fwrite(line.data(), 1, line.size(), out);
+    return true;
+}
+
+bool Decoder::tokenRecord(FILE *out) {
+    uint8_t flags;
+    uint32_t delta, token;
+    std::string line, category, args;
+    char num[16];
+
+    if (!byte(&flags)) {
+        return false;
+    }
+    if (flags & FSLOG_BIN_HAS_TIME) {
+        if (!varint(&delta)) {
+            return false;
+        }
+        _last_time += (uint32_t)fslogUnzigzag(delta);
+        snprintf(num, sizeof(num), "%010u ", (unsigned)_last_time);
+        line += num;
+    }
+    if (flags & FSLOG_BIN_HAS_CATEGORY) {
+        uint32_t id;
+        if (!varint(&id) || (!id && !string(&category))) {
+            return false;
+        }
+        line += "[" + (id ? _categories[id] : category) + "] ";
+    }
+    if (!varint(&token) || !string(&args)) {
+        return false;
+    }
+
+    line += levelName(fslogNibbleToLevel(flags & FSLOG_BIN_LEVEL_MASK));
+    line += ": ";
+    auto it = _tokens.find(token);
+    const uint8_t *p = (const uint8_t *)args.data();
+    if (it == _tokens.end() || !detokenize(it->second, p, p + args.size(), &line)) {
+        snprintf(num, sizeof(num), "$%08x", (unsigned)token);
+        line += num;
+        line += " (unknown token)";
+    }
+    line += "\n\r";
+    fwrite(line.data(), 1, line.size(), out);
+    return true;
+}
+
+static int decode(const std::vector<uint8_t> &data, const TokenDatabase &tokens) {
+    // Text logs need no decoding
+    if (data.size() < FSLOG_BIN_HEADER_SIZE || memcmp(data.data(), FSLOG_BIN_MAGIC, 4) != 0) {
+        fwrite(data.data(), 1, data.size(), stdout);
+        return 0;
+    }
+    if (data[4] != FSLOG_BIN_VERSION) {
+        fprintf(stderr, "fslog_decode: unsupported format version %u\n", data[4]);
+        return 1;
+    }
+
+    Decoder decoder(data.data() + FSLOG_BIN_HEADER_SIZE, data.size() - FSLOG_BIN_HEADER_SIZE, tokens);
+    return decoder.run(stdout) ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    const char *path = nullptr;
+    TokenDatabase tokens;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--elf") == 0 && i + 1 < argc) {
+            if (!loadTokens(argv[++i], &tokens)) {
+                return 1;
+            }
+        } else {
+            path = argv[i];
+        }
+    }
+
+    std::vector<uint8_t> data;
+    if (!readFile(path, &data)) {
+        return 1;
+    }
+
+    if (data.size() >= FSLOG_CIRC_DATA_OFFSET && memcmp(data.data(), FSLOG_CIRC_MAGIC, 4) == 0) {
+        std::vector<uint8_t> raw;
+        if (!unwrapCircular(data, &raw)) {
+            return 1;
+        }
+        data.swap(raw);
+    }
+
+    if (data.size() >= FSLOG_Z_HEADER_SIZE && memcmp(data.data(), FSLOG_Z_MAGIC, 4) == 0) {
+        std::vector<uint8_t> raw;
+        if (!inflateFrames(data, &raw)) {
+            return 1;
+        }
+        data.swap(raw);
+    }
+
+    if (data.size() >= FSLOG_J_HEADER_SIZE && memcmp(data.data(), FSLOG_J_MAGIC, 4) == 0) {
+        std::vector<std::vector<uint8_t>> sessions;
+        unwrapJournal(data, &sessions);
+        int result = 0;
+        for (const std::vector<uint8_t> &session : sessions) {
+            result |= decode(session, tokens);
+        }
+        return result;
+    }
+
+    return decode(data, tokens);
+}
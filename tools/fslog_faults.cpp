@@ -0,0 +1,452 @@
+// fslog_faults: FSLogHandler recovery from filesystem faults and power cuts
+// Company: Particle
+//
+// Runs FSLogHandler from loop() on the virtual clock of tools/host, logging to the host filesystem through
+// tools/host/HostFaults, which makes write(), fsync() and close() fail on demand.  Each scenario logs a steady load of
+// tagged records, injects one kind of fault for a while, lifts it, and then reads the log back to see which records
+// made it:
+//
+//   enospc_rotation    A disk quota below what configureRotation() keeps, so writes fail with ENOSPC until the oldest
+//                      generation is evicted
+//   enospc_transient   The filesystem full for 30 s, then space freed
+//   enospc_plain       The filesystem full for good without configureRotation(), so nothing can be evicted and writes
+//                      stay held while records are dropped
+//   eio_transient      Every write and fsync() failing with EIO for 30 s
+//   eio_stale          The logfile's descriptor failing with EIO until it is reopened
+//   torn_writes        Writes cut short part way, then failing with EIO, for 30 s
+//   slow_fsync         fsync() taking 500 ms for 60 s under a heavier load
+//
+// For each it reports the handler's faultStats(), the time from the fault being lifted to the first complete write,
+// and the records lost: dropped from the RAM buffers, missing from the log, or written twice.  Records lost to
+// eviction are counted apart, being the point of it.  drops is getDropCount(), every record dropped under
+// backpressure; records_lost is faultStats().records_lost, those dropped while a write fault or a run of fsync() stalls
+// lasted; drops_outside_faults is the difference, which should stay zero.
+//
+// The power cut scenarios run a configureJournal() logfile and cut the power after a random number of bytes, tearing
+// the write in progress ("kill"), or also dropping a random part of what was written since the last fsync() ("truncate").
+// The journal is then reopened, and across all trials they report the recovery time, the bytes scanned and discarded to
+// find the end of the valid data, the bytes and records lost, and two things that must stay zero: synced bytes lost,
+// and trials whose recovered records aren't an intact prefix of what was logged.
+//
+// Build:   make -C tools
+// Usage:   fslog_faults [--trials N] [--seed N] > results.json
+
+#include "../src/FSLogHandler.h"
+#include "host/HostFaults.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define FAULTS_TICK_MS      10      // Application loop() period
+#define FAULTS_WARMUP_S     30      // Load before the fault
+#define FAULTS_AFTER_S      60      // Load after the fault is lifted, longer than FS_LOG_HANDLER_RETRY_MAX_MS
+#define FAULTS_DRAIN_S      20      // Idle time at the end
+#define FAULTS_CUT_S        20      // Length of a power cut session
+#define FAULTS_LOG          FS_LOG_HANDLER_DIR "/faults.log"
+
+static bool _first_result = true;
+
+// Deterministic random numbers, the same on every host
+static uint64_t _seed = 1;
+
+static uint32_t nextRandom() {
+    _seed = _seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)(_seed >> 33);
+}
+
+static void removeLogs() {
+    DIR *dir = opendir(FS_LOG_HANDLER_DIR);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_name[0] != '.') {
+            unlink((std::string(FS_LOG_HANDLER_DIR "/") + entry->d_name).c_str());
+        }
+    }
+    closedir(dir);
+}
+
+static long fileSize(const char *path) {
+    struct stat statbuf;
+    return stat(path, &statbuf) == 0 ? (long)statbuf.st_size : 0;
+}
+
+/**
+ * @brief Logs tagged records ("#<id>;") on a fixed schedule, so that a dump shows which of them the log holds
+ */
+class Load {
+public:
+    Load(FSLogHandler &handler, double per_second) : logged(0), _handler(handler), _per_second(per_second),
+            _start(millis()) {}
+
+    /**
+     * @brief Log one tick's worth of records at tick t, then run loop() unless an earlier loop() overran into this
+     * tick.  Records due while loop() was stuck in I/O pile up in the RAM buffers, as they would from other threads.
+     */
+    void tick(uint32_t t, bool log = true) {
+        uint32_t now = millis() - _start;
+        bool behind = now > t;
+        if (!behind) {
+            hostClockAdvance((uint64_t)(t - now) * 1000);
+        }
+        if (log) {
+            double expected = _per_second * FAULTS_TICK_MS / 1000;
+            uint32_t n = (uint32_t)expected;
+            n += (nextRandom() % 1000000) / 1000000.0 < expected - n ? 1 : 0;
+            LogAttributes attr = {};
+            attr.size = sizeof(attr);
+            attr.has_time = 1;
+            char msg[96];
+            for (; n; n--) {
+                attr.time = millis();
+                snprintf(msg, sizeof(msg), "sensor=%u value=%u.%02u state=ok #%u;", nextRandom() % 64,
+                        nextRandom() % 1000, nextRandom() % 100, logged++);
+                _handler.message(msg, LOG_LEVEL_INFO, "app", attr);
+            }
+        }
+        if (!behind) {
+            _handler.loop();
+        }
+    }
+
+    uint32_t logged;                // Records logged, also the next id
+
+private:
+    FSLogHandler &_handler;
+    double _per_second;
+    uint32_t _start;                // Clock time of tick 0
+};
+
+/**
+ * @brief Collects the record tags of a dump
+ */
+class TagCounter : public Print {
+public:
+    explicit TagCounter(uint32_t logged) : seen(logged, 0), duplicates(0) {}
+
+    size_t write(uint8_t c) override {
+        if (c == '#') {
+            _in_tag = true;
+            _tag.clear();
+        } else if (_in_tag && c >= '0' && c <= '9') {
+            _tag += (char)c;
+        } else if (_in_tag) {
+            uint32_t id = (uint32_t)strtoul(_tag.c_str(), nullptr, 10);
+            if (c == ';' && !_tag.empty() && id < seen.size()) {
+                duplicates += seen[id] ? 1 : 0;
+                seen[id] = 1;
+            }
+            _in_tag = false;
+        }
+        return 1;
+    }
+
+    std::vector<uint8_t> seen;      // Per id, whether the dump had it
+    uint32_t duplicates;            // Records seen more than once
+
+private:
+    std::string _tag;
+    bool _in_tag = false;
+};
+
+struct Scenario {
+    const char *name;
+    void (*configure)(FSLogHandler &handler);
+    void (*inject)();               // Start the fault
+    void (*lift)();                 // End it, nullptr if it lasts to the end of the run
+    uint32_t fault_s;               // How long the fault lasts
+    double per_second;              // Records logged per second
+};
+
+static void configurePlain(FSLogHandler &handler) {
+    (void)handler;
+}
+
+static void configureRotation(FSLogHandler &handler) {
+    handler.configureRotation(16384, 8);
+}
+
+static void injectQuota() {
+    hostFaultQuota(".", 49152);     // Room for three of the eight generations
+}
+
+static void injectFull() {
+    hostFaultQuota(".", 1);
+}
+
+static void injectEio() {
+    hostFaultError(EIO);
+}
+
+static void injectStale() {
+    hostFaultStale();
+}
+
+static void injectTorn() {
+    hostFaultTornWrites();
+}
+
+static void injectSlowFsync() {
+    hostFaultSlowFsync(500);
+}
+
+static const Scenario _scenarios[] = {
+    { "enospc_rotation", configureRotation, injectQuota, nullptr, 0, 50 },
+    { "enospc_transient", configurePlain, injectFull, hostFaultClear, 30, 50 },
+    { "enospc_plain", configurePlain, injectFull, nullptr, 0, 50 },
+    { "eio_transient", configurePlain, injectEio, hostFaultClear, 30, 50 },
+    { "eio_stale", configurePlain, injectStale, nullptr, 0, 50 },
+    { "torn_writes", configurePlain, injectTorn, hostFaultClear, 30, 50 },
+    { "slow_fsync", configurePlain, injectSlowFsync, hostFaultClear, 60, 200 },
+};
+
+static void runScenario(const Scenario &scenario, uint64_t seed) {
+    removeLogs();
+    hostFaultClear();
+    hostClockSet(1000000);
+    _seed = seed;
+
+    uint32_t lifted_ms = 0;         // Clock time the fault was lifted, 0 while it lasts
+    uint32_t resumed_ms = 0;        // Clock time of the first complete write after that
+    uint32_t logged;
+    uint32_t drops;
+    FSLogHandler::FaultStats faults;
+    FSLogHandler::Stats stats;
+    {
+        FSLogHandler handler("faults", false, LOG_LEVEL_TRACE);
+        scenario.configure(handler);
+        handler.configureIoObserver([&](const FSLogHandler::IoEvent &event) {
+            if (event.type == FSLogHandler::IoEvent::WRITE && lifted_ms && !resumed_ms &&
+                    event.result == (int)event.bytes) {
+                resumed_ms = event.time_ms;
+            }
+        });
+        handler.enable();
+
+        Load load(handler, scenario.per_second);
+        uint32_t fault_ms = FAULTS_WARMUP_S * 1000;
+        uint32_t lift_ms = fault_ms + scenario.fault_s * 1000;
+        uint32_t load_ms = lift_ms + FAULTS_AFTER_S * 1000;
+        uint32_t end_ms = load_ms + FAULTS_DRAIN_S * 1000;
+        for (uint32_t t = 0; t < end_ms; t += FAULTS_TICK_MS) {
+            if (t == fault_ms) {
+                scenario.inject();
+            }
+            if (t == lift_ms && scenario.lift) {
+                scenario.lift();
+                lifted_ms = millis();
+            }
+            load.tick(t, t < load_ms);
+        }
+        logged = load.logged;
+        drops = handler.getDropCount();
+        faults = handler.faultStats();
+        stats = handler.stats();
+    }
+    hostFaultClear();
+
+    // Read the log back with the fault gone
+    TagCounter tags(logged);
+    {
+        FSLogHandler handler("faults", false, LOG_LEVEL_TRACE);
+        scenario.configure(handler);
+        handler.dump(tags);
+    }
+    uint32_t evicted = 0;
+    uint32_t missing = 0;
+    bool found = false;
+    for (uint32_t id = 0; id < logged; id++) {
+        found = found || tags.seen[id];
+        if (!tags.seen[id]) {
+            if (found || !faults.evictions) {
+                missing++;
+            } else {
+                evicted++;      // Older than anything left, so in a deleted generation
+            }
+        }
+    }
+
+    char resume[16] = "null";
+    if (lifted_ms && resumed_ms) {
+        snprintf(resume, sizeof(resume), "%u", resumed_ms - lifted_ms);
+    }
+    printf("%s\n    {\"name\": \"faults.%s\", \"fault_s\": %u, \"records\": %u, \"drops\": %u, \"missing\": %u, "
+            "\"duplicated\": %u, \"evicted\": %u, \"failures\": %u, \"short_writes\": %u, \"retries\": %u, "
+            "\"reopens\": %u, \"evictions\": %u, \"faults\": %u, \"fsync_stalls\": %u, \"records_lost\": %u, "
+            "\"drops_outside_faults\": %d, \"bytes_lost\": %u, \"recovery_ms_max\": %u, \"resume_ms\": %s, "
+            "\"unsynced_ms_max\": %u}",
+            _first_result ? "" : ",", scenario.name, scenario.fault_s, logged, drops, missing, tags.duplicates, evicted,
+            faults.failures, faults.short_writes, faults.retries, faults.reopens, faults.evictions, faults.faults,
+            faults.fsync_stalls, faults.records_lost, (int)(drops - faults.records_lost), faults.bytes_lost,
+            faults.recovery_ms_max, resume, stats.unsynced_ms_max);
+    _first_result = false;
+}
+
+struct CutTrial {
+    uint32_t recover_us;
+    uint32_t bytes_scanned;
+    uint32_t bytes_discarded;
+    uint32_t bytes_lost;            // Written before the cut but not recovered
+    uint32_t records_lost;          // Logged but not recovered, including those still in RAM at the cut
+    long file_bytes;                // Logfile size at the cut
+    bool synced_lost;               // Recovery lost bytes that an fsync() had returned for
+    bool corrupt;                   // Recovered records aren't an intact prefix of those logged
+};
+
+// One session cut after cut_bytes, or run to the end if 0, then a reboot that recovers the journal
+static CutTrial cutTrial(uint64_t cut_bytes, bool truncate) {
+    CutTrial trial = {};
+    removeLogs();
+    hostFaultClear();
+    hostClockSet(1000000);
+
+    long synced = 0;
+    uint32_t logged;
+    {
+        FSLogHandler handler("faults", false, LOG_LEVEL_TRACE);
+        handler.configureJournal();
+        handler.configureIoObserver([&](const FSLogHandler::IoEvent &event) {
+            if (event.type == FSLogHandler::IoEvent::FSYNC && event.result == 0) {
+                synced = fileSize(FAULTS_LOG);
+            }
+        });
+        handler.enable();
+        if (cut_bytes) {
+            hostFaultPowerCut(cut_bytes);
+        }
+        Load load(handler, 50);
+        for (uint32_t t = 0; t < FAULTS_CUT_S * 1000 && !hostFaultPowerIsCut(); t += FAULTS_TICK_MS) {
+            load.tick(t);
+        }
+        logged = load.logged;
+    }   // With the power cut, nothing the destructor writes reaches the file
+    trial.file_bytes = fileSize(FAULTS_LOG);
+    if (truncate && trial.file_bytes > synced) {
+        // The filesystem kept only part of what was written since the last sync
+        if (::truncate(FAULTS_LOG, synced + nextRandom() % (trial.file_bytes - synced + 1)) != 0) {
+            perror("fslog_faults: truncate");
+        }
+    }
+    long before = fileSize(FAULTS_LOG);
+    hostFaultClear();
+
+    // Reboot.  Recovery is timed on the host clock.
+    TagCounter tags(logged);
+    hostClockVirtual(false);
+    {
+        FSLogHandler handler("faults", false, LOG_LEVEL_TRACE);
+        handler.configureJournal();
+        handler.enable();
+        LogAttributes attr = {};
+        attr.size = sizeof(attr);
+        handler.message("boot", LOG_LEVEL_INFO, "app", attr);
+        handler.loop();     // Opens the journal
+        FSLogHandler::JournalRecovery recovery = handler.journalRecovery();
+        trial.recover_us = recovery.recover_us;
+        trial.bytes_scanned = recovery.bytes_scanned;
+        trial.bytes_discarded = recovery.bytes_discarded;
+        handler.dump(tags);
+    }
+    hostClockVirtual(true);
+
+    long end = before - (long)trial.bytes_discarded;
+    trial.bytes_lost = (uint32_t)(trial.file_bytes - end);
+    trial.synced_lost = end < synced;
+    uint32_t recovered = 0;
+    for (uint32_t id = 0; id < logged; id++) {
+        if (tags.seen[id]) {
+            trial.corrupt = trial.corrupt || recovered != id;
+            recovered++;
+        }
+    }
+    trial.corrupt = trial.corrupt || tags.duplicates;
+    trial.records_lost = logged - recovered;
+    return trial;
+}
+
+static void powerCut(bool truncate, uint32_t trials, uint64_t seed) {
+    _seed = seed;
+    long session_bytes = cutTrial(0, false).file_bytes;   // What an uncut session writes
+    std::vector<CutTrial> results;
+    for (uint32_t i = 0; i < trials; i++) {
+        _seed = seed + i + 1;
+        uint64_t cut = 1 + nextRandom() % (uint64_t)session_bytes;
+        results.push_back(cutTrial(cut, truncate));
+    }
+
+    uint64_t recover_us = 0, scanned = 0, discarded = 0, bytes_lost = 0, records_lost = 0;
+    uint32_t recover_us_max = 0, scanned_max = 0, bytes_lost_max = 0, records_lost_max = 0;
+    uint32_t synced_lost = 0, corrupt = 0;
+    long file_bytes_max = 0;
+    for (const CutTrial &trial : results) {
+        recover_us += trial.recover_us;
+        scanned += trial.bytes_scanned;
+        discarded += trial.bytes_discarded;
+        bytes_lost += trial.bytes_lost;
+        records_lost += trial.records_lost;
+        recover_us_max = std::max(recover_us_max, trial.recover_us);
+        scanned_max = std::max(scanned_max, trial.bytes_scanned);
+        bytes_lost_max = std::max(bytes_lost_max, trial.bytes_lost);
+        records_lost_max = std::max(records_lost_max, trial.records_lost);
+        file_bytes_max = std::max(file_bytes_max, trial.file_bytes);
+        synced_lost += trial.synced_lost;
+        corrupt += trial.corrupt;
+    }
+    double n = results.empty() ? 1 : (double)results.size();
+    printf("%s\n    {\"name\": \"faults.power_cut.%s\", \"trials\": %u, \"file_bytes_max\": %ld, "
+            "\"recover_us_mean\": %.1f, \"recover_us_max\": %u, \"bytes_scanned_mean\": %.1f, \"bytes_scanned_max\": %u, "
+            "\"bytes_discarded_mean\": %.1f, \"bytes_lost_mean\": %.1f, \"bytes_lost_max\": %u, "
+            "\"records_lost_mean\": %.2f, \"records_lost_max\": %u, \"synced_lost\": %u, \"corrupt\": %u}",
+            _first_result ? "" : ",", truncate ? "truncate" : "kill", trials, file_bytes_max, recover_us / n,
+            recover_us_max, scanned / n, scanned_max, discarded / n, bytes_lost / n, bytes_lost_max, records_lost / n,
+            records_lost_max, synced_lost, corrupt);
+    _first_result = false;
+}
+
+int main(int argc, char **argv) {
+    uint32_t trials = 200;
+    uint64_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trials") == 0 && i + 1 < argc) {
+            trials = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "usage: fslog_faults [--trials N] [--seed N]\n");
+            return 1;
+        }
+    }
+
+    // The handler writes to FS_LOG_HANDLER_DIR relative to the current directory
+    char scratch[] = "/tmp/fslog_faults.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0 || mkdir(FS_LOG_HANDLER_DIR, 0755) != 0) {
+        perror("fslog_faults: scratch directory");
+        return 1;
+    }
+
+    hostClockVirtual(true);
+    printf("{\n  \"tool\": \"fslog_faults\",\n  \"seed\": %llu,\n  \"results\": [", (unsigned long long)seed);
+    for (const Scenario &scenario : _scenarios) {
+        runScenario(scenario, seed);
+    }
+    powerCut(false, trials, seed);
+    powerCut(true, trials, seed);
+    printf("\n  ]\n}\n");
+
+    hostFaultClear();
+    removeLogs();
+    rmdir(FS_LOG_HANDLER_DIR);
+    if (chdir("/") == 0) {
+        rmdir(scratch);
+    }
+    return 0;
+}
@@ -0,0 +1,334 @@
+// fslog_sim: Deterministic replay of FSLogHandler sync policies on a virtual clock
+// Company: Particle
+//
+// Runs FSLogHandler from loop() on the virtual clock of tools/host against SimStorage, an in-memory FSLogStorage whose
+// appends and syncs take simulated flash time, so hours of synthetic load replay in seconds and every run with the same
+// seed gives the same numbers.  The load is a steady mix of TRACE, INFO, WARN and ERROR records with a TRACE flood every
+// ten minutes.  Each configureFsync() and configureDurability() setting, with and without the urgent and bulk lanes, is
+// reported with its write and sync counts, the flash it programs and erases, and per level the durability latency of its
+// records: how long each waited between being logged and the end of the sync that made it durable.  Every write and
+// sync is recorded through configureIoObserver(); --trace writes them out as CSV.
+//
+// Flash costs follow a simple model of a filesystem on SPI NOR: data is programmed in 256 byte units as they fill, a
+// sync also programs the partial unit (padded, and programmed again once it fills) plus a 256 byte metadata commit, each
+// unit takes --program-us and every 4 KB programmed costs an --erase-ms sector erase.  The model ranks policies; it
+// doesn't predict a particular device.
+//
+// Build:   make -C tools
+// Usage:   fslog_sim [--hours H] [--seed N] [--program-us US] [--erase-ms MS] [--trace FILE] > results.json
+
+#include "../src/FSLogHandler.h"
+#include "../src/FSLogStorage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#define SIM_TICK_MS         10      // Application loop() period
+#define SIM_DRAIN_S         120     // Idle time after the load, so every policy gets to sync what it holds
+#define SIM_UNIT            256     // Program unit
+#define SIM_SECTOR          4096    // Erase unit
+
+static const LogLevel _levels[] = { LOG_LEVEL_TRACE, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR };
+#define SIM_LEVELS (sizeof(_levels) / sizeof(_levels[0]))
+
+static uint32_t _program_us = 700;
+static uint32_t _erase_ms = 45;
+
+// Deterministic random numbers, the same on every host
+static uint64_t _seed = 1;
+
+static uint32_t nextRandom() {
+    _seed = _seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)(_seed >> 33);
+}
+
+// Number of arrivals in one tick for a rate in records per second
+static uint32_t arrivals(double per_second) {
+    double expected = per_second * SIM_TICK_MS / 1000;
+    uint32_t n = (uint32_t)expected;
+    return n + ((nextRandom() % 1000000) / 1000000.0 < expected - n ? 1 : 0);
+}
+
+// Records are tagged "#<id>;" so SimStorage can tell which ones each sync makes durable
+struct Record {
+    uint32_t logged_ms;
+    uint32_t durable_ms;
+    uint8_t level;                  // Index into _levels
+    bool durable;
+};
+
+/**
+ * @brief In-memory FSLogStorage that charges simulated flash time to the virtual clock and tracks record durability.
+ * Keeps no data, so read() finds nothing.
+ */
+class SimStorage : public FSLogStorage {
+public:
+    explicit SimStorage(std::vector<Record> &records) : appended(0), programmed(0), _records(records), _cached(0),
+            _erase_debt(0) {}
+
+    bool open() override {
+        return true;
+    }
+
+    int append(const void *data, size_t len) override {
+        const char *p = (const char *)data;
+        for (size_t i = 0; i < len; i++) {
+            scan(p[i]);
+        }
+        appended += len;
+        _cached += len;
+        uint32_t units = 0;
+        while (_cached >= SIM_UNIT) {
+            _cached -= SIM_UNIT;
+            units++;
+        }
+        program(units);
+        return (int)len;
+    }
+
+    int sync() override {
+        program(_cached ? 2 : 1);   // The padded partial unit, which stays cached, and the metadata commit
+        uint32_t now = millis();
+        for (uint32_t id : _unsynced) {
+            _records[id].durable = true;
+            _records[id].durable_ms = now;
+        }
+        _unsynced.clear();
+        return 0;
+    }
+
+    void close() override {
+        sync();
+    }
+
+    int read(uint64_t *position, uint8_t *data, size_t len) override {
+        (void)position;
+        (void)data;
+        (void)len;
+        return 0;
+    }
+
+    void clear() override {
+    }
+
+    long size() override {
+        return (long)appended;
+    }
+
+    uint64_t appended;              // Bytes appended
+    uint64_t programmed;            // Bytes programmed, including padding and metadata
+
+private:
+    std::vector<Record> &_records;
+    std::vector<uint32_t> _unsynced;    // Records appended since the last sync
+    size_t _cached;                 // Bytes in the partly filled program unit
+    uint32_t _erase_debt;           // Bytes programmed since the last erase
+    std::string _tag;               // Digits of the tag being scanned
+    bool _in_tag = false;
+
+    void program(uint32_t units) {
+        uint64_t us = (uint64_t)units * _program_us;
+        programmed += units * SIM_UNIT;
+        _erase_debt += units * SIM_UNIT;
+        while (_erase_debt >= SIM_SECTOR) {
+            _erase_debt -= SIM_SECTOR;
+            us += _erase_ms * 1000;
+        }
+        hostClockAdvance(us);
+    }
+
+    void scan(char c) {
+        if (c == '#') {
+            _in_tag = true;
+            _tag.clear();
+        } else if (_in_tag && c >= '0' && c <= '9') {
+            _tag += c;
+        } else if (_in_tag) {
+            uint32_t id = (uint32_t)strtoul(_tag.c_str(), nullptr, 10);
+            if (c == ';' && !_tag.empty() && id < _records.size()) {
+                _unsynced.push_back(id);
+            }
+            _in_tag = false;
+        }
+    }
+};
+
+struct Policy {
+    const char *name;
+    unsigned int max_bytes;         // configureFsync()
+    unsigned int timeout_s;
+    unsigned int durability_ms;     // configureDurability(), 0 for the thresholds
+    bool lanes;                     // ERROR on an urgent lane synced within 50 ms, TRACE on a bulk lane
+};
+
+static const Policy _policies[] = {
+    { "fsync", 512, 1, 0, false },
+    { "fsync", 4096, 10, 0, false },
+    { "fsync", 16384, 30, 0, false },
+    { "fsync", 65536, 60, 0, false },
+    { "durability", 4096, 10, 250, false },
+    { "durability", 4096, 10, 1000, false },
+    { "durability", 4096, 10, 5000, false },
+    { "fsync", 4096, 10, 0, true },
+    { "fsync", 65536, 60, 0, true },
+    { "durability", 4096, 10, 1000, true },
+};
+
+static FILE *_trace = nullptr;
+
+static void runPolicy(const Policy &policy, size_t index, double hours, uint64_t seed) {
+    std::vector<Record> records;
+    records.reserve((size_t)(hours * 3600 * 40) + 1024);
+    SimStorage storage(records);
+    _seed = seed;   // Same load, from the same time, for every policy
+    hostClockSet(1000000);
+
+    uint32_t writes = 0;
+    uint32_t fsyncs = 0;
+    uint64_t fsync_us = 0;
+    uint32_t start = millis();
+    auto wall = std::chrono::steady_clock::now();
+    {
+        FSLogHandler handler("sim", false, LOG_LEVEL_TRACE);
+        handler.configureStorage(&storage);
+        handler.configureFsync(policy.max_bytes, policy.timeout_s);
+        handler.configureDurability(policy.durability_ms);
+        handler.configureBuffer(16384);
+        if (policy.lanes) {
+            handler.configureUrgentLane(LOG_LEVEL_ERROR, 50, 4096);
+            handler.configureBulkLane(LOG_LEVEL_INFO, 16384);
+        }
+        handler.configureIoObserver([&](const FSLogHandler::IoEvent &event) {
+            if (event.type == FSLogHandler::IoEvent::WRITE) {
+                writes++;
+            } else {
+                fsyncs++;
+                fsync_us += event.us;
+            }
+            if (_trace) {
+                fprintf(_trace, "%u,%u,%s,%u,%u,%d\n", (unsigned)index, event.time_ms - start,
+                        event.type == FSLogHandler::IoEvent::WRITE ? "write" : "fsync", event.bytes, event.us, event.result);
+            }
+        });
+        handler.enable();
+
+        LogAttributes attr = {};
+        attr.size = sizeof(attr);
+        attr.has_time = 1;
+        char msg[96];
+        uint32_t load_ms = (uint32_t)(hours * 3600000);
+        uint32_t end_ms = load_ms + SIM_DRAIN_S * 1000;
+        for (uint32_t t = 0; t < end_ms; t += SIM_TICK_MS) {
+            // Ticks are on a fixed schedule; a loop() that spent longer in I/O delays the next one
+            uint32_t now = millis() - start;
+            if (now < t) {
+                hostClockAdvance((uint64_t)(t - now) * 1000);
+            }
+            if (t < load_ms) {
+                bool flood = t % 600000 < 10000;    // 10 s of TRACE at 500 records/s every 10 minutes
+                const double rates[SIM_LEVELS] = { flood ? 500.0 : 20.0, 2.0, 0.1, 0.01 };
+                for (size_t level = 0; level < SIM_LEVELS; level++) {
+                    for (uint32_t n = arrivals(rates[level]); n; n--) {
+                        uint32_t id = (uint32_t)records.size();
+                        attr.time = millis();
+                        records.push_back({ attr.time, 0, (uint8_t)level, false });
+                        snprintf(msg, sizeof(msg), "sensor=%u value=%u.%02u state=ok #%u;", nextRandom() % 64,
+                                nextRandom() % 1000, nextRandom() % 100, id);
+                        handler.message(msg, _levels[level], "app", attr);
+                    }
+                }
+            }
+            handler.loop();
+        }
+
+        FSLogHandler::Stats stats = handler.stats();
+        double wall_ms = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - wall).count() / 1000.0;
+        uint64_t erases = storage.programmed / SIM_SECTOR;
+
+        printf("%s\n    {\"name\": \"sim.%s\", \"max_bytes\": %u, \"timeout_s\": %u, \"durability_ms\": %u, \"lanes\": %s, "
+                "\"records\": %u, \"drops\": %u, \"writes\": %u, \"fsyncs\": %u, \"fsyncs_per_hour\": %.1f, "
+                "\"fsync_ms_total\": %.1f, \"bytes\": %llu, \"programmed_bytes\": %llu, \"write_amplification\": %.3f, "
+                "\"erases\": %llu, \"erases_per_hour\": %.1f, \"unsynced_ms_max\": %u, \"wall_ms\": %.1f, \"levels\": {",
+                index ? "," : "", policy.name, policy.max_bytes, policy.timeout_s, policy.durability_ms,
+                policy.lanes ? "true" : "false", (unsigned)records.size(), stats.drops, writes, fsyncs, fsyncs / hours,
+                fsync_us / 1000.0, (unsigned long long)storage.appended, (unsigned long long)storage.programmed,
+                storage.appended ? (double)storage.programmed / storage.appended : 0.0, (unsigned long long)erases,
+                erases / hours, stats.unsynced_ms_max, wall_ms);
+    }   // The handler's final sync makes the rest durable, but at the end of the run rather than by policy
+
+    for (size_t level = 0; level < SIM_LEVELS; level++) {
+        std::vector<uint32_t> latencies;
+        uint32_t lost = 0;
+        for (const Record &record : records) {
+            if (record.level != level) {
+                continue;
+            }
+            if (record.durable) {
+                latencies.push_back(record.durable_ms - record.logged_ms);
+            } else {
+                lost++;
+            }
+        }
+        std::sort(latencies.begin(), latencies.end());
+        uint64_t total = 0;
+        for (uint32_t latency : latencies) {
+            total += latency;
+        }
+        size_t n = latencies.size();
+        printf("%s\"%s\": {\"records\": %u, \"not_written\": %u, \"latency_ms_mean\": %.1f, \"latency_ms_p99\": %u, "
+                "\"latency_ms_max\": %u}", level ? ", " : "", LogHandler::levelName(_levels[level]), (unsigned)(n + lost),
+                lost, n ? (double)total / n : 0.0, n ? latencies[n * 99 / 100] : 0, n ? latencies[n - 1] : 0);
+    }
+    printf("}}");
+}
+
+int main(int argc, char **argv) {
+    double hours = 4;
+    uint64_t seed = 1;
+    const char *trace = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--hours") == 0 && i + 1 < argc) {
+            hours = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--program-us") == 0 && i + 1 < argc) {
+            _program_us = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--erase-ms") == 0 && i + 1 < argc) {
+            _erase_ms = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else {
+            fprintf(stderr, "usage: fslog_sim [--hours H] [--seed N] [--program-us US] [--erase-ms MS] [--trace FILE]\n");
+            return 1;
+        }
+    }
+    if (hours <= 0) {
+        fprintf(stderr, "fslog_sim: --hours must be positive\n");
+        return 1;
+    }
+    if (trace) {
+        _trace = fopen(trace, "w");
+        if (!_trace) {
+            perror("fslog_sim: trace file");
+            return 1;
+        }
+        fprintf(_trace, "policy,time_ms,event,bytes,us,result\n");
+    }
+
+    hostClockVirtual(true);
+    printf("{\n  \"tool\": \"fslog_sim\",\n  \"hours\": %.2f,\n  \"seed\": %llu,\n  \"results\": [", hours,
+            (unsigned long long)seed);
+    for (size_t i = 0; i < sizeof(_policies) / sizeof(_policies[0]); i++) {
+        runPolicy(_policies[i], i, hours, seed);
+    }
+    printf("\n  ]\n}\n");
+
+    if (_trace) {
+        fclose(_trace);
+    }
+    return 0;
+}
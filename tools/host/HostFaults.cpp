@@ -0,0 +1,178 @@
+// HostFaults.cpp: Filesystem fault injection for the host tools
+// Company: Particle
+
+#include "HostFaults.h"
+#include "Particle.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <mutex>
+#include <set>
+#include <string>
+
+static std::recursive_mutex _mutex;
+static int _error = 0;                      // hostFaultError()
+static std::set<int> _stale;                // hostFaultStale() descriptors not closed yet
+static bool _torn = false;                  // hostFaultTornWrites()
+static bool _torn_next = false;             // The last write was cut short, so this one fails
+static std::string _quota_dir;              // hostFaultQuota()
+static uint64_t _quota = 0;
+static uint32_t _fsync_ms = 0;              // hostFaultSlowFsync()
+static bool _cut_armed = false;             // hostFaultPowerCut()
+static uint64_t _cut_left = 0;              // Bytes until the power goes
+static bool _cut = false;                   // The power is off
+
+void hostFaultError(int error) {
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    _error = error;
+}
+
+void hostFaultStale() {
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    for (int fd = 3; fd < 1024; fd++) {
+        if (fcntl(fd, F_GETFD) != -1) {
+            _stale.insert(fd);
+        }
+    }
+}
+
+void hostFaultTornWrites() {
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    _torn = true;
+    _torn_next = false;
+}
+
+void hostFaultQuota(const char *dir, uint64_t bytes) {
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    _quota_dir = dir;
+    _quota = bytes;
+}
+
+void hostFaultSlowFsync(uint32_t ms) {
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    _fsync_ms = ms;
+}
+
+void hostFaultPowerCut(uint64_t bytes) {
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    _cut_armed = true;
+    _cut_left = bytes;
+    _cut = false;
+}
+
+bool hostFaultPowerIsCut() {
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    return _cut;
+}
+
+void hostFaultClear() {
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    _error = 0;
+    _stale.clear();
+    _torn = false;
+    _torn_next = false;
+    _quota = 0;
+    _fsync_ms = 0;
+    _cut_armed = false;
+    _cut = false;
+}
+
+// Bytes held by the files under path
+static uint64_t usage(const std::string &path) {
+    uint64_t total = 0;
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        std::string child = path + "/" + entry->d_name;
+        struct stat statbuf;
+        if (stat(child.c_str(), &statbuf) != 0) {
+            continue;
+        }
+        total += S_ISDIR(statbuf.st_mode) ? usage(child) : (uint64_t)statbuf.st_size;
+    }
+    closedir(dir);
+    return total;
+}
+
+// How much of a write of count bytes at the descriptor's position fits under the quota
+static size_t fits(int fd, size_t count) {
+    struct stat statbuf;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0 || fstat(fd, &statbuf) != 0) {
+        return count;
+    }
+    uint64_t end = (uint64_t)pos + count;
+    uint64_t grow_from = statbuf.st_size > pos ? (uint64_t)statbuf.st_size : (uint64_t)pos;
+    if (end <= grow_from) {
+        return count;   // Overwrites don't take space
+    }
+    uint64_t used = usage(_quota_dir);
+    uint64_t room = used < _quota ? _quota - used : 0;
+    return end - grow_from > room ? (size_t)(grow_from - pos + room) : count;
+}
+
+extern "C" ssize_t write(int fd, const void *buf, size_t count) {
+    if (fd > 2) {
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        if (_cut || _error || _stale.count(fd) || (_torn && _torn_next)) {
+            errno = _error && !_cut ? _error : EIO;
+            _torn_next = false;
+            return -1;
+        }
+        size_t n = count;
+        if (_quota) {
+            n = fits(fd, count);
+            if (!n && count) {
+                errno = ENOSPC;
+                return -1;
+            }
+        }
+        if (_torn && n > 1) {
+            n = (n + 1) / 2;
+            _torn_next = true;
+        }
+        if (_cut_armed && n >= _cut_left) {
+            n = (size_t)_cut_left;
+            _cut = true;
+            _cut_armed = false;
+        } else if (_cut_armed) {
+            _cut_left -= n;
+        }
+        if (!n && count) {
+            errno = EIO;
+            return -1;
+        }
+        count = n;
+    }
+    return (ssize_t)syscall(SYS_write, fd, buf, count);
+}
+
+extern "C" int fsync(int fd) {
+    if (fd > 2) {
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        if (_cut || _error || _stale.count(fd)) {
+            errno = _error && !_cut ? _error : EIO;
+            return -1;
+        }
+        if (_fsync_ms) {
+            hostClockAdvance((uint64_t)_fsync_ms * 1000);
+        }
+    }
+    return (int)syscall(SYS_fsync, fd);
+}
+
+extern "C" int close(int fd) {
+    {
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        _stale.erase(fd);
+    }
+    return (int)syscall(SYS_close, fd);
+}
@@ -0,0 +1,62 @@
+// HostFaults.h: Filesystem fault injection for the host tools
+// Company: Particle
+//
+// Linking HostFaults.cpp into a tool replaces write(), fsync() and close() with versions that fail on demand, so the
+// library's unchanged file code meets a full filesystem, I/O errors, torn writes, slow syncs and power cuts.  Only
+// descriptors above stderr are affected.  With no fault set the calls go straight to the kernel.  Faults last until
+// hostFaultClear().
+
+#ifndef __HOST_FAULTS_H
+#define __HOST_FAULTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Make every write() and fsync() fail with error, e.g. EIO
+ */
+void hostFaultError(int error);
+
+/**
+ * @brief Make the descriptors open now fail every write() and fsync() with EIO until they are closed, as after a
+ * filesystem remount.  Descriptors opened later work.
+ */
+void hostFaultStale();
+
+/**
+ * @brief Cut every write() short at half of what it asks for, and fail the call after it with EIO, like a transfer
+ * that times out part way
+ */
+void hostFaultTornWrites();
+
+/**
+ * @brief Limit the bytes that the files under dir may hold.  A write() that would go past the limit writes what fits
+ * and then fails with ENOSPC, the way a full filesystem does.
+ *
+ * @param dir Directory whose files (and subdirectories' files) count against the limit
+ * @param bytes Limit, 0 for none
+ */
+void hostFaultQuota(const char *dir, uint64_t bytes);
+
+/**
+ * @brief Make every fsync() take ms milliseconds of the virtual clock, see hostClockVirtual()
+ */
+void hostFaultSlowFsync(uint32_t ms);
+
+/**
+ * @brief Cut the power after bytes more are written: the write() that reaches the limit is torn there, and every
+ * write() and fsync() after it fails with EIO
+ */
+void hostFaultPowerCut(uint64_t bytes);
+
+/**
+ * @brief Check whether a power cut set with hostFaultPowerCut() has happened
+ */
+bool hostFaultPowerIsCut();
+
+/**
+ * @brief Remove all faults
+ */
+void hostFaultClear();
+
+#endif  // __HOST_FAULTS_H
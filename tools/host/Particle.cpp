@@ -0,0 +1,339 @@
+// Particle.cpp: POSIX stand-in for the parts of DeviceOS that FSLogHandler uses, for the host tools
+// Company: Particle
+
+#include "Particle.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+HostSerial Serial;
+ParticleClass Particle;
+SystemClass System;
+const Logger Log;
+
+// Clock
+
+static std::atomic<bool> _virtual_clock(false);
+static std::atomic<uint64_t> _virtual_us(0);
+
+static uint64_t clockUs() {
+    if (_virtual_clock) {
+        return _virtual_us;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t millis() {
+    return (uint32_t)(clockUs() / 1000);
+}
+
+uint32_t micros() {
+    return (uint32_t)clockUs();
+}
+
+void delay(uint32_t ms) {
+    if (_virtual_clock) {
+        _virtual_us += (uint64_t)ms * 1000;
+    } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    }
+}
+
+void hostClockVirtual(bool enable) {
+    if (enable && !_virtual_clock) {
+        _virtual_us = clockUs();
+    }
+    _virtual_clock = enable;
+}
+
+void hostClockAdvance(uint64_t us) {
+    _virtual_us += us;
+}
+
+void hostClockSet(uint64_t us) {
+    _virtual_us = us;
+}
+
+// Threads and synchronization
+
+int os_thread_create(os_thread_t *thread, const char *name, os_thread_prio_t priority, os_thread_fn_t fun, void *arg,
+        size_t stack_size) {
+    (void)name;
+    (void)priority;
+    (void)stack_size;
+    *thread = new std::thread(fun, arg);
+    return 0;
+}
+
+int os_thread_join(os_thread_t thread) {
+    ((std::thread *)thread)->join();
+    return 0;
+}
+
+int os_thread_cleanup(os_thread_t thread) {
+    delete (std::thread *)thread;
+    return 0;
+}
+
+int os_thread_exit(os_thread_t thread) {
+    (void)thread;   // Returning from the thread function ends the thread
+    return 0;
+}
+
+int os_thread_yield() {
+    std::this_thread::yield();
+    return 0;
+}
+
+bool os_thread_is_current(os_thread_t thread) {
+    return thread && ((std::thread *)thread)->get_id() == std::this_thread::get_id();
+}
+
+int os_mutex_create(os_mutex_t *mutex) {
+    *mutex = new std::mutex;
+    return 0;
+}
+
+int os_mutex_destroy(os_mutex_t mutex) {
+    delete (std::mutex *)mutex;
+    return 0;
+}
+
+int os_mutex_lock(os_mutex_t mutex) {
+    ((std::mutex *)mutex)->lock();
+    return 0;
+}
+
+int os_mutex_trylock(os_mutex_t mutex) {
+    return ((std::mutex *)mutex)->try_lock() ? 0 : 1;
+}
+
+int os_mutex_unlock(os_mutex_t mutex) {
+    ((std::mutex *)mutex)->unlock();
+    return 0;
+}
+
+namespace {
+
+struct Semaphore {
+    std::mutex mutex;
+    std::condition_variable cv;
+    unsigned count;
+    unsigned max;
+};
+
+}
+
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial) {
+    Semaphore *s = new Semaphore;
+    s->count = initial;
+    s->max = max;
+    *semaphore = s;
+    return 0;
+}
+
+int os_semaphore_destroy(os_semaphore_t semaphore) {
+    delete (Semaphore *)semaphore;
+    return 0;
+}
+
+// Waits in real time even with the virtual clock, as the writer thread does on the device
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool reserved) {
+    (void)reserved;
+    Semaphore *s = (Semaphore *)semaphore;
+    std::unique_lock<std::mutex> lock(s->mutex);
+    if (timeout == CONCURRENT_WAIT_FOREVER) {
+        s->cv.wait(lock, [s]() { return s->count > 0; });
+    } else if (!s->cv.wait_for(lock, std::chrono::milliseconds(timeout), [s]() { return s->count > 0; })) {
+        return 1;
+    }
+    s->count--;
+    return 0;
+}
+
+int os_semaphore_give(os_semaphore_t semaphore, bool reserved) {
+    (void)reserved;
+    Semaphore *s = (Semaphore *)semaphore;
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        if (s->count >= s->max) {
+            return 1;
+        }
+        s->count++;
+    }
+    s->cv.notify_one();
+    return 0;
+}
+
+// Wiring
+
+String String::format(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(nullptr, 0, format, args);
+    va_end(args);
+    if (len < 0) {
+        return String();
+    }
+    std::string s(len + 1, '\0');
+    va_start(args, format);
+    vsnprintf(&s[0], s.size(), format, args);
+    va_end(args);
+    s.resize(len);
+    return String(s);
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--) {
+        n += write(*buffer++);
+    }
+    return n;
+}
+
+size_t Print::vprintf(bool newline, const char *format, va_list args) {
+    char buf[256];
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(buf, sizeof(buf), format, copy);
+    va_end(copy);
+    if (len < 0) {
+        return 0;
+    }
+    size_t n;
+    if ((size_t)len < sizeof(buf)) {
+        n = write((const uint8_t *)buf, len);
+    } else {
+        std::vector<char> big(len + 1);
+        vsnprintf(big.data(), big.size(), format, args);
+        n = write((const uint8_t *)big.data(), len);
+    }
+    return newline ? n + write("\r\n") : n;
+}
+
+size_t Print::printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    size_t n = vprintf(false, format, args);
+    va_end(args);
+    return n;
+}
+
+size_t Print::printlnf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    size_t n = vprintf(true, format, args);
+    va_end(args);
+    return n;
+}
+
+size_t HostSerial::write(uint8_t c) {
+    return fputc(c, stderr) == EOF ? 0 : 1;
+}
+
+size_t HostSerial::write(const uint8_t *buffer, size_t size) {
+    return fwrite(buffer, 1, size, stderr);
+}
+
+// Logging
+
+LogHandler::LogHandler(LogLevel level, LogCategoryFilters filters) : _level(level), _filters(filters) {
+}
+
+const char *LogHandler::levelName(LogLevel level) {
+    switch (level) {
+    case LOG_LEVEL_TRACE:
+        return "TRACE";
+    case LOG_LEVEL_INFO:
+        return "INFO";
+    case LOG_LEVEL_WARN:
+        return "WARN";
+    case LOG_LEVEL_ERROR:
+        return "ERROR";
+    case LOG_LEVEL_PANIC:
+        return "PANIC";
+    default:
+        return "";
+    }
+}
+
+// The most specific filter whose category is a dot-separated prefix of the record's category sets the level
+void LogHandler::message(const char *msg, LogLevel level, const char *category, const LogAttributes &attr) {
+    LogLevel threshold = _level;
+    size_t best = 0;
+    for (const LogCategoryFilter &filter : _filters) {
+        size_t len = strlen(filter.category());
+        if (category && len > best && strncmp(category, filter.category(), len) == 0 &&
+                (category[len] == 0 || category[len] == '.')) {
+            threshold = filter.level();
+            best = len;
+        }
+    }
+    if (level >= threshold) {
+        logMessage(msg, level, category, attr);
+    }
+}
+
+LogManager *LogManager::instance() {
+    static LogManager manager;
+    return &manager;
+}
+
+bool LogManager::addHandler(LogHandler *handler) {
+    for (LogHandler *h : _handlers) {
+        if (h == handler) {
+            return false;
+        }
+    }
+    _handlers.push_back(handler);
+    return true;
+}
+
+void LogManager::removeHandler(LogHandler *handler) {
+    for (size_t i = 0; i < _handlers.size(); i++) {
+        if (_handlers[i] == handler) {
+            _handlers.erase(_handlers.begin() + i);
+            return;
+        }
+    }
+}
+
+void LogManager::message(const char *msg, LogLevel level, const char *category, const LogAttributes &attr) {
+    for (LogHandler *handler : _handlers) {
+        handler->message(msg, level, category, attr);
+    }
+}
+
+void Logger::vlog(LogLevel level, const char *format, va_list args) const {
+    char msg[256];
+    vsnprintf(msg, sizeof(msg), format, args);
+    LogAttributes attr = {};
+    attr.size = sizeof(attr);
+    attr.time = millis();
+    attr.has_time = 1;
+    LogManager::instance()->message(msg, level, _name, attr);
+}
+
+#define LOGGER_METHOD(name, level) \
+    void Logger::name(const char *format, ...) const { \
+        va_list args; \
+        va_start(args, format); \
+        vlog(level, format, args); \
+        va_end(args); \
+    }
+
+LOGGER_METHOD(trace, LOG_LEVEL_TRACE)
+LOGGER_METHOD(info, LOG_LEVEL_INFO)
+LOGGER_METHOD(warn, LOG_LEVEL_WARN)
+LOGGER_METHOD(error, LOG_LEVEL_ERROR)
+
+void Logger::log(LogLevel level, const char *format, ...) const {
+    va_list args;
+    va_start(args, format);
+    vlog(level, format, args);
+    va_end(args);
+}
@@ -0,0 +1,267 @@
+// Particle.h: POSIX stand-in for the parts of DeviceOS that FSLogHandler uses, for the host tools
+// Company: Particle
+//
+// Lets the library sources build unchanged on Linux, see tools/Makefile.  Threads, mutexes and semaphores
+// map onto the standard library, the logging framework onto a small LogManager that hands messages to its handlers,
+// and the DeviceOS filesystem onto the host's.  Logfiles go to FS_LOG_HANDLER_DIR, which is relative here, so a tool
+// that chdir()s into a scratch directory gets a private log directory.
+//
+// millis() and micros() run from the host's monotonic clock, or from a virtual clock after hostClockVirtual(true), in
+// which case delay() advances the clock instead of sleeping and timing decisions replay exactly.
+
+#ifndef __PARTICLE_HOST_H
+#define __PARTICLE_HOST_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#define FS_LOG_HANDLER_DIR "log"
+
+typedef off_t _off_t;
+
+#if !(defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 38)))
+inline size_t strlcpy(char *dst, const char *src, size_t size) {
+    size_t len = strlen(src);
+    if (size) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = 0;
+    }
+    return len;
+}
+#endif
+
+// Clock
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+inline void HAL_Delay_Milliseconds(uint32_t ms) { delay(ms); }
+inline bool HAL_IsISR() { return false; }
+inline bool system_thread_current(void *reserved) { (void)reserved; return false; }
+
+/**
+ * @brief Switch millis() and micros() between the host clock and a virtual clock that only moves when advanced
+ */
+void hostClockVirtual(bool enable);
+
+/**
+ * @brief Move the virtual clock forward
+ */
+void hostClockAdvance(uint64_t us);
+
+/**
+ * @brief Set the virtual clock, so that a replay starts from the same time on every run
+ */
+void hostClockSet(uint64_t us);
+
+// Threads and synchronization, with the DeviceOS signatures.  Functions return 0 on success.
+
+typedef void *os_thread_t;
+typedef void *os_mutex_t;
+typedef void *os_semaphore_t;
+typedef uint8_t os_thread_prio_t;
+typedef void (*os_thread_fn_t)(void *param);
+typedef uint32_t system_tick_t;
+
+#define OS_THREAD_PRIORITY_DEFAULT 2
+#define OS_THREAD_STACK_SIZE_DEFAULT 3072
+#define CONCURRENT_WAIT_FOREVER ((system_tick_t)-1)
+
+int os_thread_create(os_thread_t *thread, const char *name, os_thread_prio_t priority, os_thread_fn_t fun, void *arg,
+        size_t stack_size);
+int os_thread_join(os_thread_t thread);
+int os_thread_cleanup(os_thread_t thread);
+int os_thread_exit(os_thread_t thread);
+int os_thread_yield();
+bool os_thread_is_current(os_thread_t thread);
+
+int os_mutex_create(os_mutex_t *mutex);
+int os_mutex_destroy(os_mutex_t mutex);
+int os_mutex_lock(os_mutex_t mutex);
+int os_mutex_trylock(os_mutex_t mutex);
+int os_mutex_unlock(os_mutex_t mutex);
+
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial);
+int os_semaphore_destroy(os_semaphore_t semaphore);
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool reserved);
+int os_semaphore_give(os_semaphore_t semaphore, bool reserved);
+
+// Wiring
+
+class String {
+public:
+    String() {}
+    String(const char *s) : _s(s ? s : "") {}
+    String(const std::string &s) : _s(s) {}
+    explicit String(int value) : _s(std::to_string(value)) {}
+    explicit String(unsigned int value) : _s(std::to_string(value)) {}
+
+    const char *c_str() const { return _s.c_str(); }
+    operator const char *() const { return _s.c_str(); }
+    unsigned int length() const { return (unsigned int)_s.size(); }
+    bool concat(const char *s) { _s += s; return true; }
+    bool concat(const String &s) { _s += s._s; return true; }
+    bool concat(char c) { _s += c; return true; }
+    String &operator+=(const char *s) { _s += s; return *this; }
+    String operator+(const String &s) const { return String(_s + s._s); }
+    String operator+(const char *s) const { return String(_s + s); }
+    friend String operator+(const char *a, const String &b) { return String(std::string(a) + b._s); }
+    bool operator==(const char *s) const { return _s == s; }
+    bool operator!=(const char *s) const { return _s != s; }
+
+    static String format(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+private:
+    std::string _s;
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+
+    size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+    size_t print(const char *str) { return write(str); }
+    size_t println(const char *str) { return write(str) + write("\r\n"); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    size_t printlnf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    int getWriteError() { return _write_error; }
+    void clearWriteError() { setWriteError(0); }
+
+protected:
+    void setWriteError(int err = 1) { _write_error = err; }
+
+private:
+    size_t vprintf(bool newline, const char *format, va_list args);
+
+    int _write_error = 0;
+};
+
+// Writes to stderr, so tools can keep stdout for their results
+class HostSerial : public Print {
+public:
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+};
+extern HostSerial Serial;
+
+class ParticleClass {
+public:
+    void process() {}
+};
+extern ParticleClass Particle;
+
+class SystemClass {
+public:
+    uint32_t uptime() { return millis() / 1000; }
+};
+extern SystemClass System;
+
+// Logging
+
+typedef enum LogLevel {
+    LOG_LEVEL_ALL = 1,
+    LOG_LEVEL_TRACE = 1,
+    LOG_LEVEL_INFO = 30,
+    LOG_LEVEL_WARN = 40,
+    LOG_LEVEL_ERROR = 50,
+    LOG_LEVEL_PANIC = 60,
+    LOG_LEVEL_NONE = 70
+} LogLevel;
+
+typedef struct LogAttributes {
+    size_t size;
+    const char *file;
+    int line;
+    const char *function;
+    uint32_t time;
+    intptr_t code;
+    const char *details;
+    unsigned has_file: 1;
+    unsigned has_line: 1;
+    unsigned has_function: 1;
+    unsigned has_time: 1;
+    unsigned has_code: 1;
+    unsigned has_details: 1;
+} LogAttributes;
+
+class LogCategoryFilter {
+public:
+    LogCategoryFilter(const char *category, LogLevel level) : _category(category), _level(level) {}
+    const char *category() const { return _category.c_str(); }
+    LogLevel level() const { return _level; }
+
+private:
+    std::string _category;
+    LogLevel _level;
+};
+
+class LogCategoryFilters : public std::vector<LogCategoryFilter> {
+public:
+    LogCategoryFilters() {}
+    LogCategoryFilters(std::initializer_list<LogCategoryFilter> filters) : std::vector<LogCategoryFilter>(filters) {}
+    int size() const { return (int)std::vector<LogCategoryFilter>::size(); }
+};
+
+class LogHandler {
+public:
+    explicit LogHandler(LogLevel level = LOG_LEVEL_INFO, LogCategoryFilters filters = {});
+    virtual ~LogHandler() {}
+
+    LogLevel level() const { return _level; }
+    static const char *levelName(LogLevel level);
+
+    // Filters by level and category the way DeviceOS does, then calls logMessage()
+    void message(const char *msg, LogLevel level, const char *category, const LogAttributes &attr);
+
+protected:
+    virtual void logMessage(const char *msg, LogLevel level, const char *category, const LogAttributes &attr) = 0;
+
+private:
+    LogLevel _level;
+    LogCategoryFilters _filters;
+};
+
+class LogManager {
+public:
+    static LogManager *instance();
+    bool addHandler(LogHandler *handler);
+    void removeHandler(LogHandler *handler);
+    void message(const char *msg, LogLevel level, const char *category, const LogAttributes &attr);
+
+private:
+    std::vector<LogHandler *> _handlers;
+};
+
+class Logger {
+public:
+    explicit Logger(const char *name = "app") : _name(name) {}
+
+    void trace(const char *format, ...) const __attribute__((format(printf, 2, 3)));
+    void info(const char *format, ...) const __attribute__((format(printf, 2, 3)));
+    void warn(const char *format, ...) const __attribute__((format(printf, 2, 3)));
+    void error(const char *format, ...) const __attribute__((format(printf, 2, 3)));
+    void log(LogLevel level, const char *format, ...) const __attribute__((format(printf, 3, 4)));
+
+private:
+    void vlog(LogLevel level, const char *format, va_list args) const;
+
+    const char *_name;
+};
+extern const Logger Log;
+
+#endif /* __PARTICLE_HOST_H */